@@ -37,6 +37,9 @@
 #include "errors.h"
 #include "endianness.h"
 #include "deviceio.h"
+#include "misc.h"
+#include "partition.h"
+#include "fat12.h"
 #include "mallocv.h"
 
 // used to check if device is mounted
@@ -229,13 +232,8 @@ int32_t read_bootsector(DEVICE *device, struct sBootSector *bs) {
 	assert(device != NULL);
 	assert(bs != NULL);
 
-	// seek to beginning of fs
-	if (device_seekset(device, 0) == -1) {
-		stderror();
-		return -1;
-	}
-
-  ret=device_read(device, bs, 1, sizeof(struct sBootSector));
+	// read from beginning of fs
+	ret=device_pread(device, bs, sizeof(struct sBootSector), 0);
 	if (ret == -1) {
 		myerror("Failed to read from device!");
 		return -1;
@@ -267,12 +265,7 @@ int32_t checkVbrCecksum(struct sFileSystem *fs) {
 	for (j=0; j<12; j++) {
 
 		// read sector j
-		if (device_seekset(fs->device, j * fs->sectorSize) == -1) {
-			stderror();
-			return -1;
-		}
-
-		if (device_read(fs->device, sector, fs->sectorSize, 1) < 1) {
+		if (device_pread(fs->device, sector, fs->sectorSize, (int64_t) j * fs->sectorSize) < fs->sectorSize) {
 			stderror();
 			return -1;
 		}
@@ -303,28 +296,17 @@ int32_t writeBootSector(struct sFileSystem *fs) {
 	write boot sector
 */
 
-	// seek to beginning of fs
-	if (device_seekset(fs->device, 0) == -1) {
-		stderror();
-		return -1;
-	}
-
-	// write boot sector
-	if (device_write(fs->device, &(fs->bs), sizeof(struct sBootSector), 1) < 1) {
+	// write boot sector to beginning of fs
+	if (device_pwrite(fs->device, &(fs->bs), sizeof(struct sBootSector), 0) < (int64_t) sizeof(struct sBootSector)) {
 		stderror();
 		return -1;
 	}
 
 	//  update backup boot sector for FAT32 file systems
 	if (fs->FATType == FATTYPE_FAT32) {
-		// seek to beginning of backup boot sector
-		if (device_seekset(fs->device, SwapInt16(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_BkBootSec) * fs->sectorSize) == -1) {
-			stderror();
-			return -1;
-		}
-
 		// write backup boot sector
-		if (device_write(fs->device, &(fs->bs), sizeof(struct sBootSector), 1) < 1) {
+		if (device_pwrite(fs->device, &(fs->bs), sizeof(struct sBootSector),
+			(int64_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_BkBootSec) * fs->sectorSize) < (int64_t) sizeof(struct sBootSector)) {
 			stderror();
 			return -1;
 		}
@@ -341,15 +323,9 @@ int32_t readFSInfo(struct sFileSystem *fs, struct sFSInfo *fsInfo) {
 	assert(fs != NULL);
 	assert(fsInfo != NULL);
 
-	// seek to beginning of FSInfo structure
-
-	if (device_seekset(fs->device, SwapInt16(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_FSInfo) * fs->sectorSize) == -1) {
-
-		stderror();
-		return -1;
-	}
-
-	if (device_read(fs->device, fsInfo, sizeof(struct sFSInfo), 1) < 1) {
+	// read from beginning of FSInfo structure
+	if (device_pread(fs->device, fsInfo, sizeof(struct sFSInfo),
+		(int64_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_FSInfo) * fs->sectorSize) < (int64_t) sizeof(struct sFSInfo)) {
 		stderror();
 		return -1;
 	}
@@ -364,16 +340,9 @@ int32_t writeFSInfo(struct sFileSystem *fs, struct sFSInfo *fsInfo) {
 	assert(fs != NULL);
 	assert(fsInfo != NULL);
 
-	// seek to beginning of FSInfo structure
-
-	if (device_seekset(fs->device, SwapInt16(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_FSInfo) * fs->sectorSize) == -1) {
-
-		stderror();
-		return -1;
-	}
-
-	// write fsInfo
-	if (device_write(fs->device, fsInfo, sizeof(struct sFSInfo), 1) < 1) {
+	// write fsInfo to beginning of FSInfo structure
+	if (device_pwrite(fs->device, fsInfo, sizeof(struct sFSInfo),
+		(int64_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_FSInfo) * fs->sectorSize) < (int64_t) sizeof(struct sFSInfo)) {
 		stderror();
 		return -1;
 	}
@@ -454,19 +423,9 @@ uint16_t isEOC(struct sFileSystem *fs, const uint32_t data) {
 */
 
 	assert(fs != NULL);
+	assert(fs->isEOC != NULL);
 
-	if(fs->FATType == FATTYPE_FAT12) {
-	    if(data >= 0x0FF8)
-		return 1;
-	} else if(fs->FATType == FATTYPE_FAT16) {
-	    if(data >= 0xFFF8)
-		return 1;
-	} else if (fs->FATType == FATTYPE_FAT32) {
-	    if((data & 0x0FFFFFFF) >= 0x0FFFFFF8)
-		return 1;
-	}
-
-	return 0;
+	return fs->isEOC(data);
 }
 
 uint16_t isBadCluster(struct sFileSystem *fs, const uint32_t data) {
@@ -474,19 +433,9 @@ uint16_t isBadCluster(struct sFileSystem *fs, const uint32_t data) {
 	checks whether data marks a bad cluster
 */
 	assert(fs != NULL);
+	assert(fs->isBadCluster != NULL);
 
-	if(fs->FATType == FATTYPE_FAT12) {
-	    if(data == 0xFF7)
-		return 1;
-	} else if(fs->FATType == FATTYPE_FAT16) {
-	    if(data == 0xFFF7)
-		return 1;
-	} else if (fs->FATType == FATTYPE_FAT32) {
-	    if ((data & 0x0FFFFFFF) == 0x0FFFFFF7)
-		return 1;
-	}
-
-	return 0;
+	return fs->isBadCluster(data);
 }
 
 
@@ -510,12 +459,7 @@ void *readFAT(struct sFileSystem *fs, uint16_t nr) {
 		return NULL;
 	}
 	BSOffset = (off_t)SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) * SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec);
-	if (device_seekset(fs->device, BSOffset + nr * FATSizeInBytes) == -1) {
-		myerror("Seek error!");
-		free(FAT);
-		return NULL;
-	}
-	if (device_read(fs->device, FAT, FATSizeInBytes, 1) < 1) {
+	if (device_pread(fs->device, FAT, FATSizeInBytes, BSOffset + (off_t) nr * FATSizeInBytes) < FATSizeInBytes) {
 		myerror("Failed to read from file!");
 		free(FAT);
 		return NULL;
@@ -542,12 +486,8 @@ int32_t writeFAT(struct sFileSystem *fs, void *fat) {
 
 	// write all FATs!
 	for(nr=0; nr< fs->bs.xxFATxx.FAT12_16_32.BS_NumFATs; nr++) {
-		if (device_seekset(fs->device, BSOffset + nr * FATSizeInBytes) == -1) {
-			myerror("Seek error!");
-			return -1;
-		}
-		if (device_write(fs->device, fat, FATSizeInBytes, 1) < 1) {
-			myerror("Failed to read from file!");
+		if (device_pwrite(fs->device, fat, FATSizeInBytes, BSOffset + (off_t) nr * FATSizeInBytes) < FATSizeInBytes) {
+			myerror("Failed to write to file!");
 			return -1;
 		}
 	}
@@ -555,6 +495,20 @@ int32_t writeFAT(struct sFileSystem *fs, void *fat) {
 	return 0;
 }
 
+static uint32_t getFATEntryOfByte(struct sFileSystem *fs, uint64_t offset) {
+/*
+	returns the cluster whose FAT entry contains the byte at offset in the FAT
+*/
+	switch(fs->FATType) {
+	case FATTYPE_FAT12:
+		return (uint32_t) (offset * 2 / 3);
+	case FATTYPE_FAT16:
+		return (uint32_t) (offset / 2);
+	default:
+		return (uint32_t) (offset / 4);
+	}
+}
+
 int32_t checkFATs(struct sFileSystem *fs) {
 /*
 	checks whether all FATs have the same content
@@ -562,69 +516,390 @@ int32_t checkFATs(struct sFileSystem *fs) {
 
 	assert(fs != NULL);
 
-	uint32_t FATSizeInBytes;
+	uint64_t FATSizeInBytes, pos, len, first, last;
+	struct sDeviceRange *ranges;
 	int32_t result=0;
-	int32_t i;
-
-	off_t BSOffset;
+	uint32_t i;
 
-	char *FAT1, *FATx;
+	char *FAT1=NULL, *FATx=NULL, *buf1=NULL, *bufx=NULL;
 
 	// if there is just one FAT, we don't have to check anything
 	if (fs->FATCount < 2) {
 		return 0;
 	}
 
-	FATSizeInBytes = fs->FATSize * fs->sectorSize;
+	FATSizeInBytes = (uint64_t) fs->FATSize * fs->sectorSize;
 
-	if ((FAT1=malloc(FATSizeInBytes))==NULL) {
+	// FATs are compared chunk by chunk, so memory use does not grow with the FAT
+	ranges=malloc(sizeof(struct sDeviceRange) * fs->FATCount);
+	buf1=malloc(FAT_COMPARE_CHUNK_SIZE);
+	bufx=malloc(FAT_COMPARE_CHUNK_SIZE);
+	if ((ranges == NULL) || (buf1 == NULL) || (bufx == NULL)) {
 		stderror();
+		free(ranges);
+		free(buf1);
+		free(bufx);
 		return -1;
 	}
-	if ((FATx=malloc(FATSizeInBytes))==NULL) {
+
+	for (pos=0; (pos < FATSizeInBytes) && !result; pos+=len) {
+		len=FATSizeInBytes - pos;
+		if (len > FAT_COMPARE_CHUNK_SIZE) len=FAT_COMPARE_CHUNK_SIZE;
+
+		// the next chunk of every FAT is read ahead while this one is compared
+		if (pos + len < FATSizeInBytes) {
+			for (i=0; i < fs->FATCount; i++) {
+				ranges[i].offset=(int64_t) (fs->FATOffset + i * FATSizeInBytes + pos + len);
+				ranges[i].size=FATSizeInBytes - pos - len;
+				if (ranges[i].size > FAT_COMPARE_CHUNK_SIZE) ranges[i].size=FAT_COMPARE_CHUNK_SIZE;
+			}
+			device_advise(fs->device, ranges, fs->FATCount);
+		}
+
+		// memory mapped FATs are compared in place
+		if ((FAT1=device_map(fs->device, fs->FATOffset + pos, len)) == NULL) {
+			FAT1=buf1;
+			if (device_pread(fs->device, FAT1, len, fs->FATOffset + pos) < (int64_t) len) {
+				myerror("Failed to read from file!");
+				result=-1;
+				break;
+			}
+		}
+
+		for (i=1; i < fs->FATCount; i++) {
+			if ((FATx=device_map(fs->device, fs->FATOffset + i * FATSizeInBytes + pos, len)) == NULL) {
+				FATx=bufx;
+				if (device_pread(fs->device, FATx, len, fs->FATOffset + i * FATSizeInBytes + pos) < (int64_t) len) {
+					myerror("Failed to read from file!");
+					result=-1;
+					break;
+				}
+			}
+
+			if (memcmp(FAT1, FATx, len) != 0) {
+				// FATs don't match, report the differing entries of this chunk
+				for (first=0; FAT1[first] == FATx[first]; first++);
+				for (last=len-1; FAT1[last] == FATx[last]; last--);
+				myerror("FAT %u differs from FAT 1 in entries of clusters %u to %u!", i+1,
+					getFATEntryOfByte(fs, pos + first), getFATEntryOfByte(fs, pos + last));
+				result=1;
+				break;
+			}
+		}
+	}
+
+	free(ranges);
+	free(buf1);
+	free(bufx);
+
+	return result;
+}
+
+static void freeFATCache(struct sFileSystem *fs) {
+/*
+	frees the FAT cache
+*/
+	assert(fs != NULL);
+
+	uint32_t i;
+
+	if (fs->FATCache == NULL) return;
+
+	for (i=0; i<fs->FATCache->pageCount; i++) {
+		free(fs->FATCache->pages[i]);
+	}
+	free(fs->FATCache->pages);
+	free(fs->FATCache->ring);
+	free(fs->FATCache);
+	fs->FATCache=NULL;
+}
+
+int32_t setFATCache(struct sFileSystem *fs, uint64_t maxSize) {
+/*
+	keeps up to maxSize bytes of the FAT in memory, the whole FAT if it fits
+*/
+	assert(fs != NULL);
+
+	struct sFATCache *cache;
+
+	freeFATCache(fs);
+
+	// FAT12 tables are small and unpacked as a whole when they are first used
+	if (!maxSize || !fs->FATSize || (fs->FATType == FATTYPE_FAT12)) return 0;
+
+	if ((cache=malloc(sizeof(struct sFATCache))) == NULL) {
 		stderror();
-		free(FAT1);
 		return -1;
 	}
-	BSOffset = (off_t)SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) * SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec);
-	if (device_seekset(fs->device, BSOffset) == -1) {
-		myerror("Seek error!");
-		free(FAT1);
-		free(FATx);
+
+	cache->offset = fs->FATOffset;
+	cache->size = (uint64_t) fs->FATSize * fs->sectorSize;
+
+	// a FAT that fits is read with one request, larger ones are paged in on demand
+	if ((cache->size <= maxSize) && (cache->size <= UINT32_MAX - 4)) {
+		cache->pageSize = (uint32_t) cache->size;
+	} else {
+		cache->pageSize = FAT_CACHE_PAGE_SIZE;
+	}
+	cache->pageCount = (uint32_t) ((cache->size + cache->pageSize - 1) / cache->pageSize);
+	if (maxSize / cache->pageSize >= cache->pageCount) {
+		cache->maxPages = cache->pageCount;
+	} else if (maxSize < cache->pageSize) {
+		cache->maxPages = 1;
+	} else {
+		cache->maxPages = (uint32_t) (maxSize / cache->pageSize);
+	}
+	cache->resident = 0;
+	cache->next = 0;
+	cache->loads = 0;
+
+	cache->pages=malloc(sizeof(char *) * cache->pageCount);
+	cache->ring=malloc(sizeof(uint32_t) * cache->maxPages);
+	if ((cache->pages == NULL) || (cache->ring == NULL)) {
+		stderror();
+		free(cache->pages);
+		free(cache->ring);
+		free(cache);
 		return -1;
 	}
-	if (device_read(fs->device, FAT1, FATSizeInBytes, 1) < 1) {
-		myerror("Failed to read from file!");
-		free(FAT1);
-		free(FATx);
+	memset(cache->pages, 0, sizeof(char *) * cache->pageCount);
+
+	fs->FATCache=cache;
+
+	return 0;
+}
+
+static char *getFATCachePage(struct sFileSystem *fs, uint32_t nr) {
+/*
+	returns page nr of the FAT cache, reading it from the device if necessary
+*/
+	assert(fs != NULL);
+	assert(fs->FATCache != NULL);
+
+	struct sFATCache *cache=fs->FATCache;
+	uint64_t start=(uint64_t) nr * cache->pageSize, len;
+	uint32_t slot;
+	char *page;
+
+	if (cache->pages[nr] != NULL) return cache->pages[nr];
+
+	// pages also hold the first bytes of the next one, so FAT12 entries never cross their end
+	len=cache->size - start;
+	if (len > (uint64_t) cache->pageSize + 4) len=(uint64_t) cache->pageSize + 4;
+
+	if (cache->resident < cache->maxPages) {
+		slot=cache->resident++;
+		page=NULL;
+	} else {
+		// evict the page that was loaded first
+		slot=cache->next;
+		cache->next=(cache->next + 1) % cache->maxPages;
+		page=NULL;
+		if (cache->ring[slot] != UINT32_MAX) {
+			page=cache->pages[cache->ring[slot]];
+			cache->pages[cache->ring[slot]]=NULL;
+		}
+	}
+	cache->ring[slot]=UINT32_MAX;
+
+	if ((page == NULL) && ((page=malloc(cache->pageSize + 4)) == NULL)) {
+		stderror();
+		return NULL;
+	}
+
+	if (device_pread(fs->device, page, len, cache->offset + (off_t) start) < (int64_t) len) {
+		myerror("Failed to read FAT!");
+		free(page);
+		return NULL;
+	}
+
+	cache->loads++;
+	cache->ring[slot]=nr;
+	cache->pages[nr]=page;
+
+	return page;
+}
+
+static int32_t readFATBytes(struct sFileSystem *fs, off_t offset, void *data, uint32_t len) {
+/*
+	reads len bytes of the FAT at device offset from the mapping, the FAT cache or the device
+*/
+	assert(fs != NULL);
+	assert(data != NULL);
+
+	struct sFATCache *cache=fs->FATCache;
+	uint64_t pos;
+	char *page;
+	void *entry;
+
+	// FAT of memory mapped images is accessed directly
+	if ((entry=device_map(fs->device, offset, len)) != NULL) {
+		memcpy(data, entry, len);
+		return 0;
+	}
+
+	if ((cache != NULL) && (offset >= cache->offset) && ((uint64_t) (offset - cache->offset) + len <= cache->size)) {
+		pos=(uint64_t) (offset - cache->offset);
+		if ((page=getFATCachePage(fs, (uint32_t) (pos / cache->pageSize))) == NULL) return -1;
+		memcpy(data, page + pos % cache->pageSize, len);
+		return 0;
+	}
+
+	if (device_pread(fs->device, data, len, offset) < len) return -1;
+
+	return 0;
+}
+
+static uint16_t isFAT12EOC(const uint32_t data) {
+/*
+	checks whether data marks the end of a FAT12 cluster chain
+*/
+	return data >= 0x0FF8;
+}
+
+static uint16_t isFAT16EOC(const uint32_t data) {
+/*
+	checks whether data marks the end of a FAT16 cluster chain
+*/
+	return data >= 0xFFF8;
+}
+
+static uint16_t isFAT32EOC(const uint32_t data) {
+/*
+	checks whether data marks the end of a FAT32 cluster chain
+*/
+	return (data & 0x0FFFFFFF) >= 0x0FFFFFF8;
+}
+
+static uint16_t isExFATEOC(const uint32_t data) {
+/*
+	checks whether data marks the end of a exFAT cluster chain
+*/
+	return data >= 0xFFFFFFF8;
+}
+
+static uint16_t isFAT12BadCluster(const uint32_t data) {
+/*
+	checks whether data marks a bad FAT12 cluster
+*/
+	return data == 0x0FF7;
+}
+
+static uint16_t isFAT16BadCluster(const uint32_t data) {
+/*
+	checks whether data marks a bad FAT16 cluster
+*/
+	return data == 0xFFF7;
+}
+
+static uint16_t isFAT32BadCluster(const uint32_t data) {
+/*
+	checks whether data marks a bad FAT32 cluster
+*/
+	return (data & 0x0FFFFFFF) == 0x0FFFFFF7;
+}
+
+static uint16_t isExFATBadCluster(const uint32_t data) {
+/*
+	checks whether data marks a bad exFAT cluster
+*/
+	return data == 0xFFFFFFF7;
+}
+
+static int32_t loadFAT12(struct sFileSystem *fs) {
+/*
+	reads the first FAT of a FAT12 file system at once and unpacks all of its entries
+*/
+	assert(fs != NULL);
+
+	uint64_t size=(uint64_t) fs->FATSize * fs->sectorSize;
+	uint32_t count=(uint32_t) (size * 2 / 3);
+	uint16_t *entries;
+	uint8_t *packed;
+
+	if ((entries=malloc(sizeof(uint16_t) * count)) == NULL) {
+		stderror();
 		return -1;
 	}
 
-	for(i=1; i < fs->FATCount; i++) {
-		if (device_seekset(fs->device, BSOffset+FATSizeInBytes) == -1) {
-			myerror("Seek error!");
-			free(FAT1);
-			free(FATx);
+	if ((packed=device_map(fs->device, fs->FATOffset, size)) != NULL) {
+		unpackFAT12(packed, entries, count);
+	} else {
+		if ((packed=malloc(size)) == NULL) {
+			stderror();
+			free(entries);
 			return -1;
 		}
-		if (device_read(fs->device, FATx, FATSizeInBytes, 1) < 1) {
-			myerror("Failed to read from file!");
-			free(FAT1);
-			free(FATx);
+		if (device_pread(fs->device, packed, size, fs->FATOffset) < (int64_t) size) {
+			myerror("Failed to read FAT!");
+			free(packed);
+			free(entries);
 			return -1;
 		}
+		unpackFAT12(packed, entries, count);
+		free(packed);
+	}
 
-		//printf("FAT1: %08lx FATx: %08lx\n", FAT1[0], FATx[0]);
+	fs->FAT12=entries;
+	fs->FAT12Entries=count;
 
-		result = memcmp(FAT1, FATx, FATSizeInBytes) != 0;
-		if (result) break; // FATs don't match
+	return 0;
+}
+
+static inline int32_t getFAT12Entry(struct sFileSystem *fs, uint32_t cluster, uint32_t *data) {
+/*
+	retrieves the 12 bit FAT entry of a cluster from the unpacked FAT
+*/
+	if ((fs->FAT12 == NULL) && loadFAT12(fs)) return -1;
 
+	if (cluster >= fs->FAT12Entries) {
+		myerror("Cluster %08x is beyond the end of the FAT!", cluster);
+		return -1;
 	}
+	*data = fs->FAT12[cluster];
 
-	free(FAT1);
-	free(FATx);
+	return 0;
+}
 
-	return result;
+static inline int32_t getFAT16Entry(struct sFileSystem *fs, uint32_t cluster, uint32_t *data) {
+/*
+	retrieves the 16 bit FAT entry of a cluster
+*/
+	uint16_t value;
+
+	if (readFATBytes(fs, fs->FATOffset + (off_t) cluster * 2, &value, 2)) {
+		myerror("Failed to read from file!");
+		return -1;
+	}
+	*data = SwapInt16(value);
+
+	return 0;
+}
+
+static inline int32_t getFAT32Entry(struct sFileSystem *fs, uint32_t cluster, uint32_t *data) {
+/*
+	retrieves the FAT entry of a cluster, the upper 4 bits are reserved
+*/
+	if (readFATBytes(fs, fs->FATOffset + (off_t) cluster * 4, data, 4)) {
+		myerror("Failed to read from file!");
+		return -1;
+	}
+	*data = SwapInt32(*data) & 0x0FFFFFFF;
+
+	return 0;
+}
+
+static inline int32_t getExFATEntry(struct sFileSystem *fs, uint32_t cluster, uint32_t *data) {
+/*
+	retrieves the 32 bit FAT entry of a cluster
+*/
+	if (readFATBytes(fs, fs->FATOffset + (off_t) cluster * 4, data, 4)) {
+		myerror("Failed to read from file!");
+		return -1;
+	}
+	*data = SwapInt32(*data);
+
+	return 0;
 }
 
 int32_t getFATEntry(struct sFileSystem *fs, uint32_t cluster, uint32_t *data) {
@@ -633,147 +908,358 @@ int32_t getFATEntry(struct sFileSystem *fs, uint32_t cluster, uint32_t *data) {
 */
 
 	assert(fs != NULL);
+	assert(fs->getFATEntry != NULL);
 	assert(data != NULL);
 
-	off_t FATOffset, BSOffset;
-
 	*data=0;
 
-	switch(fs->FATType) {
-	case FATTYPE_FAT32:
-		FATOffset = (off_t)cluster * 4;
-		BSOffset = (off_t)SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) * SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec) + FATOffset;
-		if (device_seekset(fs->device, BSOffset) == -1) {
-			myerror("Seek error!");
-			return -1;
-		}
-		if (device_read(fs->device, data, 4, 1) < 1) {
-			myerror("Failed to read from file!");
-			return -1;
-		}
-		*data=SwapInt32(*data);
-		*data = *data & 0x0fffffff;
-		break;
-	case FATTYPE_FAT16:
-		FATOffset = (off_t)cluster * 2;
-		BSOffset = (off_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) * SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec) + FATOffset;
-		if (device_seekset(fs->device, BSOffset) == -1) {
-			myerror("Seek error!");
-			return -1;
+	return fs->getFATEntry(fs, cluster, data);
+}
+
+off_t getClusterOffset(struct sFileSystem *fs, uint32_t cluster) {
+/*
+	returns the offset of a specific cluster in the
+	data region of the file system
+*/
+
+	assert(fs != NULL);
+	assert(cluster > 1);
+
+	return (off_t)(cluster - 2) * fs->clusterSize + fs->firstDataSector * fs->sectorSize;
+}
+
+void *readCluster(struct sFileSystem *fs, uint32_t cluster) {
+/*
+	read cluster from file system
+*/
+	void *dummy;
+
+	if ((dummy = malloc(fs->clusterSize)) == NULL) {
+		stderror();
+		return NULL;
+	}
+
+	if (device_pread(fs->device, dummy, fs->clusterSize, getClusterOffset(fs, cluster)) < fs->clusterSize) {
+		myerror("Failed to read cluster!");
+		free(dummy);
+		return NULL;
+	}
+
+	return dummy;
+}
+
+int32_t writeCluster(struct sFileSystem *fs, uint32_t cluster, void *data) {
+/*
+	write cluster to file systen
+*/
+	if (device_pwrite(fs->device, data, fs->clusterSize, getClusterOffset(fs, cluster)) < fs->clusterSize) {
+		stderror();
+		return -1;
+	}
+
+	return 0;
+}
+
+void *readClusterChainData(struct sFileSystem *fs, struct sClusterChain *chain, uint32_t n) {
+/*
+	reads the first n clusters of a cluster chain into one buffer,
+	physically contiguous clusters are read at once
+*/
+
+	assert(fs != NULL);
+	assert(chain != NULL);
+
+	char *data;
+	uint32_t i=0, run;
+	struct sClusterChain *p;
+
+	// empty chains still get a valid buffer
+	if ((data=malloc(n ? (size_t) n * fs->clusterSize : 1)) == NULL) {
+		stderror();
+		return NULL;
+	}
+
+	chain=chain->next;
+	while ((i < n) && (chain != NULL)) {
+		for (run=1, p=chain->next; (i+run < n) && (p != NULL) && (p->cluster == chain->cluster+run); run++, p=p->next);
+
+		if (device_pread(fs->device, data + (size_t) i * fs->clusterSize, (uint64_t) run * fs->clusterSize,
+				getClusterOffset(fs, chain->cluster)) < (int64_t) run * fs->clusterSize) {
+			myerror("Failed to read clusters %08lx-%08lx!", chain->cluster, chain->cluster+run-1);
+			free(data);
+			return NULL;
 		}
-		if (device_read(fs->device, data, 2, 1)<1) {
-			myerror("Failed to read from file!");
+
+		i+=run;
+		chain=p;
+	}
+
+	if (i < n) {
+		myerror("Cluster chain is shorter than %u clusters!", n);
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+int32_t writeChangedData(struct sFileSystem *fs, const void *data, const void *old, uint64_t size, off_t offset) {
+/*
+	writes size bytes of data to offset, but only the sectors that differ from old,
+	adjacent changed sectors are written at once; old may be NULL to write everything,
+	with a journal the writes are logged and applied when the file system is synced
+*/
+
+	assert(fs != NULL);
+	assert(data != NULL);
+
+	const char *d=(const char *) data, *o=(const char *) old;
+	char *current=NULL;
+	uint64_t pos=0, start, len;
+	int32_t ret;
+
+	// the journal needs the current contents to skip unchanged sectors
+	if ((fs->journal != NULL) && (o == NULL)) {
+		if ((current=malloc((size_t) size)) == NULL) {
+			stderror();
 			return -1;
 		}
-		*data=SwapInt32(*data);
-		break;
-	case FATTYPE_FAT12:
-		FATOffset = (off_t) cluster + (cluster / 2);
-		BSOffset = (off_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) * SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec) + FATOffset;
-		if (device_seekset(fs->device, BSOffset) == -1) {
-			myerror("Seek error!");
+		if (device_pread(fs->device, current, size, offset) < (int64_t) size) {
+			stderror();
+			free(current);
 			return -1;
 		}
-		if (device_read(fs->device, data, 2, 1)<1) {
-			myerror("Failed to read from file!");
-			return -1;
+		o=current;
+	}
+
+	while (pos < size) {
+		len=(size-pos < fs->sectorSize) ? size-pos : fs->sectorSize;
+
+		// skip unchanged sectors
+		if ((o != NULL) && !memcmp(d+pos, o+pos, (size_t) len)) {
+			fs->bytesSkipped+=len;
+			pos+=len;
+			continue;
 		}
 
-		*data=SwapInt32(*data);
+		// collect following changed sectors
+		start=pos;
+		pos+=len;
+		while (pos < size) {
+			len=(size-pos < fs->sectorSize) ? size-pos : fs->sectorSize;
+			if ((o != NULL) && !memcmp(d+pos, o+pos, (size_t) len)) break;
+			pos+=len;
+		}
 
-		if (cluster & 1)  {
-			*data = *data >> 4;	/* cluster number is odd */
+		if (fs->journal != NULL) {
+			ret=journal_log(fs->journal, offset+(off_t) start, o+start, d+start, (uint32_t) (pos-start));
+		} else if (device_pwrite(fs->device, d+start, pos-start, offset+(off_t) start) < (int64_t) (pos-start)) {
+			stderror();
+			ret=-1;
 		} else {
-			*data = *data & 0x0FFF;	/* cluster number is even */
+			ret=0;
 		}
-		break;
-	case FATTYPE_EXFAT:
-		FATOffset = (off_t)cluster * 4;
-		BSOffset = (off_t)SwapInt32(fs->bs.xxFATxx.exFAT.fat_sector_start) * fs->sectorSize + FATOffset;
-		if (device_seekset(fs->device, BSOffset) == -1) {
-			myerror("Seek error!");
+		if (ret == -1) {
+			free(current);
 			return -1;
 		}
-		if (device_read(fs->device, data, 4, 1) < 1) {
-			myerror("Failed to read from file!");
+		fs->bytesWritten+=pos-start;
+
+		// remember the range that has to be synced
+		if (!fs->pendingBytes || (offset+(off_t) start < fs->pendingStart)) fs->pendingStart=offset+(off_t) start;
+		if (!fs->pendingBytes || (offset+(off_t) pos > fs->pendingEnd)) fs->pendingEnd=offset+(off_t) pos;
+		fs->pendingBytes+=pos-start;
+	}
+
+	free(current);
+
+	return 0;
+}
+
+int32_t writeClusterChainData(struct sFileSystem *fs, struct sClusterChain *chain, const void *data, const void *old, uint32_t n) {
+/*
+	writes the first n clusters of a cluster chain from one buffer,
+	physically contiguous clusters are written at once,
+	if old holds the current contents, only changed sectors are written
+*/
+
+	assert(fs != NULL);
+	assert(chain != NULL);
+	assert(data != NULL);
+
+	uint32_t i=0, run;
+	struct sClusterChain *p;
+
+	chain=chain->next;
+	while ((i < n) && (chain != NULL)) {
+		for (run=1, p=chain->next; (i+run < n) && (p != NULL) && (p->cluster == chain->cluster+run); run++, p=p->next);
+
+		if (writeChangedData(fs, (const char *) data + (size_t) i * fs->clusterSize,
+				(old != NULL) ? (const char *) old + (size_t) i * fs->clusterSize : NULL,
+				(uint64_t) run * fs->clusterSize, getClusterOffset(fs, chain->cluster)) == -1) {
+			myerror("Failed to write clusters %08lx-%08lx!", chain->cluster, chain->cluster+run-1);
 			return -1;
 		}
-		*data=SwapInt32(*data);
-		break;
-	default:
-		myerror("Failed to get FAT type!");
+
+		i+=run;
+		chain=p;
+	}
+
+	if (i < n) {
+		myerror("Cluster chain is shorter than %u clusters!", n);
 		return -1;
 	}
 
-	return 0;
+	return 0;
+}
+
+int32_t prefetchClusters(struct sFileSystem *fs, const uint32_t *clusters, uint32_t n) {
+/*
+	reads clusters into the device cache in one batch
+*/
+
+	assert(fs != NULL);
+	assert(!n || (clusters != NULL));
+
+	struct sDeviceRange *ranges;
+	uint32_t i, count=0;
+	off_t offset;
+	int32_t ret;
+
+	if (!n) return 0;
+
+	if ((ranges=malloc(sizeof(struct sDeviceRange) * n)) == NULL) {
+		stderror();
+		return -1;
+	}
+
+	for (i=0; i<n; i++) {
+		// invalid clusters are reported when the directory is parsed
+		if ((clusters[i] < 2) || (clusters[i] >= fs->clusters+2)) continue;
+
+		offset=getClusterOffset(fs, clusters[i]);
+		// merge adjacent clusters
+		if (count && (ranges[count-1].offset + (int64_t) ranges[count-1].size == (int64_t) offset)) {
+			ranges[count-1].size+=fs->clusterSize;
+		} else {
+			ranges[count].offset=(int64_t) offset;
+			ranges[count].size=fs->clusterSize;
+			count++;
+		}
+	}
+
+	ret=device_prefetch(fs->device, ranges, count);
+
+	free(ranges);
 
+	return ret;
 }
 
-off_t getClusterOffset(struct sFileSystem *fs, uint32_t cluster) {
+int32_t prefetchClusterChain(struct sFileSystem *fs, struct sClusterChain *chain) {
 /*
-	returns the offset of a specific cluster in the
-	data region of the file system
+	reads all clusters of a cluster chain into the device cache in one batch
 */
 
 	assert(fs != NULL);
-	assert(cluster > 1);
+	assert(chain != NULL);
 
-	return (off_t)(cluster - 2) * fs->clusterSize + fs->firstDataSector * fs->sectorSize;
-}
+	struct sClusterChain *p;
+	uint32_t *clusters, n=0;
+	int32_t ret;
 
-void *readCluster(struct sFileSystem *fs, uint32_t cluster) {
-/*
-	read cluster from file system
-*/
-	void *dummy;
+	for (p=chain->next; p != NULL; p=p->next) n++;
+	if (!n) return 0;
 
-	if (device_seekset(fs->device, getClusterOffset(fs, cluster)) != 0) {
+	if ((clusters=malloc(sizeof(uint32_t) * n)) == NULL) {
 		stderror();
-		return NULL;
+		return -1;
 	}
 
-	if ((dummy = malloc(fs->clusterSize)) == NULL) {
-		stderror();
-		return NULL;
-	}
+	n=0;
+	for (p=chain->next; p != NULL; p=p->next) clusters[n++]=p->cluster;
 
-	if ((device_read(fs->device, dummy, fs->clusterSize, 1)<1)) {
-		myerror("Failed to read cluster!");
-		return NULL;
-	}
+	ret=prefetchClusters(fs, clusters, n);
 
-	return dummy;
+	free(clusters);
+
+	return ret;
 }
 
-int32_t writeCluster(struct sFileSystem *fs, uint32_t cluster, void *data) {
+void adviseClusters(struct sFileSystem *fs, const uint32_t *clusters, uint32_t n) {
 /*
-	write cluster to file systen
+	asks the kernel to read clusters and the FAT sectors with their entries ahead,
+	this is a hint only, so nothing happens if memory is short
 */
-	if (device_seekset(fs->device, getClusterOffset(fs, cluster)) != 0) {
-		stderror();
-		return -1;
-	}
 
-	if (device_write(fs->device, data, fs->clusterSize, 1)<1) {
-		stderror();
-		return -1;
+	assert(fs != NULL);
+	assert(!n || (clusters != NULL));
+
+	struct sDeviceRange *ranges, *fat=NULL;
+	uint32_t i, count=0, fats=0;
+	int64_t start, end;
+	off_t offset;
+
+	if (!n) return;
+
+	if ((ranges=malloc(sizeof(struct sDeviceRange) * n * 2)) == NULL) return;
+
+	// data ranges are collected from the front, FAT sectors from the back
+	for (i=0; i<n; i++) {
+		if ((clusters[i] < 2) || (clusters[i] >= fs->clusters+2)) continue;
+
+		offset=getClusterOffset(fs, clusters[i]);
+		if (count && (ranges[count-1].offset + (int64_t) ranges[count-1].size == (int64_t) offset)) {
+			ranges[count-1].size+=fs->clusterSize;
+		} else {
+			ranges[count].offset=(int64_t) offset;
+			ranges[count].size=fs->clusterSize;
+			count++;
+		}
+
+		// the chain of the cluster starts in the FAT sector with its entry
+		switch(fs->FATType) {
+		case FATTYPE_FAT12:
+			start=(int64_t) fs->FATOffset + clusters[i] + clusters[i] / 2;
+			end=start + 2;
+			break;
+		case FATTYPE_FAT16:
+			start=(int64_t) fs->FATOffset + (int64_t) clusters[i] * 2;
+			end=start + 2;
+			break;
+		default:
+			start=(int64_t) fs->FATOffset + (int64_t) clusters[i] * 4;
+			end=start + 4;
+		}
+		start-=start % fs->sectorSize;
+		end=(end + fs->sectorSize - 1) / fs->sectorSize * fs->sectorSize;
+
+		// merge with the previous FAT range if they touch
+		if ((fat != NULL) && (fat->offset <= end) && (fat->offset + (int64_t) fat->size >= start)) {
+			if (end < fat->offset + (int64_t) fat->size) end=fat->offset + (int64_t) fat->size;
+			if (start > fat->offset) start=fat->offset;
+		} else {
+			fat=&ranges[2*n - ++fats];
+		}
+		fat->offset=start;
+		fat->size=(uint64_t) (end - start);
 	}
 
-	return 0;
+	memmove(ranges+count, ranges+2*n-fats, sizeof(struct sDeviceRange) * fats);
+
+	device_advise(fs->device, ranges, count+fats);
+
+	free(ranges);
 }
 
-int32_t parseEntry(struct sFileSystem *fs, union sDirEntry *de) {
+int32_t parseEntry(union sDirEntry *de, const void *data) {
 /*
-	parses one directory entry
+	parses one directory entry from directory data
 */
 
-	assert(fs != NULL);
 	assert(de != NULL);
+	assert(data != NULL);
 
-	if ((device_read(fs->device, de, DIR_ENTRY_SIZE, 1)<1)) {
-		myerror("Failed to read from file!");
-		return -1;
-	}
+	memcpy(de, data, DIR_ENTRY_SIZE);
 
 	if (de->ShortDirEntry.DIR_Name[0] == DE_FOLLOWING_FREE ) return 0; // no more entries
 
@@ -784,18 +1270,15 @@ int32_t parseEntry(struct sFileSystem *fs, union sDirEntry *de) {
 }
 
 
-int32_t parseExFATEntry(struct sFileSystem *fs, struct sExFATDirEntry *de) {
+int32_t parseExFATEntry(struct sExFATDirEntry *de, const void *data) {
 /*
-	parses one exFAT directory entry
+	parses one exFAT directory entry from directory data
 */
 
-	assert(fs != NULL);
 	assert(de != NULL);
+	assert(data != NULL);
 
-	if ((device_read(fs->device, de, DIR_ENTRY_SIZE, 1)<1)) {
-		myerror("Failed to read from file!");
-		return -1;
-	}
+	memcpy(de, data, DIR_ENTRY_SIZE);
 
 	return de->type;
 
@@ -832,10 +1315,8 @@ int32_t getAllocationTableOffset(struct sFileSystem *fs) {
 
 	tmp=chain->next;
 	while (tmp != NULL) {
-		device_seekset(fs->device, getClusterOffset(fs, tmp->cluster));
-
 		for(i=0; i < fs->clusterSize / DIR_ENTRY_SIZE; i++){
-			if ((device_read(fs->device, &de, DIR_ENTRY_SIZE, 1)<1)) {
+			if (device_pread(fs->device, &de, DIR_ENTRY_SIZE, getClusterOffset(fs, tmp->cluster) + (off_t) i * DIR_ENTRY_SIZE) < DIR_ENTRY_SIZE) {
 				myerror("Failed to read from file!");
 				freeClusterChain(chain);
 				return -1;
@@ -880,9 +1361,7 @@ int32_t isClusterAllocated(struct sFileSystem *fs, uint32_t cluster) {
 
 	offset=getClusterOffset(fs, fs->allocBitmapFirstCluster) + (cluster) / 8;
 
-	device_seekset(fs->device, offset);
-
-	if ((device_read(fs->device, &byte, 1, 1)<1)) {
+	if (device_pread(fs->device, &byte, 1, offset) < 1) {
 		myerror("Failed to read from file!");
 		return -1;
 	}
@@ -917,9 +1396,7 @@ int32_t countAllocatedClusters(struct sFileSystem *fs) {
 
 		offset=getClusterOffset(fs, tmp->cluster);
 
-		device_seekset(fs->device, offset);
-
-		if ((device_read(fs->device, &data, fs->clusterSize, 1)<1)) {
+		if (device_pread(fs->device, &data, fs->clusterSize, offset) < fs->clusterSize) {
 			myerror("Failed to read from file!");
 			return -1;
 		}
@@ -943,6 +1420,53 @@ int32_t countAllocatedClusters(struct sFileSystem *fs) {
 }
 
 
+/*
+	generates the cluster chain walker of a FAT type, entries are read with
+	get<type>Entry and the walk stops at the first cluster for which end is true
+*/
+#define DEFINE_CLUSTER_CHAIN_WALKER(type, end) \
+static int32_t get##type##ClusterChain(struct sFileSystem *fs, uint32_t startCluster, struct sClusterChain *chain) { \
+	assert(fs != NULL); \
+	assert(chain != NULL); \
+\
+	uint32_t cluster=startCluster, data, i=0; \
+\
+	do { \
+		if (i == fs->maxClusterChainLength) { \
+			myerror("Cluster chain is too long!"); \
+			return -1; \
+		} \
+		if (cluster >= fs->clusters+2) { \
+			myerror("Cluster %08x does not exist!", cluster); \
+			return -1; \
+		} \
+		if (insertCluster(chain, cluster) == -1) { \
+			myerror("Failed to insert cluster!"); \
+			return -1; \
+		} \
+		i++; \
+		if (get##type##Entry(fs, cluster, &data)) { \
+			myerror("Failed to get FAT entry!"); \
+			return -1; \
+		} \
+		if (data == 0) { \
+			myerror("Cluster %08x is marked as unused!", cluster); \
+			return -1; \
+		} \
+		cluster=data; \
+	} while (!end(cluster)); \
+\
+	return i; \
+}
+
+// some FAT32 implementations end chains with this value
+#define isFAT32ChainEnd(cluster) (isFAT32EOC(cluster) || ((cluster) == 0x0ff8fff8))
+
+DEFINE_CLUSTER_CHAIN_WALKER(FAT12, isFAT12EOC)
+DEFINE_CLUSTER_CHAIN_WALKER(FAT16, isFAT16EOC)
+DEFINE_CLUSTER_CHAIN_WALKER(FAT32, isFAT32ChainEnd)
+DEFINE_CLUSTER_CHAIN_WALKER(ExFAT, isExFATEOC)
+
 int32_t getClusterChain(struct sFileSystem *fs, uint32_t startCluster, struct sClusterChain *chain) {
 /*
 	retrieves an array of all clusters in a cluster chain
@@ -950,137 +1474,196 @@ int32_t getClusterChain(struct sFileSystem *fs, uint32_t startCluster, struct sC
 */
 
 	assert(fs != NULL);
+	assert(fs->getClusterChain != NULL);
 	assert(chain != NULL);
 
-	uint32_t cluster;
-	uint32_t data,i=0;
+	return fs->getClusterChain(fs, startCluster, chain);
+}
+
+// marks clusters whose chain length is being computed
+#define CHAIN_LENGTH_PENDING (CHAIN_LENGTH_INVALID - 1)
+
+uint16_t isChainEnd(struct sFileSystem *fs, const uint32_t data) {
+/*
+	checks whether data ends a cluster chain like the chain walkers do
+*/
+	if (fs->FATType == FATTYPE_FAT32) return isFAT32ChainEnd(data);
+
+	return fs->isEOC(data);
+}
+
+static int32_t getChainLengths(struct sFileSystem *fs, uint32_t startCluster, uint32_t *lengths) {
+/*
+	computes the chain length of startCluster and of all clusters that follow it,
+	the walk stops at the first cluster whose length is already known
+*/
+	uint32_t cluster, data, steps=0, length, i;
+
+	// first walk: find the length of the last cluster that is not known yet
+	for (cluster=startCluster; ; cluster=data) {
+		lengths[cluster]=CHAIN_LENGTH_PENDING;
+		steps++;
+		if (getFATEntry(fs, cluster, &data) || (data == 0)) {
+			length=CHAIN_LENGTH_INVALID;
+		} else if (isChainEnd(fs, data)) {
+			length=1;
+		} else if (data >= fs->clusters+2) {
+			length=CHAIN_LENGTH_INVALID;
+		} else if (lengths[data] == CHAIN_LENGTH_PENDING) {
+			// the chain runs into itself
+			length=CHAIN_LENGTH_INVALID;
+		} else if (lengths[data] == CHAIN_LENGTH_INVALID) {
+			length=CHAIN_LENGTH_INVALID;
+		} else if (lengths[data] != 0) {
+			length=lengths[data] + 1;
+		} else {
+			continue;
+		}
+		break;
+	}
+
+	// second walk: every cluster is one longer than its successor
+	for (cluster=startCluster, i=steps; i; i--) {
+		if ((length == CHAIN_LENGTH_INVALID) || ((uint64_t) length + i - 1 > fs->maxClusterChainLength)) {
+			lengths[cluster]=CHAIN_LENGTH_INVALID;
+		} else {
+			lengths[cluster]=length + i - 1;
+		}
+		if ((i > 1) && getFATEntry(fs, cluster, &cluster)) {
+			myerror("Failed to get FAT entry!");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int32_t getFATStats(struct sFileSystem *fs, uint32_t *used, uint32_t *bad, uint32_t *lengths) {
+/*
+	counts used and bad clusters in one pass over the FAT,
+	lengths receives the length of the cluster chain starting at every cluster if not NULL
+*/
+	assert(fs != NULL);
+	assert(used != NULL);
+	assert(bad != NULL);
+
+	uint32_t i, value;
+
+	*used=0;
+	*bad=0;
+
+	if (lengths != NULL) memset(lengths, 0, sizeof(uint32_t) * (fs->clusters+2));
+
+	for (i=0; i<fs->clusters+2; i++) {
+		getFATEntry(fs, i, &value);
+
+		if (i >= 2) {
+			if ((value & 0x0FFFFFFF) != 0) (*used)++;
+			if (isBadCluster(fs, value)) (*bad)++;
+		}
+
+		// chains of used clusters, reserved entries included
+		if ((lengths != NULL) && ((value & 0x0FFFFFFF) != 0) && (lengths[i] == 0)) {
+			if (getChainLengths(fs, i, lengths)) return -1;
+		}
+	}
+
+	// exFAT does not need FAT entries for contiguous files, the bitmap knows which clusters are used
+	if (fs->FATType == FATTYPE_EXFAT) *used=fs->allocatedClusters;
+
+	return 0;
+}
+
+int32_t getChainExtents(struct sFileSystem *fs, uint32_t startCluster, struct sFragmentation *frag) {
+/*
+	adds the contiguous runs of the cluster chain starting with startCluster to frag
+	without collecting the clusters of the chain, returns 1 if the chain is broken,
+	the runs up to the break are added anyway
+*/
+	assert(fs != NULL);
+	assert(frag != NULL);
+
+	uint32_t cluster=startCluster, data, length=0, i;
+	int32_t broken=0;
+
+	for (i=0; ; i++) {
+		// longer chains must run in circles
+		if (i == fs->clusters) {
+			myerror("Cluster chain is too long!");
+			broken=1;
+			break;
+		}
+		if ((cluster < 2) || (cluster >= fs->clusters+2)) {
+			myerror("Cluster %08x does not exist!", cluster);
+			broken=1;
+			break;
+		}
+		if (getFATEntry(fs, cluster, &data)) {
+			myerror("Failed to get FAT entry!");
+			return -1;
+		}
+		if (data == 0) {
+			myerror("Cluster %08x is marked as unused!", cluster);
+			broken=1;
+			break;
+		}
+
+		length++;
+		if (isChainEnd(fs, data)) break;
 
-	cluster=startCluster;
+		if (data != cluster + 1) {
+			frag_addextent(frag, length);
+			length=0;
+		}
+		cluster=data;
+	}
+	if (length) frag_addextent(frag, length);
+
+	return broken;
+}
+
+static void selectFATAccessors(struct sFileSystem *fs) {
+/*
+	binds the accessors of the FAT type of the file system
+*/
+	assert(fs != NULL);
 
 	switch(fs->FATType) {
 	case FATTYPE_FAT12:
-		do {
-			if (i == fs->maxClusterChainLength) {
-				myerror("Cluster chain is too long!");
-				return -1;
-			}
-			if (cluster >= fs->clusters+2) {
-				myerror("Cluster %08x does not exist!", data);
-				return -1;
-			}
-			if (insertCluster(chain, cluster) == -1) {
-				myerror("Failed to insert cluster!");
-				return -1;
-			}
-			i++;
-			if (getFATEntry(fs, cluster, &data)) {
-				myerror("Failed to get FAT entry!");
-				return -1;
-			}
-			if (data == 0) {
-				myerror("Cluster %08x is marked as unused!", cluster);
-				return -1;
-			}
-			cluster=data;
-		} while (cluster < 0x0ff8);	// end of cluster
+		fs->getFATEntry=getFAT12Entry;
+		fs->getClusterChain=getFAT12ClusterChain;
+		fs->isEOC=isFAT12EOC;
+		fs->isBadCluster=isFAT12BadCluster;
 		break;
 	case FATTYPE_FAT16:
-		do {
-			if (i == fs->maxClusterChainLength) {
-				myerror("Cluster chain is too long!");
-				return -1;
-			}
-			if (cluster >= fs->clusters+2) {
-				myerror("Cluster %08x does not exist!", data);
-				return -1;
-			}
-			if (insertCluster(chain, cluster) == -1) {
-				myerror("Failed to insert cluster!");
-				return -1;
-			}
-			i++;
-			if (getFATEntry(fs, cluster, &data)) {
-				myerror("Failed to get FAT entry!");
-				return -1;
-			}
-			if (data == 0) {
-				myerror("Cluster %08x is marked as unused!", cluster);
-				return -1;
-			}
-			cluster=data;
-		} while (cluster < 0xfff8);	// end of cluster chain
+		fs->getFATEntry=getFAT16Entry;
+		fs->getClusterChain=getFAT16ClusterChain;
+		fs->isEOC=isFAT16EOC;
+		fs->isBadCluster=isFAT16BadCluster;
 		break;
 	case FATTYPE_FAT32:
-		do {
-			if (i == fs->maxClusterChainLength) {
-				myerror("Cluster chain is too long!");
-				return -1;
-			}
-			if ((cluster & 0x0fffffff) >= fs->clusters+2) {
-				myerror("Cluster %08x does not exist!", data);
-				return -1;
-			}
-			if (insertCluster(chain, cluster) == -1) {
-				myerror("Failed to insert cluster!");
-				return -1;
-			}
-			i++;
-			if (getFATEntry(fs, cluster, &data)) {
-				myerror("Failed to get FAT entry");
-				return -1;
-			}
-			if ((data & 0x0fffffff) == 0) {
-				myerror("Cluster %08x is marked as unused!", cluster);
-				return -1;
-			}
-			cluster=data;
-		} while (((cluster & 0x0fffffff) != 0x0ff8fff8) &&
-			 ((cluster & 0x0fffffff) < 0x0ffffff8));	// end of cluster chain
-		break;
-	case FATTYPE_EXFAT:
-		do {
-			if (i == fs->maxClusterChainLength) {
-				myerror("Cluster chain is too long!");
-				return -1;
-			}
-			if (cluster >= fs->clusters+2) {
-				myerror("Cluster %08x does not exist!", data);
-				return -1;
-			}
-			if (insertCluster(chain, cluster) == -1) {
-				myerror("Failed to insert cluster!");
-				return -1;
-			}
-			i++;
-			if (getFATEntry(fs, cluster, &data)) {
-				myerror("Failed to get FAT entry");
-				return -1;
-			}
-			if (data == 0) {
-				myerror("Cluster %08x is marked as unused!", cluster);
-				return -1;
-			}
-			cluster=data;
-		} while (cluster < 0xfffffff8);	// end of cluster chain
+		fs->getFATEntry=getFAT32Entry;
+		fs->getClusterChain=getFAT32ClusterChain;
+		fs->isEOC=isFAT32EOC;
+		fs->isBadCluster=isFAT32BadCluster;
 		break;
-	case -1:
 	default:
-		myerror("Failed to get FAT type!");
-		return -1;
+		fs->getFATEntry=getExFATEntry;
+		fs->getClusterChain=getExFATClusterChain;
+		fs->isEOC=isExFATEOC;
+		fs->isBadCluster=isExFATBadCluster;
 	}
-
-	return i;
 }
 
 
-int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs) {
+DEVICE *openDevice(char *path, uint32_t mode) {
 /*
-	opens file system and assemlbes file system information into data structure
+	opens the device after checking that it can be accessed in mode
 */
 	assert(path != NULL);
-	assert(fs != NULL);
 
 	int32_t ret;
+	DEVICE *device;
 
 	switch(mode) {
 		case FS_MODE_RO:
@@ -1090,6 +1673,9 @@ int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs) {
 			break;
 		case FS_MODE_RO_EXCL:
 		case FS_MODE_RW_EXCL:
+			// a RAM copy can not interfere with a mounted file system
+			if (!strncmp(path, DEVICE_RAM_PREFIX, strlen(DEVICE_RAM_PREFIX))) break;
+
 			// this check is only done for user convenience
 			// open would fail too if device is mounted, but without specific error message
 			ret=check_mounted(path);
@@ -1097,24 +1683,48 @@ int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs) {
 				case 0: break;  // filesystem not mounted
 				case 1:		// filesystem mounted
 					myerror("Filesystem is mounted. Please unmount!");
-					return -1;
+					return NULL;
 				case -1:	// unable to check
 				default:
 					myerror("Could not check whether filesystem is mounted!");
-					return -1;
+					return NULL;
 			}
 
 			break;
 		default:
 			myerror("Mode not supported!");
-			return -1;
+			return NULL;
 	}
 
-	if ((fs->device=device_open(path)) == NULL) {
+	if ((device=device_open(path)) == NULL) {
 		stderror();
-		return -1;
+		return NULL;
 	}
 
+	return device;
+}
+
+int32_t attachFileSystem(DEVICE *device, char *path, struct sFileSystem *fs) {
+/*
+	assembles the information of the file system on device into data structure
+*/
+	assert(device != NULL);
+	assert(path != NULL);
+	assert(fs != NULL);
+
+	fs->device=device;
+	fs->disk=NULL;
+	fs->bytesWritten=0;
+	fs->bytesSkipped=0;
+	fs->pendingDirs=0;
+	fs->pendingBytes=0;
+	fs->journal=NULL;
+	fs->checkpoint=NULL;
+	fs->FATCache=NULL;
+	fs->FAT12=NULL;
+	fs->FAT12Entries=0;
+	fs->fragmentation=NULL;
+
 	// read boot sector
 	if (read_bootsector(fs->device, &(fs->bs))) {
 		myerror("Failed to read boot sector!");
@@ -1130,12 +1740,14 @@ int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs) {
 		fs->FATType = FATTYPE_EXFAT;
 		fs->sectorSize = (1 << fs->bs.xxFATxx.exFAT.sector_bits);
 		fs->FATSize = SwapInt32(fs->bs.xxFATxx.exFAT.fat_sector_count);
+		fs->FATOffset = (off_t) SwapInt32(fs->bs.xxFATxx.exFAT.fat_sector_start) * fs->sectorSize;
 		fs->clusters = SwapInt32(fs->bs.xxFATxx.exFAT.cluster_count);
 		fs->clusterSize = (1 << fs->bs.xxFATxx.exFAT.spc_bits) * fs->sectorSize;
 		fs->FSSize = SwapInt64(fs->bs.xxFATxx.exFAT.sector_count) * fs->sectorSize;
 		fs->FATCount = fs->bs.xxFATxx.exFAT.fat_count;
 		fs->maxClusterChainLength = 0xffffffff; // basically not limited
 		fs->firstDataSector= SwapInt32(fs->bs.xxFATxx.exFAT.cluster_sector_start);
+		selectFATAccessors(fs);
 
 		if (checkVbrCecksum(fs)) {
 			myerror("Volume Boot Record checksum verification failed!");
@@ -1226,6 +1838,8 @@ int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs) {
 
 		fs->sectorSize=SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec);
 
+		fs->FATOffset = (off_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) * fs->sectorSize;
+
 		fs->clusterSize=fs->bs.xxFATxx.FAT12_16_32.BS_SecPerClus * SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec);
 
 		fs->FSSize = (uint64_t) fs->clusters * fs->clusterSize;
@@ -1240,6 +1854,7 @@ int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs) {
 				  (SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec) - 1)) / SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_BytesPerSec);
 		fs->firstDataSector = (SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) +
 				      (fs->FATCount * fs->FATSize) + rootDirSectors);
+		selectFATAccessors(fs);
 	}
 
 	fs->maxDirEntriesPerCluster = fs->clusterSize / DIR_ENTRY_SIZE;
@@ -1257,25 +1872,136 @@ int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs) {
 	return 0;
 }
 
+int32_t openFileSystem(char *path, uint32_t partition, uint32_t mode, struct sFileSystem *fs) {
+/*
+	opens file system and assemlbes file system information into data structure
+*/
+	assert(path != NULL);
+	assert(fs != NULL);
+
+	DEVICE *disk, *view;
+	struct sPartitionTable *table;
+	struct sPartition *p;
+
+	if ((disk=openDevice(path, mode)) == NULL) return -1;
+
+	if (!partition) return attachFileSystem(disk, path, fs);
+
+	if ((table=malloc(sizeof(struct sPartitionTable))) == NULL) {
+		stderror();
+		device_close(disk);
+		return -1;
+	}
+
+	if (readPartitionTable(disk, table)) {
+		myerror("Failed to read partition table!");
+		free(table);
+		device_close(disk);
+		return -1;
+	}
+
+	if ((p=getPartition(table, partition)) == NULL) {
+		myerror("Partition %u does not exist!", partition);
+		free(table);
+		device_close(disk);
+		return -1;
+	}
+
+	view=device_openview(disk, p->offset, p->size);
+	free(table);
+	if (view == NULL) {
+		myerror("Failed to open partition %u!", partition);
+		device_close(disk);
+		return -1;
+	}
+
+	if (attachFileSystem(view, path, fs)) {
+		device_close(disk);
+		return -1;
+	}
+
+	// the partition view is closed before its disk
+	fs->disk=disk;
+
+	return 0;
+}
+
 int32_t syncFileSystem(struct sFileSystem *fs) {
 /*
 	sync file system
 */
+	if ((fs->journal != NULL) && journal_commit(fs->journal, fs->device)) {
+		myerror("Could not commit journal!");
+		return -1;
+	}
+
 	if (device_sync(fs->device) != 0) {
 		myerror("Could not sync device!");
 		return -1;
 	}
 
+	if ((fs->journal != NULL) && journal_reset(fs->journal)) {
+		myerror("Could not reset journal!");
+		return -1;
+	}
+
+	fs->pendingDirs=0;
+	fs->pendingBytes=0;
+
+	return 0;
+}
+
+int32_t syncPendingWrites(struct sFileSystem *fs) {
+/*
+	sync only the range written since the last sync
+*/
+	if (!fs->pendingBytes) return 0;
+
+	if ((fs->journal != NULL) && journal_commit(fs->journal, fs->device)) {
+		myerror("Could not commit journal!");
+		return -1;
+	}
+
+	if (device_syncrange(fs->device, fs->pendingStart, (uint64_t) (fs->pendingEnd - fs->pendingStart)) != 0) {
+		myerror("Could not sync device!");
+		return -1;
+	}
+
+	if ((fs->journal != NULL) && journal_reset(fs->journal)) {
+		myerror("Could not reset journal!");
+		return -1;
+	}
+
+	fs->pendingDirs=0;
+	fs->pendingBytes=0;
+
 	return 0;
 }
 
+uint64_t getVolumeFingerprint(struct sFileSystem *fs) {
+/*
+	identifies the file system by a hash of its boot sector
+*/
+	assert(fs != NULL);
+
+	return hashData(HASH_INIT, &fs->bs, sizeof(struct sBootSector));
+}
+
 int32_t closeFileSystem(struct sFileSystem *fs) {
 /*
 	closes file system
 */
 	assert(fs != NULL);
 
+	if (fs->checkpoint != NULL) checkpoint_close(fs->checkpoint, 0);
+	if (fs->journal != NULL) journal_close(fs->journal);
+	freeFATCache(fs);
+	free(fs->FAT12);
+	fs->FAT12=NULL;
+	frag_free(fs->fragmentation);
+	fs->fragmentation=NULL;
 	device_close(fs->device);
+	if (fs->disk != NULL) device_close(fs->disk);
 #ifndef __WIN32__
 	iconv_close(fs->cd);
 #endif
@@ -78,6 +78,9 @@
 #include "deviceio.h"
 #include "endianness.h"
 #include "clusterchain.h"
+#include "journal.h"
+#include "checkpoint.h"
+#include "fragment.h"
 
 #ifdef __WIN32__
 #define ATTR_PACKED __attribute__ ((gcc_struct, __packed__))
@@ -324,9 +327,31 @@ struct sFSInfo {
 	uint32_t FSI_TrailSig;
 } ATTR_PACKED;
 
+// bytes of the FAT that are read at once if it does not fit into the FAT cache
+#define FAT_CACHE_PAGE_SIZE (1024*1024)
+// bytes of each FAT that are compared at once when checking whether all FATs are equal
+#define FAT_COMPARE_CHUNK_SIZE (256*1024)
+// chain length of clusters whose chain is broken
+#define CHAIN_LENGTH_INVALID UINT32_MAX
+
+// the FAT or its recently used pages in memory, fatsort never modifies the FAT
+struct sFATCache {
+	off_t offset;		// of the first FAT on the device
+	uint64_t size;		// of a FAT in bytes
+	uint32_t pageSize;	// the whole FAT if it fits into the cache
+	uint32_t pageCount;
+	uint32_t maxPages;	// pages kept in memory at most
+	uint32_t resident;	// pages in memory
+	uint32_t next;		// slot of the page in ring that is evicted next
+	char **pages;		// page table, NULL for pages that are not in memory
+	uint32_t *ring;		// pages in memory in the order they were loaded
+	uint64_t loads;		// pages read from the device
+};
+
 // holds information about the file system
 struct sFileSystem {
 	DEVICE *device;
+	DEVICE *disk;		// disk of a partition view that is closed together with the file system, NULL otherwise
 	uint32_t mode;
 	char path[MAX_PATH_LEN+1];
 	struct sBootSector bs;
@@ -336,6 +361,7 @@ struct sFileSystem {
 	uint32_t totalSectors;
 	uint32_t clusterSize;
 	uint32_t FATSize;
+	off_t FATOffset;	// of the first FAT on the device
 	uint64_t FSSize;
 	uint32_t maxDirEntriesPerCluster;
 	uint32_t maxClusterChainLength;
@@ -344,13 +370,36 @@ struct sFileSystem {
 	uint32_t allocBitmapFirstCluster;
 	uint64_t allocBitmapSize;
 	uint32_t allocatedClusters;
+	uint64_t bytesWritten;
+	uint64_t bytesSkipped;
+	uint32_t pendingDirs;
+	uint64_t pendingBytes;
+	off_t pendingStart;
+	off_t pendingEnd;
+	struct sJournal *journal;
+	struct sCheckpoint *checkpoint;
+	struct sFragmentation *fragmentation;	// NULL unless a fragmentation report is collected
+	struct sFATCache *FATCache;	// NULL if FAT entries are read from the device
+	uint16_t *FAT12;	// unpacked entries of a FAT12 file system, NULL until they are first used
+	uint32_t FAT12Entries;
+	// accessors for the FAT type of the file system, selected when it is opened
+	int32_t (*getFATEntry)(struct sFileSystem *fs, uint32_t cluster, uint32_t *data);
+	int32_t (*getClusterChain)(struct sFileSystem *fs, uint32_t startCluster, struct sClusterChain *chain);
+	uint16_t (*isEOC)(const uint32_t data);
+	uint16_t (*isBadCluster)(const uint32_t data);
 	iconv_t cd;
 };
 
 // functions
 
-// opens file system and calculates file system information
-int32_t openFileSystem(char *path, uint32_t mode, struct sFileSystem *fs);
+// opens the device at path after checking that it can be accessed in mode
+DEVICE *openDevice(char *path, uint32_t mode);
+
+// calculates the information of the file system on an open device, the file system takes ownership of device
+int32_t attachFileSystem(DEVICE *device, char *path, struct sFileSystem *fs);
+
+// opens file system and calculates file system information, partition 0 means the whole device
+int32_t openFileSystem(char *path, uint32_t partition, uint32_t mode, struct sFileSystem *fs);
 
 // update boot sector
 int32_t writeBootSector(struct sFileSystem *fs);
@@ -358,12 +407,21 @@ int32_t writeBootSector(struct sFileSystem *fs);
 // sync file system
 int32_t syncFileSystem(struct sFileSystem *fs);
 
+// sync only the range written since the last sync
+int32_t syncPendingWrites(struct sFileSystem *fs);
+
+// identifies the file system by a hash of its boot sector
+uint64_t getVolumeFingerprint(struct sFileSystem *fs);
+
 // closes file system
 int32_t closeFileSystem(struct sFileSystem *fs);
 
 // lazy check if this is really a FAT bootsector
 int32_t check_bootsector(struct sBootSector *bs);
 
+// keeps up to maxSize bytes of the FAT in memory, the whole FAT if it fits, 0 disables the cache
+int32_t setFATCache(struct sFileSystem *fs, uint64_t maxSize);
+
 // retrieves FAT entry for a cluster number
 int32_t getFATEntry(struct sFileSystem *fs, uint32_t cluster, uint32_t *data);
 
@@ -388,14 +446,35 @@ uint16_t isEOC(struct sFileSystem *fs, const uint32_t data);
 // checks whether data marks a bad cluster
 uint16_t isBadCluster(struct sFileSystem *fs, const uint32_t data);
 
+// checks whether data ends a cluster chain like getClusterChain does
+uint16_t isChainEnd(struct sFileSystem *fs, const uint32_t data);
+
 // returns the offset of a specific cluster in the data region of the file system
 off_t getClusterOffset(struct sFileSystem *fs, uint32_t cluster);
 
-// parses one directory entry
-int32_t parseEntry(struct sFileSystem *fs, union sDirEntry *de);
+// reads the first n clusters of a cluster chain into one buffer
+void *readClusterChainData(struct sFileSystem *fs, struct sClusterChain *chain, uint32_t n);
 
-// parses one exFAT directory entry
-int32_t parseExFATEntry(struct sFileSystem *fs, struct sExFATDirEntry *de);
+// writes the sectors of data that differ from old (all if old is NULL) to offset
+int32_t writeChangedData(struct sFileSystem *fs, const void *data, const void *old, uint64_t size, off_t offset);
+
+// writes the first n clusters of a cluster chain from one buffer, skipping sectors that equal old
+int32_t writeClusterChainData(struct sFileSystem *fs, struct sClusterChain *chain, const void *data, const void *old, uint32_t n);
+
+// reads clusters into the device cache in one batch
+int32_t prefetchClusters(struct sFileSystem *fs, const uint32_t *clusters, uint32_t n);
+
+// reads all clusters of a cluster chain into the device cache in one batch
+int32_t prefetchClusterChain(struct sFileSystem *fs, struct sClusterChain *chain);
+
+// asks the kernel to read clusters and the FAT sectors with their entries ahead
+void adviseClusters(struct sFileSystem *fs, const uint32_t *clusters, uint32_t n);
+
+// parses one directory entry from directory data
+int32_t parseEntry(union sDirEntry *de, const void *data);
+
+// parses one exFAT directory entry from directory data
+int32_t parseExFATEntry(struct sExFATDirEntry *de, const void *data);
 
 // calculate checksum for short dir entry name
 uint8_t calculateChecksum (char *sname);
@@ -412,6 +491,12 @@ int32_t writeFSInfo(struct sFileSystem *fs, struct sFSInfo *fsInfo);
 // get cluster chain
 int32_t getClusterChain(struct sFileSystem *fs, uint32_t startCluster, struct sClusterChain *chain);
 
+// counts used and bad clusters, lengths receives the chain length of every cluster if not NULL
+int32_t getFATStats(struct sFileSystem *fs, uint32_t *used, uint32_t *bad, uint32_t *lengths);
+
+// adds the contiguous runs of the cluster chain starting with startCluster to frag, 1 if the chain is broken
+int32_t getChainExtents(struct sFileSystem *fs, uint32_t startCluster, struct sFragmentation *frag);
+
 // return if cluster is allocated, -1 on error
 int32_t isClusterAllocated(struct sFileSystem *fs, uint32_t cluster);
 
@@ -0,0 +1,276 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes checkpoints of the directory traversal.
+	A checkpoint holds the stack of directories that are being processed
+	together with the number of their sub directories that are finished,
+	so that an interrupted run can skip everything that was done already.
+*/
+
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#if defined __WIN32__
+#include <io.h>
+#endif
+#include "errors.h"
+#include "mallocv.h"
+
+#define CHECKPOINT_MAGIC "FSCKPT01"
+
+// the checkpoint is a host local file, so all fields are stored in host byte order
+struct sCheckpointHeader {
+	char magic[8];
+	uint64_t volume;
+	uint32_t depth;
+	uint32_t reserved;
+};
+
+static int32_t checkpoint_load(struct sCheckpoint *checkpoint) {
+/*
+	reads the position to resume from
+*/
+	assert(checkpoint != NULL);
+
+	struct sCheckpointHeader header;
+	FILE *fp;
+
+	if ((fp=fopen(checkpoint->path, "rb")) == NULL) {
+		// a complete run removes its checkpoint
+		if (errno == ENOENT) return 0;
+		stderror();
+		return -1;
+	}
+
+	if ((fread(&header, sizeof(header), 1, fp) != 1) || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))) {
+		myerror("%s is not a checkpoint file!", checkpoint->path);
+		fclose(fp);
+		return -1;
+	}
+
+	if (header.volume != checkpoint->volume) {
+		myerror("Checkpoint %s belongs to another file system!", checkpoint->path);
+		fclose(fp);
+		return -1;
+	}
+
+	if ((checkpoint->resume=malloc(header.depth * sizeof(struct sCheckpointLevel) + 1)) == NULL) {
+		stderror();
+		fclose(fp);
+		return -1;
+	}
+
+	if (header.depth && (fread(checkpoint->resume, sizeof(struct sCheckpointLevel), header.depth, fp) != header.depth)) {
+		myerror("Checkpoint %s is truncated!", checkpoint->path);
+		fclose(fp);
+		return -1;
+	}
+	checkpoint->resumeDepth=header.depth;
+
+	fclose(fp);
+
+	return 0;
+}
+
+struct sCheckpoint *checkpoint_open(const char *path, uint64_t volume, int32_t resume) {
+/*
+	creates a checkpoint for the file system with fingerprint volume,
+	loads the last position if resume is set
+*/
+	assert(path != NULL);
+
+	struct sCheckpoint *checkpoint;
+
+	if ((checkpoint=malloc(sizeof(struct sCheckpoint))) == NULL) {
+		stderror();
+		return NULL;
+	}
+	memset(checkpoint, 0, sizeof(struct sCheckpoint));
+	checkpoint->volume=volume;
+	checkpoint->saved=time(NULL);
+
+	if ((checkpoint->path=malloc(strlen(path)+1)) == NULL) {
+		stderror();
+		free(checkpoint);
+		return NULL;
+	}
+	strcpy(checkpoint->path, path);
+
+	if (resume && checkpoint_load(checkpoint)) {
+		checkpoint_close(checkpoint, 0);
+		return NULL;
+	}
+
+	return checkpoint;
+}
+
+int32_t checkpoint_skip(struct sCheckpoint *checkpoint) {
+/*
+	checks whether the next sub directory of the current directory was finished before,
+	counts it as done if so
+*/
+	assert(checkpoint != NULL);
+	assert(checkpoint->depth > 0);
+
+	struct sCheckpointLevel *top=&checkpoint->levels[checkpoint->depth-1];
+
+	if ((checkpoint->matched == checkpoint->depth) && (checkpoint->depth <= checkpoint->resumeDepth) &&
+		(top->done < checkpoint->resume[checkpoint->depth-1].done)) {
+		top->done++;
+		return 1;
+	}
+
+	return 0;
+}
+
+int32_t checkpoint_enter(struct sCheckpoint *checkpoint, uint32_t cluster) {
+/*
+	pushes a directory that is about to be sorted,
+	returns 1 if it was sorted by the interrupted run, -1 on errors
+*/
+	assert(checkpoint != NULL);
+
+	uint32_t d=checkpoint->depth;
+	struct sCheckpointLevel *tmp;
+	int32_t sorted=0;
+
+	if (d == checkpoint->capacity) {
+		if ((tmp=realloc(checkpoint->levels, (checkpoint->capacity + 16) * sizeof(struct sCheckpointLevel))) == NULL) {
+			stderror();
+			return -1;
+		}
+		checkpoint->levels=tmp;
+		checkpoint->capacity+=16;
+	}
+
+	// the directory lies on the resumed position if its parent does and it is the next unfinished sub directory
+	if ((checkpoint->matched == d) && (d < checkpoint->resumeDepth) &&
+		((d == 0) || (checkpoint->levels[d-1].done == checkpoint->resume[d-1].done))) {
+		if (checkpoint->resume[d].cluster == cluster) {
+			checkpoint->matched=d+1;
+			sorted=1;
+		} else {
+			myerror("Checkpoint does not match directory at cluster %08lx, resuming from here!", cluster);
+			checkpoint->resumeDepth=d;
+		}
+	}
+
+	checkpoint->levels[d].cluster=cluster;
+	checkpoint->levels[d].done=0;
+	checkpoint->depth++;
+
+	return sorted;
+}
+
+void checkpoint_leave(struct sCheckpoint *checkpoint) {
+/*
+	pops the current directory after its sub directories are finished
+*/
+	assert(checkpoint != NULL);
+	assert(checkpoint->depth > 0);
+
+	checkpoint->depth--;
+	if (checkpoint->matched > checkpoint->depth) checkpoint->matched=checkpoint->depth;
+	if (checkpoint->depth) checkpoint->levels[checkpoint->depth-1].done++;
+}
+
+int32_t checkpoint_due(struct sCheckpoint *checkpoint) {
+/*
+	checks whether it is time to save the checkpoint
+*/
+	assert(checkpoint != NULL);
+
+	return (time(NULL) - checkpoint->saved) >= CHECKPOINT_INTERVAL;
+}
+
+int32_t checkpoint_save(struct sCheckpoint *checkpoint) {
+/*
+	writes the traversal position to a temporary file and renames it to the checkpoint file
+*/
+	assert(checkpoint != NULL);
+
+	struct sCheckpointHeader header;
+	char *tmpPath;
+	FILE *fp;
+	int32_t ret;
+
+	if ((tmpPath=malloc(strlen(checkpoint->path)+5)) == NULL) {
+		stderror();
+		return -1;
+	}
+	strcpy(tmpPath, checkpoint->path);
+	strcat(tmpPath, ".tmp");
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.volume=checkpoint->volume;
+	header.depth=checkpoint->depth;
+
+	if ((fp=fopen(tmpPath, "wb")) == NULL) {
+		stderror();
+		free(tmpPath);
+		return -1;
+	}
+
+	ret=(fwrite(&header, sizeof(header), 1, fp) != 1) ||
+		(checkpoint->depth && (fwrite(checkpoint->levels, sizeof(struct sCheckpointLevel), checkpoint->depth, fp) != checkpoint->depth)) ||
+		fflush(fp) ||
+#if defined __WIN32__
+		_commit(_fileno(fp));
+#else
+		fsync(fileno(fp));
+#endif
+	if (fclose(fp)) ret=1;
+
+#if defined __WIN32__
+	// rename does not replace existing files on Windows
+	if (!ret) remove(checkpoint->path);
+#endif
+	if (ret || rename(tmpPath, checkpoint->path)) {
+		stderror();
+		remove(tmpPath);
+		free(tmpPath);
+		return -1;
+	}
+
+	free(tmpPath);
+	checkpoint->saved=time(NULL);
+
+	return 0;
+}
+
+void checkpoint_close(struct sCheckpoint *checkpoint, int32_t complete) {
+/*
+	frees the checkpoint and removes the checkpoint file if the traversal is complete
+*/
+	assert(checkpoint != NULL);
+
+	if (complete && remove(checkpoint->path) && (errno != ENOENT)) stderror();
+
+	free(checkpoint->levels);
+	free(checkpoint->resume);
+	free(checkpoint->path);
+	free(checkpoint);
+}
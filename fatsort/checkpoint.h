@@ -0,0 +1,80 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes checkpoints of the directory traversal.
+	A checkpoint holds the stack of directories that are being processed
+	together with the number of their sub directories that are finished,
+	so that an interrupted run can skip everything that was done already.
+*/
+
+#ifndef __checkpoint_h__
+#define __checkpoint_h__
+
+#include <stdint.h>
+#include <time.h>
+
+// minimum number of seconds between two checkpoints
+#define CHECKPOINT_INTERVAL 1
+
+struct sCheckpointLevel {
+/*
+	a directory on the traversal stack
+*/
+	uint32_t cluster;	// first cluster, 0 for the FAT12/16 root directory
+	uint32_t done;		// number of finished sub directories
+};
+
+struct sCheckpoint {
+/*
+	this structure contains the current and the resumed traversal position
+*/
+	char *path;
+	uint64_t volume;	// fingerprint of the file system
+	struct sCheckpointLevel *levels;
+	uint32_t depth;
+	uint32_t capacity;
+	struct sCheckpointLevel *resume;
+	uint32_t resumeDepth;
+	uint32_t matched;	// number of levels of the current stack that lie on the resumed position
+	time_t saved;
+};
+
+// creates a checkpoint for the file system with fingerprint volume, loads the last position if resume is set
+struct sCheckpoint *checkpoint_open(const char *path, uint64_t volume, int32_t resume);
+
+// checks whether the next sub directory of the current directory was finished before, counts it as done if so
+int32_t checkpoint_skip(struct sCheckpoint *checkpoint);
+
+// pushes a directory that is about to be sorted, returns 1 if it was sorted by the interrupted run
+int32_t checkpoint_enter(struct sCheckpoint *checkpoint, uint32_t cluster);
+
+// pops the current directory after its sub directories are finished
+void checkpoint_leave(struct sCheckpoint *checkpoint);
+
+// checks whether it is time to save the checkpoint
+int32_t checkpoint_due(struct sCheckpoint *checkpoint);
+
+// writes the traversal position atomically to the checkpoint file
+int32_t checkpoint_save(struct sCheckpoint *checkpoint);
+
+// frees the checkpoint and removes the checkpoint file if the traversal is complete
+void checkpoint_close(struct sCheckpoint *checkpoint, int32_t complete);
+
+#endif // __checkpoint_h__
@@ -0,0 +1,485 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+	This file contains/describes the consistency check of file systems.
+*/
+
+#include "consistency.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#include "errors.h"
+#include "endianness.h"
+#include "clusterchain.h"
+#include "misc.h"
+#include "mallocv.h"
+
+// a directory whose entries are checked later
+struct sCheckDir {
+	uint32_t cluster;
+	uint32_t count;		// valid clusters of the directory
+	uint32_t contiguous;	// exFAT directory without FAT chain
+};
+
+#define BIT_ISSET(bitmap, nr) ((bitmap)[(nr) / 8] & (1 << ((nr) % 8)))
+#define BIT_SET(bitmap, nr) ((bitmap)[(nr) / 8] |= (uint8_t) (1 << ((nr) % 8)))
+
+static void report(struct sConsistency *check, const char *str, ...) {
+/*
+	reports a problem unless too many were reported already
+*/
+	va_list argptr;
+
+	if (check->reports++ >= CONSISTENCY_MAX_REPORTS) return;
+
+	va_start(argptr, str);
+	fprintf(stderr, "checkConsistency: ");
+	vfprintf(stderr, str, argptr);
+	fprintf(stderr, "\n");
+	va_end(argptr);
+}
+
+static int32_t isAllocated(struct sConsistency *check, uint32_t cluster, uint32_t data) {
+/*
+	checks whether a cluster with FAT entry data is allocated
+*/
+	if (check->allocated != NULL) return BIT_ISSET(check->allocated, cluster-2) != 0;
+
+	return data != 0;
+}
+
+static uint32_t isInChain(struct sFileSystem *fs, uint32_t start, uint32_t steps, uint32_t cluster) {
+/*
+	checks whether cluster is one of the first steps clusters of the chain starting with start
+*/
+	uint32_t data;
+
+	while (steps--) {
+		if (start == cluster) return 1;
+		if (getFATEntry(fs, start, &data)) return 0;
+		start=data;
+	}
+
+	return 0;
+}
+
+static int32_t markChain(struct sFileSystem *fs, struct sConsistency *check, uint32_t owner,
+				uint32_t start, uint32_t contiguous, uint32_t *count) {
+/*
+	marks the clusters of a chain as used, contiguous is the length of exFAT chains
+	without FAT entries and 0 otherwise, count receives the number of valid clusters
+*/
+	uint32_t cluster=start, data=0, steps;
+
+	*count=0;
+
+	for (steps=0; ; steps++) {
+		if ((cluster < 2) || (cluster >= fs->clusters+2)) {
+			check->invalidRefs++;
+			report(check, "Chain of cluster %08x in directory %08x continues with invalid cluster %08x!", start, owner, cluster);
+			return 0;
+		}
+		if (!contiguous && getFATEntry(fs, cluster, &data)) {
+			myerror("Failed to get FAT entry!");
+			return -1;
+		}
+		if (BIT_ISSET(check->used, cluster)) {
+			if (!contiguous && isInChain(fs, start, steps, cluster)) {
+				check->cycles++;
+				report(check, "Chain of cluster %08x in directory %08x runs into itself at cluster %08x!", start, owner, cluster);
+			} else {
+				check->crossLinks++;
+				report(check, "Chain of cluster %08x in directory %08x is cross-linked at cluster %08x!", start, owner, cluster);
+			}
+			return 0;
+		}
+		if (!isAllocated(check, cluster, data)) {
+			check->freeRefs++;
+			report(check, "Chain of cluster %08x in directory %08x uses free cluster %08x!", start, owner, cluster);
+			return 0;
+		}
+
+		BIT_SET(check->used, cluster);
+		(*count)++;
+
+		if (contiguous) {
+			if (*count == contiguous) return 0;
+			cluster++;
+		} else {
+			if (isChainEnd(fs, data)) return 0;
+			cluster=data;
+		}
+	}
+}
+
+static int32_t pushDir(struct sCheckDir **dirs, uint32_t *n, uint32_t *size, uint32_t cluster, uint32_t count, uint32_t contiguous) {
+/*
+	puts a directory on the stack of directories that are checked later
+*/
+	struct sCheckDir *tmp;
+
+	if (*n == *size) {
+		if ((tmp=realloc(*dirs, sizeof(struct sCheckDir) * (*size ? *size * 2 : 64))) == NULL) {
+			stderror();
+			return -1;
+		}
+		*dirs=tmp;
+		*size=*size ? *size * 2 : 64;
+	}
+
+	(*dirs)[*n].cluster=cluster;
+	(*dirs)[*n].count=count;
+	(*dirs)[*n].contiguous=contiguous;
+	(*n)++;
+
+	return 0;
+}
+
+static char *readDir(struct sFileSystem *fs, struct sCheckDir *dir) {
+/*
+	reads the valid clusters of a directory into one buffer
+*/
+	struct sClusterChain *chain;
+	uint32_t cluster=dir->cluster, i;
+	char *data;
+
+	if ((chain=newClusterChain()) == NULL) {
+		myerror("Failed to generate new ClusterChain!");
+		return NULL;
+	}
+
+	// the chain was validated when the directory was found
+	for (i=0; i<dir->count; i++) {
+		if (insertCluster(chain, cluster) == -1) {
+			myerror("Failed to insert cluster!");
+			freeClusterChain(chain);
+			return NULL;
+		}
+		if (dir->contiguous) {
+			cluster++;
+		} else if (getFATEntry(fs, cluster, &cluster)) {
+			myerror("Failed to get FAT entry!");
+			freeClusterChain(chain);
+			return NULL;
+		}
+	}
+
+	data=readClusterChainData(fs, chain, dir->count);
+	freeClusterChain(chain);
+
+	return data;
+}
+
+static int32_t checkFATxxDir(struct sFileSystem *fs, struct sConsistency *check, uint32_t owner, const char *data, uint64_t size,
+				struct sCheckDir **dirs, uint32_t *n, uint32_t *max) {
+/*
+	marks the chains of all entries of a FATxx directory and puts its sub directories on the stack
+*/
+	const struct sShortDirEntry *sde;
+	uint64_t i;
+	uint32_t cluster, count;
+
+	for (i=0; i + DIR_ENTRY_SIZE <= size; i+=DIR_ENTRY_SIZE) {
+		sde=(const struct sShortDirEntry *) (data + i);
+
+		if (sde->DIR_Name[0] == 0) break;	// end of directory
+		if ((uint8_t) sde->DIR_Name[0] == DE_FREE) continue;
+		if ((sde->DIR_Atrr & ATTR_LONG_NAME_MASK) == ATTR_LONG_NAME) continue;
+		if (sde->DIR_Atrr & ATTR_VOLUME_ID) continue;
+		if (sde->DIR_Name[0] == '.') continue;	// . and ..
+
+		cluster=SwapInt16(sde->DIR_FstClusHI) * 65536 + SwapInt16(sde->DIR_FstClusLO);
+		if (fs->FATType != FATTYPE_FAT32) cluster=SwapInt16(sde->DIR_FstClusLO);
+
+		if (sde->DIR_Atrr & ATTR_DIRECTORY) {
+			check->dirs++;
+			if (cluster == 0) {
+				check->invalidRefs++;
+				report(check, "Sub directory in directory %08x has no cluster!", owner);
+				continue;
+			}
+		} else {
+			check->files++;
+			// empty files have no cluster
+			if (cluster == 0) continue;
+		}
+
+		if (markChain(fs, check, owner, cluster, 0, &count)) return -1;
+
+		if ((sde->DIR_Atrr & ATTR_DIRECTORY) && count && pushDir(dirs, n, max, cluster, count, 0)) return -1;
+	}
+
+	return 0;
+}
+
+static int32_t checkExFATDir(struct sFileSystem *fs, struct sConsistency *check, uint32_t owner, const char *data, uint64_t size,
+				struct sCheckDir **dirs, uint32_t *n, uint32_t *max) {
+/*
+	marks the chains of all entries of an exFAT directory and puts its sub directories on the stack
+*/
+	const struct sExFATDirEntry *de, *stream;
+	uint64_t i, len;
+	uint32_t cluster, count, contiguous, dir;
+
+	for (i=0; i + DIR_ENTRY_SIZE <= size; i+=DIR_ENTRY_SIZE) {
+		de=(const struct sExFATDirEntry *) (data + i);
+
+		if (de->type == EXFAT_ENTRY_EMPTY) break;	// end of directory
+		if (!(de->type & EXFAT_FLAG_INUSE)) continue;
+
+		if (EXFAT_ISTYPE((*de), EXFAT_ENTRY_ALLOC_BITMAP) || EXFAT_ISTYPE((*de), EXFAT_ENTRY_UPCASE_TABLE)) {
+			// bitmap and up-case table have the same layout and FAT chains
+			cluster=SwapInt32(de->entry.AllocationBitmapDirEntry.firstCluster);
+			if (markChain(fs, check, owner, cluster, 0, &count)) return -1;
+			continue;
+		}
+
+		if (!EXFAT_ISTYPE((*de), EXFAT_ENTRY_FILE)) continue;
+
+		// the stream extension follows the file entry
+		if (i + 2 * DIR_ENTRY_SIZE > size) break;
+		stream=(const struct sExFATDirEntry *) (data + i + DIR_ENTRY_SIZE);
+		i+=(uint64_t) de->entry.fileDirEntry.count * DIR_ENTRY_SIZE;
+		if (!EXFAT_ISTYPE((*stream), EXFAT_ENTRY_STREAM_EXTENSION)) {
+			check->invalidRefs++;
+			report(check, "File entry in directory %08x has no stream extension!", owner);
+			continue;
+		}
+
+		dir=EXFAT_HASATTR(de->entry.fileDirEntry, EXFAT_ATTR_DIR) != 0;
+		if (dir) check->dirs++; else check->files++;
+
+		cluster=SwapInt32(stream->entry.streamExtDirEntry.firstCluster);
+		len=(SwapInt64(stream->entry.streamExtDirEntry.dataLen) + fs->clusterSize - 1) / fs->clusterSize;
+		if ((cluster == 0) || (len == 0)) continue;
+
+		contiguous=0;
+		if (stream->entry.streamExtDirEntry.genSecFlags & EXFAT_GSFLAG_FAT_INVALID) {
+			if (len > fs->clusters) {
+				check->invalidRefs++;
+				report(check, "Contiguous file in directory %08x is larger than the file system!", owner);
+				continue;
+			}
+			contiguous=(uint32_t) len;
+		}
+
+		if (markChain(fs, check, owner, cluster, contiguous, &count)) return -1;
+
+		if (dir && count && pushDir(dirs, n, max, cluster, count, contiguous)) return -1;
+	}
+
+	return 0;
+}
+
+static int32_t loadAllocationBitmap(struct sFileSystem *fs, struct sConsistency *check) {
+/*
+	reads the allocation bitmap of an exFAT file system
+*/
+	struct sClusterChain *chain;
+	int32_t clen;
+
+	if ((chain=newClusterChain()) == NULL) {
+		myerror("Failed to generate new ClusterChain!");
+		return -1;
+	}
+
+	if ((clen=getClusterChain(fs, fs->allocBitmapFirstCluster, chain)) == -1) {
+		myerror("Failed to get cluster chain of allocation bitmap!");
+		freeClusterChain(chain);
+		return -1;
+	}
+
+	if ((uint64_t) clen * fs->clusterSize < ((uint64_t) fs->clusters + 7) / 8) {
+		myerror("Allocation bitmap is too small!");
+		freeClusterChain(chain);
+		return -1;
+	}
+
+	check->allocated=readClusterChainData(fs, chain, (uint32_t) clen);
+	freeClusterChain(chain);
+
+	return (check->allocated == NULL) ? -1 : 0;
+}
+
+static int32_t findLostClusters(struct sFileSystem *fs, struct sConsistency *check) {
+/*
+	counts allocated clusters that are not used and the chains they form in one pass over the FAT
+*/
+	uint8_t *pointed;
+	uint32_t i, data;
+
+	// lost clusters that another lost cluster points to, the others start lost chains
+	if ((pointed=malloc(((size_t) fs->clusters + 2) / 8 + 1)) == NULL) {
+		stderror();
+		return -1;
+	}
+	memset(pointed, 0, ((size_t) fs->clusters + 2) / 8 + 1);
+
+	for (i=2; i<fs->clusters+2; i++) {
+		if (getFATEntry(fs, i, &data)) {
+			myerror("Failed to get FAT entry!");
+			free(pointed);
+			return -1;
+		}
+		if (BIT_ISSET(check->used, i) || !isAllocated(check, i, data) || isBadCluster(fs, data)) continue;
+
+		check->lostClusters++;
+		if ((data >= 2) && (data < fs->clusters+2) && !isChainEnd(fs, data)) {
+			BIT_SET(pointed, data);
+		} else if ((check->allocated != NULL) && (data == 0) && (i+1 < fs->clusters+2)) {
+			// exFAT clusters without FAT entry continue contiguously
+			BIT_SET(pointed, i+1);
+		}
+	}
+
+	for (i=2; i<fs->clusters+2; i++) {
+		if (BIT_ISSET(check->used, i) || BIT_ISSET(pointed, i)) continue;
+		if (getFATEntry(fs, i, &data)) {
+			myerror("Failed to get FAT entry!");
+			free(pointed);
+			return -1;
+		}
+		if (!isAllocated(check, i, data) || isBadCluster(fs, data)) continue;
+
+		check->lostChains++;
+		report(check, "Lost cluster chain starts at cluster %08x!", i);
+	}
+
+	free(pointed);
+
+	return 0;
+}
+
+static int32_t checkTree(struct sFileSystem *fs, struct sConsistency *check) {
+/*
+	marks the chains of all files and directories, depth first so the stack
+	of directories stays as small as the tree is deep
+*/
+	struct sCheckDir *dirs=NULL, dir;
+	uint32_t n=0, max=0, count, root;
+	uint64_t size;
+	off_t offset;
+	char *data;
+	int32_t ret;
+
+	// the root directory of FAT12 and FAT16 lies in front of the data region
+	if ((fs->FATType == FATTYPE_FAT12) || (fs->FATType == FATTYPE_FAT16)) {
+		offset=((off_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) +
+			(off_t) fs->bs.xxFATxx.FAT12_16_32.BS_NumFATs * fs->FATSize) * fs->sectorSize;
+		size=(uint64_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RootEntCnt) * DIR_ENTRY_SIZE;
+
+		if ((data=malloc(size ? size : 1)) == NULL) {
+			stderror();
+			return -1;
+		}
+		if (device_pread(fs->device, data, size, offset) < (int64_t) size) {
+			myerror("Failed to read root directory!");
+			free(data);
+			return -1;
+		}
+		ret=checkFATxxDir(fs, check, 0, data, size, &dirs, &n, &max);
+		free(data);
+		if (ret) {
+			free(dirs);
+			return -1;
+		}
+	} else {
+		if (fs->FATType == FATTYPE_EXFAT) {
+			root=SwapInt32(fs->bs.xxFATxx.exFAT.rootdir_cluster);
+		} else {
+			root=SwapInt32(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_RootClus);
+		}
+		if (markChain(fs, check, 0, root, 0, &count) ||
+			(count && pushDir(&dirs, &n, &max, root, count, 0))) {
+			free(dirs);
+			return -1;
+		}
+	}
+
+	while (n) {
+		dir=dirs[--n];
+
+		if ((data=readDir(fs, &dir)) == NULL) {
+			myerror("Failed to read directory %08x!", dir.cluster);
+			free(dirs);
+			return -1;
+		}
+
+		size=(uint64_t) dir.count * fs->clusterSize;
+		if (fs->FATType == FATTYPE_EXFAT) {
+			ret=checkExFATDir(fs, check, dir.cluster, data, size, &dirs, &n, &max);
+		} else {
+			ret=checkFATxxDir(fs, check, dir.cluster, data, size, &dirs, &n, &max);
+		}
+		free(data);
+		if (ret) {
+			free(dirs);
+			return -1;
+		}
+	}
+
+	free(dirs);
+
+	return 0;
+}
+
+int32_t checkConsistency(struct sFileSystem *fs) {
+/*
+	checks the directory tree and the FAT, returns 0 if consistent, 1 if not and -1 on error
+*/
+	assert(fs != NULL);
+
+	struct sConsistency check;
+	int32_t ret;
+
+	memset(&check, 0, sizeof(check));
+
+	if ((check.used=malloc(((size_t) fs->clusters + 2) / 8 + 1)) == NULL) {
+		stderror();
+		return -1;
+	}
+	memset(check.used, 0, ((size_t) fs->clusters + 2) / 8 + 1);
+
+	if (((fs->FATType == FATTYPE_EXFAT) && loadAllocationBitmap(fs, &check)) ||
+		checkTree(fs, &check) || findLostClusters(fs, &check)) {
+		free(check.used);
+		free(check.allocated);
+		return -1;
+	}
+
+	free(check.used);
+	free(check.allocated);
+
+	infomsg("Checked %" PRIu64 " directories and %" PRIu64 " files.\n", check.dirs, check.files);
+
+	ret=check.crossLinks || check.cycles || check.freeRefs || check.invalidRefs || check.lostClusters;
+	if (ret) {
+		myerror("%" PRIu64 " cross-links, %" PRIu64 " cyclic chains, %" PRIu64 " chains into free clusters, %" PRIu64 " invalid references!",
+			check.crossLinks, check.cycles, check.freeRefs, check.invalidRefs);
+		myerror("%" PRIu64 " lost clusters in %" PRIu64 " chains!", check.lostClusters, check.lostChains);
+	}
+
+	return ret;
+}
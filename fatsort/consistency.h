@@ -0,0 +1,57 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+	This file contains/describes the consistency check of file systems.
+	The directory tree is traversed once and every cluster that a file or
+	directory uses is marked in a bitmap, then one pass over the FAT finds
+	allocated clusters that nothing uses.
+*/
+
+#ifndef __consistency_h__
+#define __consistency_h__
+
+#include <stdint.h>
+#include "FAT_fs.h"
+
+// number of problems that are reported in detail
+#define CONSISTENCY_MAX_REPORTS 10
+
+struct sConsistency {
+/*
+	this structure contains the state and the findings of a consistency check
+*/
+	uint8_t *used;		// bitmap of clusters used by files and directories
+	uint8_t *allocated;	// allocation bitmap of exFAT, NULL for FATxx
+	uint64_t crossLinks;	// clusters used by more than one chain
+	uint64_t cycles;	// chains that run into themselves
+	uint64_t freeRefs;	// chains that continue in free clusters
+	uint64_t invalidRefs;	// chains that continue outside of the data region
+	uint64_t lostClusters;	// allocated clusters that are not used
+	uint64_t lostChains;
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t reports;
+};
+
+// checks the directory tree and the FAT, returns 0 if consistent, 1 if not and -1 on error
+int32_t checkConsistency(struct sFileSystem *fs);
+
+#endif // __consistency_h__
@@ -28,8 +28,28 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <time.h>
+
+#if defined __LINUX__
+#include <linux/fs.h>
+#include <sys/sysmacros.h>
+#elif defined __BSD__ || defined __OSX__
+#include <sys/disk.h>
+#endif
+
+#if defined __LINUX__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
 
 #elif defined __WIN32__
 
@@ -54,75 +74,2292 @@ typedef struct _STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR {
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include <assert.h>
 
-#include "mallocv.h"
-#include "errors.h"
+#include "mallocv.h"
+#include "errors.h"
+
+#if defined __LINUX__ || defined __BSD__ || defined __OSX__ 
+
+// a single cached block of the device
+struct sCacheBlock {
+  uint64_t nr;				// block number (offset / block size)
+  uint32_t len;				// number of valid bytes in the block
+  int dirty;				// block contains changes not yet written to the device
+  char *data;
+  struct sCacheBlock *prev, *next;	// LRU list, most recently used block first
+  struct sCacheBlock *hnext;		// next block in hash bucket
+};
+
+// a block of the copy-on-write overlay
+struct sOverlayBlock {
+  uint64_t nr;				// block number (offset / block size)
+  uint32_t len;				// number of bytes the device has in this block
+  char *data;
+  uint8_t *dirty;			// bitmap of the written sectors of staged blocks, NULL otherwise
+  struct sOverlayBlock *hnext;		// next block in hash bucket
+};
+
+// in-memory copy of all blocks that have been written
+struct sDeviceOverlay {
+  uint32_t blockSize;
+  uint32_t hashMask;
+  uint32_t count;
+  struct sOverlayBlock **hash;
+  uint64_t writes, bytes;
+  int writeBack;			// blocks are staged and their written sectors are written back on sync
+  uint32_t maxBlocks;			// staged blocks that trigger a write back
+  uint32_t sectorSize;			// granularity of the dirty bitmaps of staged blocks
+};
+
+#define OVERLAY_ISDIRTY(b, sector) (((b)->dirty[(sector) / 8] >> ((sector) % 8)) & 1)
+
+// state of the slow device emulation
+struct sDeviceEmulator {
+  struct sDeviceModel model;
+  int64_t last;				// end of the previous request
+  uint64_t total;			// nanoseconds added so far
+  uint64_t debt;			// nanoseconds not slept yet
+};
+
+// trace file that receives a record for each call
+struct sDeviceTrace {
+  FILE *fp;
+  struct timespec start;
+};
+
+// LRU cache of aligned device blocks
+struct sDeviceCache {
+  uint32_t blockSize;
+  uint32_t blockCount;
+  uint32_t used;			// number of blocks in use
+  uint32_t hashMask;
+  char *data;				// block data, aligned for direct i/o
+  void *mem;
+  struct sCacheBlock *blocks;
+  struct sCacheBlock **hash;
+  struct sCacheBlock *first, *last;
+  uint64_t hits, misses;
+};
+
+static int64_t fd_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+  device->stats.syscalls++;
+#if defined __BSD__ || defined __OSX__
+  return pread(device->fd, data, (size_t) size, (off_t) (device->base + offset));
+#else
+  return pread64(device->fd, data, (size_t) size, (off64_t) (device->base + offset));
+#endif
+}
+
+static int64_t fd_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+  device->stats.syscalls++;
+#if defined __BSD__ || defined __OSX__
+  return pwrite(device->fd, data, (size_t) size, (off_t) (device->base + offset));
+#else
+  return pwrite64(device->fd, data, (size_t) size, (off64_t) (device->base + offset));
+#endif
+}
+
+static int64_t fd_preadv(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
+#if defined __OSX__
+  // preadv is not available before macOS 11, so read buffer by buffer
+  int i;
+  int64_t ret, total=0;
+
+  for (i=0; i<iovcnt; i++) {
+    device->stats.syscalls++;
+    ret=pread(device->fd, iov[i].iov_base, iov[i].iov_len, (off_t) (device->base + offset + total));
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
+
+  return total;
+#elif defined __BSD__
+  device->stats.syscalls++;
+  return preadv(device->fd, iov, iovcnt, (off_t) (device->base + offset));
+#else
+  device->stats.syscalls++;
+  return preadv64(device->fd, iov, iovcnt, (off64_t) (device->base + offset));
+#endif
+}
+
+static int64_t fd_pwritev(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
+#if defined __OSX__
+  // pwritev is not available before macOS 11, so write buffer by buffer
+  int i;
+  int64_t ret, total=0;
+
+  for (i=0; i<iovcnt; i++) {
+    device->stats.syscalls++;
+    ret=pwrite(device->fd, iov[i].iov_base, iov[i].iov_len, (off_t) (device->base + offset + total));
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
+
+  return total;
+#elif defined __BSD__
+  device->stats.syscalls++;
+  return pwritev(device->fd, iov, iovcnt, (off_t) (device->base + offset));
+#else
+  device->stats.syscalls++;
+  return pwritev64(device->fd, iov, iovcnt, (off64_t) (device->base + offset));
+#endif
+}
+
+// number of bytes of a transfer on the descriptor that lie inside the view
+static uint64_t view_clamp(DEVICE *device, uint64_t size, int64_t offset) {
+
+  // the mapping of a view is limited to the view already
+  if (!device->view || (device->map != NULL)) return size;
+
+  if ((uint64_t) offset >= device->viewSize) return 0;
+  if (size > device->viewSize - (uint64_t) offset) size=device->viewSize - (uint64_t) offset;
+
+  return size;
+}
+
+static int64_t map_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  // reads beyond the end of the mapping are short like for files
+  if ((uint64_t) offset >= device->mapSize) return 0;
+  if (size > device->mapSize - (uint64_t) offset) size=device->mapSize - (uint64_t) offset;
+
+  memcpy(data, device->map+offset, (size_t) size);
+
+  return (int64_t) size;
+}
+
+static int64_t map_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  // a mapping cannot grow, so writes beyond its end are short
+  if ((uint64_t) offset >= device->mapSize) return 0;
+  if (size > device->mapSize - (uint64_t) offset) size=device->mapSize - (uint64_t) offset;
+
+  memcpy(device->map+offset, data, (size_t) size);
+
+  return (int64_t) size;
+}
+
+// flushes a range of the mapping, which does not start at a page boundary for views
+static int map_sync(DEVICE *device, int64_t offset, uint64_t size) {
+
+  uintptr_t start, page=(uintptr_t) sysconf(_SC_PAGESIZE);
+
+  if ((uint64_t) offset >= device->mapSize) return 0;
+  if (size > device->mapSize - (uint64_t) offset) size=device->mapSize - (uint64_t) offset;
+
+  // msync needs a page aligned address
+  start=(uintptr_t) (device->map + offset);
+  device->stats.syscalls++;
+
+  return msync((void *) (start - start % page), (size_t) (size + start % page), MS_SYNC);
+}
+
+// allocates size bytes aligned to align bytes, *mem receives the pointer to be freed
+static void *alignedmalloc(size_t size, size_t align, void **mem) {
+
+  if ((*mem=malloc(size + align)) == NULL) return NULL;
+
+  return (void *) (((uintptr_t) *mem + align - 1) & ~((uintptr_t) align - 1));
+}
+
+// checks whether a transfer meets the alignment requirements of direct i/o
+static int direct_aligned(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+  return !((((uintptr_t) data) | (uintptr_t) size | (uintptr_t) offset) & (device->logicalSectorSize-1));
+}
+
+// reads unaligned data through an aligned bounce buffer
+static int64_t direct_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  uint32_t align=device->logicalSectorSize;
+  int64_t start=offset - offset % align, ret;
+  uint64_t len=((uint64_t) (offset-start) + size + align - 1) / align * align;
+  void *mem;
+  char *buffer;
+
+  if ((buffer=alignedmalloc((size_t) len, align, &mem)) == NULL) {
+    stderror();
+    return -1;
+  }
+
+  if ((ret=fd_pread(device, buffer, len, start)) != -1) {
+    // number of requested bytes actually read
+    ret=(ret > offset-start) ? ret - (offset-start) : 0;
+    if ((uint64_t) ret > size) ret=(int64_t) size;
+    memcpy(data, buffer + (offset-start), (size_t) ret);
+  }
+
+  free(mem);
+
+  return ret;
+}
+
+// writes unaligned data with a read-modify-write cycle of the first and last sector
+static int64_t direct_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  uint32_t align=device->logicalSectorSize;
+  int64_t start=offset - offset % align, ret=0;
+  uint64_t len=((uint64_t) (offset-start) + size + align - 1) / align * align;
+  void *mem;
+  char *buffer;
+
+  if ((buffer=alignedmalloc((size_t) len, align, &mem)) == NULL) {
+    stderror();
+    return -1;
+  }
+
+  memset(buffer, 0, (size_t) len);
+  if (offset != start) {
+    ret=fd_pread(device, buffer, align, start);
+  }
+  if ((ret != -1) && ((offset+size) % align) && ((len > align) || (offset == start))) {
+    ret=fd_pread(device, buffer + len - align, align, start + (int64_t) len - align);
+  }
+
+  if (ret != -1) {
+    memcpy(buffer + (offset-start), data, (size_t) size);
+    if ((ret=fd_pwrite(device, buffer, len, start)) != -1) {
+      ret=(ret > offset-start) ? ret - (offset-start) : 0;
+      if ((uint64_t) ret > size) ret=(int64_t) size;
+    }
+  }
+
+  free(mem);
+
+  return ret;
+}
+
+static void emulate(DEVICE *device, int64_t offset, uint64_t size, int write) {
+  // charges a media access according to the device model and sleeps once a millisecond has accumulated
+
+  struct sDeviceEmulator *emu=device->emulator;
+  struct sDeviceModel *m;
+  struct timespec ts;
+  uint64_t ns, dist, bytes=size, rate;
+
+  if (emu == NULL) return;
+  m=&emu->model;
+
+  ns=(uint64_t) m->latency * 1000;
+
+  if (offset != emu->last) {
+    dist=(offset > emu->last) ? (uint64_t) (offset - emu->last) : (uint64_t) (emu->last - offset);
+    ns+=(dist >> 20) * m->seek * 1000 >> 10;
+  }
+
+  // flash rewrites whole pages
+  if (write && m->page) {
+    bytes=((uint64_t) offset + size + m->page - 1) / m->page * m->page - (uint64_t) offset / m->page * m->page;
+  }
+
+  if ((rate=write ? m->writeRate : m->readRate) != 0) ns+=bytes * 1000000000 / (rate * 1024);
+
+  emu->last=offset + (int64_t) size;
+  emu->total+=ns;
+  emu->debt+=ns;
+
+  if (emu->debt >= 1000000) {
+    ts.tv_sec=(time_t) (emu->debt / 1000000000);
+    ts.tv_nsec=(long) (emu->debt % 1000000000);
+    while (nanosleep(&ts, &ts) && (errno == EINTR));
+    emu->debt=0;
+  }
+}
+
+static void media_access(DEVICE *device, int64_t offset, uint64_t size, int write) {
+  // counts an access to the media and its seek distance, then charges it to the emulated device
+
+  struct sDeviceStats *st=&device->stats;
+  uint64_t dist;
+  uint32_t bucket=0;
+
+  if (write) {
+    st->mediaWrites++;
+    st->mediaBytesWritten+=size;
+  } else {
+    st->mediaReads++;
+    st->mediaBytesRead+=size;
+  }
+
+  if (offset != device->mediaEnd) {
+    dist=(offset > device->mediaEnd) ? (uint64_t) (offset - device->mediaEnd) : (uint64_t) (device->mediaEnd - offset);
+    while ((dist >> (bucket+1)) && (bucket < DEVICE_SEEK_BUCKETS-1)) bucket++;
+    st->seeks++;
+    st->seekBytes+=dist;
+    st->seekHistogram[bucket]++;
+  }
+  device->mediaEnd=offset + (int64_t) size;
+
+  emulate(device, offset, size, write);
+}
+
+// uncached i/o on the mapping or on the file descriptor, honoring direct i/o alignment
+static int64_t media_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  if (device->map != NULL) return map_pread(device, data, size, offset);
+
+  if (!(size=view_clamp(device, size, offset))) return 0;
+
+  if (device->direct && !direct_aligned(device, data, size, offset)) return direct_pread(device, data, size, offset);
+
+  return fd_pread(device, data, size, offset);
+}
+
+static int64_t media_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  if (device->map != NULL) return map_pwrite(device, data, size, offset);
+
+  if (!(size=view_clamp(device, size, offset))) return 0;
+
+  if (device->direct && !direct_aligned(device, data, size, offset)) return direct_pwrite(device, data, size, offset);
+
+  return fd_pwrite(device, data, size, offset);
+}
+
+static int64_t raw_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  media_access(device, offset, size, 0);
+
+  return media_pread(device, data, size, offset);
+}
+
+static int64_t raw_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  media_access(device, offset, size, 1);
+
+  return media_pwrite(device, data, size, offset);
+}
+
+static int64_t raw_preadv(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
+
+  int i;
+  int64_t ret, total=0;
+  uint64_t size=0;
+
+  // a vectored request is a single access to the media
+  for (i=0; i<iovcnt; i++) size+=iov[i].iov_len;
+  media_access(device, offset, size, 0);
+
+  // requests crossing the end of a view are split up and clamped
+  if ((device->map == NULL) && !device->direct && (view_clamp(device, size, offset) == size)) {
+    return fd_preadv(device, iov, iovcnt, offset);
+  }
+
+  for (i=0; i<iovcnt; i++) {
+    ret=media_pread(device, iov[i].iov_base, iov[i].iov_len, offset+total);
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
+
+  return total;
+}
+
+static int64_t raw_pwritev(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
+
+  int i;
+  int64_t ret, total=0;
+  uint64_t size=0;
+
+  for (i=0; i<iovcnt; i++) size+=iov[i].iov_len;
+  media_access(device, offset, size, 1);
+
+  if ((device->map == NULL) && !device->direct && (view_clamp(device, size, offset) == size)) {
+    return fd_pwritev(device, iov, iovcnt, offset);
+  }
+
+  for (i=0; i<iovcnt; i++) {
+    ret=media_pwrite(device, iov[i].iov_base, iov[i].iov_len, offset+total);
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
+
+  return total;
+}
+
+// a single read request of a batch
+struct sDeviceRequest {
+  void *data;
+  uint64_t size;
+  int64_t offset;
+  int64_t result;			// number of bytes read, -1 on error
+};
+
+#ifdef HAVE_IO_URING
+
+// submission and completion queues shared with the kernel
+struct sDeviceRing {
+  int fd;
+  uint32_t entries;
+  uint32_t *sqHead, *sqTail, *sqMask, *sqArray;
+  uint32_t *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize, sqesSize;
+};
+
+static void ring_close(struct sDeviceRing *ring) {
+
+  if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+  if ((ring->cqRing != MAP_FAILED) && (ring->cqRing != ring->sqRing)) munmap(ring->cqRing, ring->cqRingSize);
+  if (ring->sqRing != MAP_FAILED) munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+  free(ring);
+}
+
+// sets up an io_uring instance, returns NULL if the kernel does not support it
+static struct sDeviceRing *ring_open(uint32_t entries) {
+
+  struct io_uring_params p;
+  struct sDeviceRing *ring;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd=(int) syscall(__NR_io_uring_setup, entries, &p)) < 0) return NULL;
+
+  if ((ring=malloc(sizeof(struct sDeviceRing))) == NULL) {
+    stderror();
+    close(fd);
+    return NULL;
+  }
+
+  ring->fd=fd;
+  ring->entries=p.sq_entries;
+  ring->sqRingSize=p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  ring->cqRingSize=p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqesSize=p.sq_entries * sizeof(struct io_uring_sqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqRingSize > ring->sqRingSize) ring->sqRingSize=ring->cqRingSize;
+    ring->cqRingSize=ring->sqRingSize;
+  }
+
+  ring->sqRing=mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing=ring->sqRing;
+  } else {
+    ring->cqRing=mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes=mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if ((ring->sqRing == MAP_FAILED) || (ring->cqRing == MAP_FAILED) || (ring->sqes == MAP_FAILED)) {
+    ring_close(ring);
+    return NULL;
+  }
+
+  ring->sqHead=(uint32_t *) ((char *) ring->sqRing + p.sq_off.head);
+  ring->sqTail=(uint32_t *) ((char *) ring->sqRing + p.sq_off.tail);
+  ring->sqMask=(uint32_t *) ((char *) ring->sqRing + p.sq_off.ring_mask);
+  ring->sqArray=(uint32_t *) ((char *) ring->sqRing + p.sq_off.array);
+  ring->cqHead=(uint32_t *) ((char *) ring->cqRing + p.cq_off.head);
+  ring->cqTail=(uint32_t *) ((char *) ring->cqRing + p.cq_off.tail);
+  ring->cqMask=(uint32_t *) ((char *) ring->cqRing + p.cq_off.ring_mask);
+  ring->cqes=(struct io_uring_cqe *) ((char *) ring->cqRing + p.cq_off.cqes);
+
+  return ring;
+}
+
+static void ring_reap(DEVICE *device, struct sDeviceRequest *req, uint32_t *inflight) {
+  // collects all completions that are available, the media access was charged when the batch started
+
+  struct sDeviceRing *ring=device->ring;
+  struct io_uring_cqe *cqe;
+  struct sDeviceRequest *r;
+  uint32_t head;
+  int64_t ret;
+
+  head=*ring->cqHead;
+  while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    cqe=&ring->cqes[head & *ring->cqMask];
+    r=&req[cqe->user_data];
+    if (cqe->res < 0) {
+      // e.g. IORING_OP_READ not supported by older kernels, retry synchronously
+      r->result=media_pread(device, r->data, r->size, r->offset);
+    } else {
+      r->result=cqe->res;
+      // complete short reads synchronously
+      if (((uint64_t) r->result < r->size) && (r->result > 0)) {
+        ret=media_pread(device, (char *) r->data + r->result, r->size - (uint64_t) r->result, r->offset + r->result);
+        if (ret > 0) r->result+=ret;
+      }
+    }
+    head++;
+    (*inflight)--;
+  }
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static void ring_drain(DEVICE *device, struct sDeviceRequest *req, uint32_t *inflight) {
+  // waits for all requests the kernel has accepted, their buffers must not be reused before
+
+  struct sDeviceRing *ring=device->ring;
+  struct timespec ts;
+
+  for (;;) {
+    ring_reap(device, req, inflight);
+    if (!*inflight) break;
+    if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      // the completions arrive anyway, so poll for them
+      ts.tv_sec=0;
+      ts.tv_nsec=1000000;
+      nanosleep(&ts, NULL);
+    }
+  }
+}
+
+// submits all requests, keeping at most ring->entries in flight, and reaps them as they complete
+static int ring_preadbatch(DEVICE *device, struct sDeviceRequest *req, uint32_t n) {
+
+  struct sDeviceRing *ring=device->ring;
+  struct io_uring_sqe *sqe;
+  uint32_t i=0, inflight=0, tail, head, idx;
+  int err=0;
+
+  // requests that are never submitted or completed keep failing
+  for (i=0; i<n; i++) req[i].result=-1;
+  i=0;
+
+  while ((i < n) || inflight) {
+
+    tail=*ring->sqTail;
+    while ((i < n) && (inflight < ring->entries)) {
+      // requests that do not fit into a single sqe are read synchronously
+      if (req[i].size > UINT32_MAX) {
+        req[i].result=media_pread(device, req[i].data, req[i].size, req[i].offset);
+        i++;
+        continue;
+      }
+      req[i].size=view_clamp(device, req[i].size, req[i].offset);
+      idx=tail & *ring->sqMask;
+      sqe=&ring->sqes[idx];
+      memset(sqe, 0, sizeof(struct io_uring_sqe));
+      sqe->opcode=IORING_OP_READ;
+      sqe->fd=device->fd;
+      sqe->addr=(uint64_t) (uintptr_t) req[i].data;
+      sqe->len=(uint32_t) req[i].size;
+      sqe->off=(uint64_t) (device->base + req[i].offset);
+      sqe->user_data=i;
+      ring->sqArray[idx]=idx;
+      tail++;
+      i++;
+      inflight++;
+    }
+    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+    if (!inflight) break;
+
+    device->stats.syscalls++;
+    if (syscall(__NR_io_uring_enter, ring->fd, tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE),
+        1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      if (errno == EINTR) continue;
+      stderror();
+      // take back the requests the kernel has not seen yet, the others are still in flight
+      head=__atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+      inflight-=tail - head;
+      __atomic_store_n(ring->sqTail, head, __ATOMIC_RELEASE);
+      ring_drain(device, req, &inflight);
+      return -1;
+    }
+
+    ring_reap(device, req, &inflight);
+  }
+
+  for (i=0; i<n; i++) {
+    if (req[i].result == -1) err=-1;
+  }
+
+  return err;
+}
+
+#endif
+
+// reads a batch of requests with the selected backend
+static int raw_preadbatch(DEVICE *device, struct sDeviceRequest *req, uint32_t n) {
+
+  uint32_t i;
+  int err=0;
+
+#ifdef HAVE_IO_URING
+  if (device->ring != NULL) {
+    // the emulated device serves one request after the other
+    for (i=0; i<n; i++) media_access(device, req[i].offset, req[i].size, 0);
+    return ring_preadbatch(device, req, n);
+  }
+#endif
+
+  for (i=0; i<n; i++) {
+    if ((req[i].result=raw_pread(device, req[i].data, req[i].size, req[i].offset)) == -1) err=-1;
+  }
+
+  return err;
+}
+
+static void cache_unlink(struct sDeviceCache *cache, struct sCacheBlock *block) {
+
+  if (block->prev) block->prev->next=block->next;
+  else cache->first=block->next;
+  if (block->next) block->next->prev=block->prev;
+  else cache->last=block->prev;
+}
+
+static void cache_pushfront(struct sDeviceCache *cache, struct sCacheBlock *block) {
+
+  block->prev=NULL;
+  block->next=cache->first;
+  if (cache->first) cache->first->prev=block;
+  else cache->last=block;
+  cache->first=block;
+}
+
+static uint32_t cache_bucket(struct sDeviceCache *cache, uint64_t nr) {
+  return (uint32_t) ((nr * 0x9E3779B97F4A7C15ULL) >> 32) & cache->hashMask;
+}
+
+static void cache_unhash(struct sDeviceCache *cache, struct sCacheBlock *block) {
+
+  struct sCacheBlock **b=&cache->hash[cache_bucket(cache, block->nr)];
+
+  while (*b != block) b=&(*b)->hnext;
+  *b=block->hnext;
+}
+
+static int cache_writeback(DEVICE *device, struct sCacheBlock *block) {
+
+  struct sDeviceCache *cache=device->cache;
+
+  if (raw_pwrite(device, block->data, block->len, (int64_t) block->nr * cache->blockSize) < block->len) {
+    myerror("Failed to write back cached block %" PRIu64 "!", block->nr);
+    return -1;
+  }
+  block->dirty=0;
+
+  return 0;
+}
+
+static int cache_compare(const void *a, const void *b) {
+
+  uint64_t nra=(*(struct sCacheBlock **) a)->nr, nrb=(*(struct sCacheBlock **) b)->nr;
+
+  return (nra > nrb) - (nra < nrb);
+}
+
+// writes back all dirty blocks in ascending order, merging adjacent blocks
+static int cache_flush(DEVICE *device) {
+
+  struct sDeviceCache *cache=device->cache;
+  struct sCacheBlock **dirty;
+  struct iovec iov[64];
+  uint32_t i, j, n=0;
+  uint64_t size;
+
+  if ((dirty=malloc(cache->used * sizeof(struct sCacheBlock *) + 1)) == NULL) {
+    stderror();
+    return -1;
+  }
+
+  for (i=0; i<cache->used; i++) {
+    if (cache->blocks[i].dirty) dirty[n++]=&cache->blocks[i];
+  }
+  qsort(dirty, n, sizeof(struct sCacheBlock *), cache_compare);
+
+  for (i=0; i<n; i=j) {
+    size=0;
+    for (j=i; (j < n) && (j-i < 64); j++) {
+      if ((j > i) && ((dirty[j]->nr != dirty[j-1]->nr+1) || (dirty[j-1]->len != cache->blockSize))) break;
+      iov[j-i].iov_base=dirty[j]->data;
+      iov[j-i].iov_len=dirty[j]->len;
+      size+=dirty[j]->len;
+    }
+    if (raw_pwritev(device, iov, (int) (j-i), (int64_t) dirty[i]->nr * cache->blockSize) < (int64_t) size) {
+      myerror("Failed to write back cached blocks %" PRIu64 "-%" PRIu64 "!", dirty[i]->nr, dirty[j-1]->nr);
+      free(dirty);
+      return -1;
+    }
+    for (; i<j; i++) dirty[i]->dirty=0;
+  }
+
+  free(dirty);
+
+  return 0;
+}
+
+static struct sCacheBlock *cache_lookup(struct sDeviceCache *cache, uint64_t nr) {
+
+  struct sCacheBlock *block;
+
+  for (block=cache->hash[cache_bucket(cache, nr)]; block != NULL; block=block->hnext) {
+    if (block->nr == nr) return block;
+  }
+
+  return NULL;
+}
+
+// assigns a free or the least recently used block to block number nr
+static struct sCacheBlock *cache_newblock(DEVICE *device, uint64_t nr) {
+
+  struct sDeviceCache *cache=device->cache;
+  struct sCacheBlock *block;
+  uint32_t bucket=cache_bucket(cache, nr);
+
+  if (cache->used < cache->blockCount) {
+    block=&cache->blocks[cache->used++];
+  } else {
+    // evict least recently used block
+    block=cache->last;
+    if (block->dirty && cache_writeback(device, block)) return NULL;
+    cache_unlink(cache, block);
+    cache_unhash(cache, block);
+  }
+
+  block->nr=nr;
+  block->dirty=0;
+  block->len=0;
+  block->hnext=cache->hash[bucket];
+  cache->hash[bucket]=block;
+  cache_pushfront(cache, block);
+
+  return block;
+}
+
+// invalidates a block that could not be read and moves it to the end of the LRU list
+static void cache_discard(struct sDeviceCache *cache, struct sCacheBlock *block) {
+
+  uint32_t bucket;
+
+  cache_unhash(cache, block);
+  cache_unlink(cache, block);
+
+  block->nr=UINT64_MAX;
+  block->len=0;
+  bucket=cache_bucket(cache, block->nr);
+  block->hnext=cache->hash[bucket];
+  cache->hash[bucket]=block;
+  block->next=NULL;
+  block->prev=cache->last;
+  if (cache->last) cache->last->next=block;
+  else cache->first=block;
+  cache->last=block;
+}
+
+// returns cached block nr, reading it from the device if load is set
+static struct sCacheBlock *cache_getblock(DEVICE *device, uint64_t nr, int load) {
+
+  struct sDeviceCache *cache=device->cache;
+  struct sCacheBlock *block;
+  int64_t ret;
+
+  if ((block=cache_lookup(cache, nr)) != NULL) {
+    cache->hits++;
+    if (block != cache->first) {
+      cache_unlink(cache, block);
+      cache_pushfront(cache, block);
+    }
+    return block;
+  }
+
+  cache->misses++;
+
+  if ((block=cache_newblock(device, nr)) == NULL) return NULL;
+
+  if (load) {
+    if ((ret=raw_pread(device, block->data, cache->blockSize, (int64_t) nr * cache->blockSize)) == -1) {
+      cache_discard(cache, block);
+      return NULL;
+    }
+    block->len=(uint32_t) ret;
+  }
+
+  return block;
+}
+
+static int64_t cache_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  struct sDeviceCache *cache=device->cache;
+  struct sCacheBlock *block;
+  uint64_t n, inBlock, total=0;
+
+  while (total < size) {
+    inBlock=(uint64_t) offset % cache->blockSize;
+    n=cache->blockSize - inBlock;
+    if (n > size-total) n=size-total;
+
+    if ((block=cache_getblock(device, (uint64_t) offset / cache->blockSize, 1)) == NULL) return -1;
+
+    // end of device reached
+    if (inBlock >= block->len) break;
+    if (n > block->len-inBlock) n=block->len-inBlock;
+
+    memcpy((char *) data+total, block->data+inBlock, n);
+    total+=n;
+    offset+=n;
+  }
+
+  return (int64_t) total;
+}
+
+static int64_t cache_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  struct sDeviceCache *cache=device->cache;
+  struct sCacheBlock *block;
+  uint64_t n, inBlock, total=0;
+
+  while (total < size) {
+    inBlock=(uint64_t) offset % cache->blockSize;
+    n=cache->blockSize - inBlock;
+    if (n > size-total) n=size-total;
+
+    // blocks that are overwritten completely need not be read first
+    if ((block=cache_getblock(device, (uint64_t) offset / cache->blockSize, n != cache->blockSize)) == NULL) return -1;
+
+    if (inBlock > block->len) memset(block->data+block->len, 0, inBlock-block->len);
+    memcpy(block->data+inBlock, (const char *) data+total, n);
+    if (inBlock+n > block->len) block->len=(uint32_t) (inBlock+n);
+    block->dirty=1;
+
+    total+=n;
+    offset+=n;
+  }
+
+  return (int64_t) total;
+}
+
+static void cache_free(DEVICE *device) {
+
+  free(device->cache->mem);
+  free(device->cache->blocks);
+  free(device->cache->hash);
+  free(device->cache);
+  device->cache=NULL;
+}
+
+// determines logical and physical sector size and optimal i/o size
+#if defined __LINUX__
+static uint32_t sysfs_value(struct stat *st, const char *attr) {
+  // reads a numeric attribute of a block device or of the disk of a partition
+
+  char path[128];
+  unsigned long value=0;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(st->st_rdev), minor(st->st_rdev), attr);
+  if ((fp=fopen(path, "r")) == NULL) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../%s", major(st->st_rdev), minor(st->st_rdev), attr);
+    if ((fp=fopen(path, "r")) == NULL) return 0;
+  }
+  if (fscanf(fp, "%lu", &value) != 1) value=0;
+  fclose(fp);
+
+  return (value <= UINT32_MAX) ? (uint32_t) value : 0;
+}
+#endif
+
+static void probe_geometry(DEVICE *dev, struct stat *st) {
+
+  dev->logicalSectorSize=512;
+  dev->sectorSize=512;
+  dev->physicalSectorSize=512;
+  dev->optimalIOSize=0;
+  dev->eraseUnitSize=0;
+
+  if (S_ISREG(st->st_mode)) {
+    // direct i/o on files has to be aligned to the file system block size
+    if (st->st_blksize > 512) dev->logicalSectorSize=(uint32_t) st->st_blksize;
+    dev->physicalSectorSize=dev->logicalSectorSize;
+    dev->optimalIOSize=(uint32_t) st->st_blksize;
+    return;
+  }
+
+#if defined __LINUX__
+  int logical;
+  unsigned int physical, optimal;
+
+  if (!ioctl(dev->fd, BLKSSZGET, &logical) && (logical > 0)) dev->sectorSize=dev->logicalSectorSize=(uint32_t) logical;
+  if (!ioctl(dev->fd, BLKPBSZGET, &physical) && physical) dev->physicalSectorSize=physical;
+  if (!ioctl(dev->fd, BLKIOOPT, &optimal)) dev->optimalIOSize=optimal;
+
+  // SD cards report their erase unit, other flash media only the discard granularity
+  if (S_ISBLK(st->st_mode) && ((dev->eraseUnitSize=sysfs_value(st, "device/preferred_erase_size")) == 0)) {
+    dev->eraseUnitSize=sysfs_value(st, "queue/discard_granularity");
+  }
+#elif defined __OSX__
+  uint32_t logical, physical;
+
+  if (!ioctl(dev->fd, DKIOCGETBLOCKSIZE, &logical) && logical) dev->sectorSize=dev->logicalSectorSize=logical;
+  if (!ioctl(dev->fd, DKIOCGETPHYSICALBLOCKSIZE, &physical) && physical) dev->physicalSectorSize=physical;
+#elif defined __BSD__
+  u_int logical;
+  off_t stripe;
+
+  if (!ioctl(dev->fd, DIOCGSECTORSIZE, &logical) && logical) dev->sectorSize=dev->logicalSectorSize=logical;
+  if (!ioctl(dev->fd, DIOCGSTRIPESIZE, &stripe) && (stripe > 0)) dev->physicalSectorSize=(uint32_t) stripe;
+#endif
+
+  if (dev->physicalSectorSize < dev->logicalSectorSize) dev->physicalSectorSize=dev->logicalSectorSize;
+}
+
+static int64_t lower_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+  // reads below the overlay
+  if (device->cache != NULL) return cache_pread(device, data, size, offset);
+  return raw_pread(device, data, size, offset);
+}
+
+static int64_t lower_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+  // writes below the overlay
+  if (device->cache != NULL) return cache_pwrite(device, data, size, offset);
+  return raw_pwrite(device, data, size, offset);
+}
+
+static struct sOverlayBlock *overlay_lookup(struct sDeviceOverlay *overlay, uint64_t nr) {
+
+  struct sOverlayBlock *b;
+
+  for (b=overlay->hash[(nr * 0x9e3779b97f4a7c15ULL >> 32) & overlay->hashMask]; b != NULL; b=b->hnext) {
+    if (b->nr == nr) return b;
+  }
+
+  return NULL;
+}
+
+static int overlay_grow(struct sDeviceOverlay *overlay) {
+
+  struct sOverlayBlock **hash, *b, *next;
+  uint32_t i, mask=overlay->hashMask*2+1, h;
+
+  if ((hash=malloc(((size_t) mask+1) * sizeof(struct sOverlayBlock *))) == NULL) return -1;
+  memset(hash, 0, ((size_t) mask+1) * sizeof(struct sOverlayBlock *));
+
+  for (i=0; i<=overlay->hashMask; i++) {
+    for (b=overlay->hash[i]; b != NULL; b=next) {
+      next=b->hnext;
+      h=(uint32_t) (b->nr * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+      b->hnext=hash[h];
+      hash[h]=b;
+    }
+  }
+
+  free(overlay->hash);
+  overlay->hash=hash;
+  overlay->hashMask=mask;
+
+  return 0;
+}
+
+static struct sOverlayBlock *overlay_getblock(DEVICE *device, uint64_t nr) {
+
+  struct sDeviceOverlay *overlay=device->overlay;
+  struct sOverlayBlock *b;
+  int64_t ret;
+  uint32_t h;
+
+  if ((b=overlay_lookup(overlay, nr)) != NULL) return b;
+
+  // keep the load factor below two
+  if ((overlay->count >= 2 * (overlay->hashMask+1)) && overlay_grow(overlay)) return NULL;
+
+  if ((b=malloc(sizeof(struct sOverlayBlock))) == NULL) return NULL;
+  if ((b->data=malloc(overlay->blockSize)) == NULL) {
+    free(b);
+    return NULL;
+  }
+  b->dirty=NULL;
+
+  if (overlay->writeBack) {
+    // staged units hold the written sectors only, the others are still read from the device
+    if ((b->dirty=malloc(overlay->blockSize / overlay->sectorSize / 8 + 1)) == NULL) {
+      free(b->data);
+      free(b);
+      return NULL;
+    }
+    memset(b->dirty, 0, overlay->blockSize / overlay->sectorSize / 8 + 1);
+    ret=overlay->blockSize;
+  } else if ((ret=lower_pread(device, b->data, overlay->blockSize, (int64_t) (nr * overlay->blockSize))) == -1) {
+    // copy on write, so start with the contents of the device
+    free(b->data);
+    free(b);
+    return NULL;
+  }
+  b->nr=nr;
+  b->len=(uint32_t) ret;
+
+  h=(uint32_t) (nr * 0x9e3779b97f4a7c15ULL >> 32) & overlay->hashMask;
+  b->hnext=overlay->hash[h];
+  overlay->hash[h]=b;
+  overlay->count++;
+
+  return b;
+}
+
+static void overlay_clear(struct sDeviceOverlay *overlay) {
+
+  struct sOverlayBlock *b, *next;
+  uint32_t i;
+
+  for (i=0; i<=overlay->hashMask; i++) {
+    for (b=overlay->hash[i]; b != NULL; b=next) {
+      next=b->hnext;
+      free(b->data);
+      free(b->dirty);
+      free(b);
+    }
+    overlay->hash[i]=NULL;
+  }
+  overlay->count=0;
+}
+
+static int compare_blocknr(const void *a, const void *b) {
+
+  uint64_t x=(*(struct sOverlayBlock * const *) a)->nr, y=(*(struct sOverlayBlock * const *) b)->nr;
+
+  return (x > y) - (x < y);
+}
+
+static int overlay_stage(DEVICE *device, struct sOverlayBlock *b, uint64_t skip, uint64_t len) {
+  // marks the sectors of a staged unit that a write touches as dirty, partly written sectors are read first
+
+  struct sDeviceOverlay *overlay=device->overlay;
+  uint64_t sector, first=skip / overlay->sectorSize, last=(skip + len - 1) / overlay->sectorSize;
+  int64_t ret;
+
+  for (sector=first; sector <= last; sector++) {
+    if (OVERLAY_ISDIRTY(b, sector)) continue;
+
+    if (((sector == first) && (skip % overlay->sectorSize)) || ((sector == last) && ((skip + len) % overlay->sectorSize))) {
+      if ((ret=lower_pread(device, b->data + sector * overlay->sectorSize, overlay->sectorSize,
+          (int64_t) (b->nr * overlay->blockSize + sector * overlay->sectorSize))) == -1) return -1;
+      // the device ends within this sector
+      if ((uint64_t) ret < overlay->sectorSize) b->len=(uint32_t) (sector * overlay->sectorSize + (uint64_t) ret);
+    }
+
+    b->dirty[sector / 8]|=(uint8_t) (1 << (sector % 8));
+  }
+
+  return 0;
+}
+
+static int64_t overlay_readstaged(DEVICE *device, struct sOverlayBlock *b, char *data, uint64_t skip, uint64_t len) {
+  // reads from a staged unit, sectors that were not written come from the device
+
+  struct sDeviceOverlay *overlay=device->overlay;
+  uint64_t pos=0, n;
+  uint32_t dirty;
+  int64_t ret;
+
+  while (pos < len) {
+    dirty=OVERLAY_ISDIRTY(b, (skip+pos) / overlay->sectorSize);
+    n=MIN(overlay->sectorSize - (skip+pos) % overlay->sectorSize, len - pos);
+    while ((pos+n < len) && (OVERLAY_ISDIRTY(b, (skip+pos+n) / overlay->sectorSize) == dirty)) {
+      n+=MIN(overlay->sectorSize, len - pos - n);
+    }
+
+    if (dirty) {
+      memcpy(data + pos, b->data + skip + pos, (size_t) n);
+    } else {
+      if ((ret=lower_pread(device, data + pos, n, (int64_t) (b->nr * overlay->blockSize + skip + pos))) == -1) return -1;
+      if ((uint64_t) ret < n) return (int64_t) (pos + (uint64_t) ret);
+    }
+    pos+=n;
+  }
+
+  return (int64_t) pos;
+}
+
+static int overlay_writeback(DEVICE *device) {
+  // writes the dirty sectors of all staged units to the media in ascending order and drops the units
+
+  struct sDeviceOverlay *overlay=device->overlay;
+  struct sOverlayBlock **blocks, *b;
+  struct sCacheBlock *block;
+  uint32_t i, count=0, sectors;
+  uint64_t nr, last, start, end, len;
+  int64_t offset;
+  int ret=0;
+
+  if (!overlay->count) return 0;
+
+  if ((blocks=malloc(overlay->count * sizeof(struct sOverlayBlock *))) == NULL) {
+    stderror();
+    return -1;
+  }
+
+  for (i=0; i<=overlay->hashMask; i++) {
+    for (b=overlay->hash[i]; b != NULL; b=b->hnext) blocks[count++]=b;
+  }
+  qsort(blocks, count, sizeof(struct sOverlayBlock *), compare_blocknr);
+
+  for (i=0; (i<count) && !ret; i++) {
+    b=blocks[i];
+    sectors=(b->len + overlay->sectorSize - 1) / overlay->sectorSize;
+
+    // one write per run of dirty sectors, the unchanged rest of the unit is not rewritten
+    for (start=0; start < sectors; start=end) {
+      if (!OVERLAY_ISDIRTY(b, start)) {
+        end=start+1;
+        continue;
+      }
+      for (end=start+1; (end < sectors) && OVERLAY_ISDIRTY(b, end); end++);
+
+      len=MIN(end * overlay->sectorSize, b->len) - start * overlay->sectorSize;
+      offset=(int64_t) (b->nr * overlay->blockSize + start * overlay->sectorSize);
+      if (raw_pwrite(device, b->data + start * overlay->sectorSize, len, offset) < (int64_t) len) {
+        myerror("Failed to write back staged unit %" PRIu64 "!", b->nr);
+        ret=-1;
+        break;
+      }
+
+      // cached copies of the sectors are outdated now
+      if (device->cache != NULL) {
+        last=((uint64_t) offset + len - 1) / device->cache->blockSize;
+        for (nr=(uint64_t) offset / device->cache->blockSize; nr <= last; nr++) {
+          if ((block=cache_lookup(device->cache, nr)) != NULL) cache_discard(device->cache, block);
+        }
+      }
+    }
+  }
+
+  free(blocks);
+
+  // keep the units that could not be written
+  if (!ret) overlay_clear(overlay);
+
+  return ret;
+}
+
+static int64_t overlay_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  struct sDeviceOverlay *overlay=device->overlay;
+  struct sOverlayBlock *b;
+  uint64_t pos=0, start, len, skip;
+  int64_t ret;
+
+  while (pos < size) {
+    skip=(uint64_t) (offset+pos) % overlay->blockSize;
+    len=MIN(overlay->blockSize - skip, size - pos);
+
+    if ((b=overlay_lookup(overlay, (uint64_t) (offset+pos) / overlay->blockSize)) != NULL) {
+      if (skip >= b->len) break;
+      len=MIN(len, b->len - skip);
+      if (b->dirty != NULL) {
+        if ((ret=overlay_readstaged(device, b, (char *) data + pos, skip, len)) == -1) return -1;
+        if ((uint64_t) ret < len) return (int64_t) pos + ret;
+      } else {
+        memcpy((char *) data + pos, b->data + skip, (size_t) len);
+      }
+      pos+=len;
+      if (skip + len == b->len && b->len < overlay->blockSize) break;
+      continue;
+    }
+
+    // read all following blocks that are not in the overlay at once
+    start=pos;
+    pos+=len;
+    while ((pos < size) && (overlay_lookup(overlay, (uint64_t) (offset+pos) / overlay->blockSize) == NULL)) {
+      pos+=MIN(overlay->blockSize, size - pos);
+    }
+
+    if ((ret=lower_pread(device, (char *) data + start, pos - start, offset + (int64_t) start)) == -1) return -1;
+    if ((uint64_t) ret < pos - start) return (int64_t) start + ret;
+  }
+
+  return (int64_t) pos;
+}
+
+static int64_t overlay_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  struct sDeviceOverlay *overlay=device->overlay;
+  struct sOverlayBlock *b;
+  uint64_t pos=0, len, skip;
+
+  overlay->writes++;
+
+  while (pos < size) {
+    skip=(uint64_t) (offset+pos) % overlay->blockSize;
+    len=MIN(overlay->blockSize - skip, size - pos);
+
+    if ((b=overlay_getblock(device, (uint64_t) (offset+pos) / overlay->blockSize)) == NULL) return -1;
+    if ((b->dirty != NULL) && overlay_stage(device, b, skip, len)) return -1;
+
+    // the device ends within this block
+    if (skip >= b->len) break;
+    len=MIN(len, b->len - skip);
+
+    memcpy(b->data + skip, (const char *) data + pos, (size_t) len);
+    pos+=len;
+    overlay->bytes+=len;
+  }
+
+  if (overlay->writeBack && (overlay->count > overlay->maxBlocks) && overlay_writeback(device)) return -1;
+
+  return (int64_t) pos;
+}
+
+static void overlay_free(DEVICE *device) {
+
+  overlay_clear(device->overlay);
+  free(device->overlay->hash);
+  free(device->overlay);
+  device->overlay=NULL;
+}
+
+static void trace_close(DEVICE *device) {
+
+  if (fclose(device->trace->fp)) stderror();
+  free(device->trace);
+  device->trace=NULL;
+}
+
+static void trace(DEVICE *device, uint32_t op, int64_t offset, uint64_t size, const char *name) {
+  // appends a record to the trace, recording stops on errors
+
+  struct sDeviceTrace *tr=device->trace;
+  struct sDeviceTraceRecord rec;
+  struct timespec now;
+
+  if (tr == NULL) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  rec.op=op;
+  rec.reserved=0;
+  rec.offset=offset;
+  rec.size=size;
+  rec.time=(uint64_t) (now.tv_sec - tr->start.tv_sec) * 1000000000 + (uint64_t) now.tv_nsec - (uint64_t) tr->start.tv_nsec;
+
+  if ((fwrite(&rec, sizeof(struct sDeviceTraceRecord), 1, tr->fp) != 1) ||
+      ((name != NULL) && (fwrite(name, (size_t) size, 1, tr->fp) != 1))) {
+    myerror("Failed to write trace record, recording stopped!");
+    trace_close(device);
+  }
+}
+
+static int64_t io_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+  // reads through the overlay or the layers below it and counts the request
+
+  int64_t ret;
+
+  device->stats.reads++;
+
+  if (device->overlay != NULL) {
+    ret=overlay_pread(device, data, size, offset);
+  } else {
+    ret=lower_pread(device, data, size, offset);
+  }
+  if (ret > 0) device->stats.bytesRead+=(uint64_t) ret;
+
+  return ret;
+}
+
+static int64_t io_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  int64_t ret;
+
+  device->stats.writes++;
+
+  if (device->overlay != NULL) {
+    ret=overlay_pwrite(device, data, size, offset);
+  } else {
+    ret=lower_pwrite(device, data, size, offset);
+  }
+  if (ret > 0) device->stats.bytesWritten+=(uint64_t) ret;
+
+  return ret;
+}
+
+static DEVICE *ram_load(const char *path) {
+  // reads an image file into a RAM device
+
+  int fd;
+  struct stat st;
+  char *data;
+  uint64_t pos=0;
+  ssize_t ret;
+
+  if ((fd=open(path, O_RDONLY)) == -1) {
+    stderror();
+    return NULL;
+  }
+
+  if (fstat(fd, &st) || ((uint64_t) st.st_size > SIZE_MAX)) {
+    stderror();
+    close(fd);
+    return NULL;
+  }
+
+  if ((data=malloc((size_t) st.st_size + 1)) == NULL) {
+    stderror();
+    close(fd);
+    return NULL;
+  }
+
+  while (pos < (uint64_t) st.st_size) {
+    if ((ret=read(fd, data+pos, (size_t) ((uint64_t) st.st_size - pos))) <= 0) {
+      if ((ret == -1) && (errno == EINTR)) continue;
+      myerror("Failed to read image file %s!", path);
+      free(data);
+      close(fd);
+      return NULL;
+    }
+    pos+=(uint64_t) ret;
+  }
+
+  close(fd);
+
+  return device_openram(data, (uint64_t) st.st_size);
+}
+
+DEVICE *device_openram(void *data, uint64_t size) {
+
+  assert(data != NULL);
+
+  DEVICE *dev;
+
+  if ((dev=malloc(sizeof(DEVICE))) == NULL) {
+    stderror();
+    return NULL;
+  }
+
+  // a RAM device is a mapping without a file behind it
+  dev->fd=-1;
+  dev->cache=NULL;
+  dev->map=(char *) data;
+  dev->mapSize=size;
+  dev->ring=NULL;
+  dev->direct=0;
+  dev->logicalSectorSize=512;
+  dev->sectorSize=512;
+  dev->physicalSectorSize=512;
+  dev->optimalIOSize=0;
+  dev->eraseUnitSize=0;
+  dev->overlay=NULL;
+  dev->ram=1;
+  dev->position=0;
+  dev->mediaEnd=0;
+  memset(&dev->stats, 0, sizeof(struct sDeviceStats));
+  dev->emulator=NULL;
+  dev->trace=NULL;
+  dev->view=0;
+  dev->base=0;
+  dev->viewSize=0;
+
+  return dev;
+}
+
+DEVICE *device_openview(DEVICE *device, int64_t offset, uint64_t size) {
+
+  assert(device != NULL);
+  assert(offset >= 0);
+
+  DEVICE *dev;
+
+  if ((device->cache != NULL) || (device->overlay != NULL) || (device->emulator != NULL) || (device->trace != NULL)) {
+    myerror("Views must be opened before the device is set up!");
+    return NULL;
+  }
+
+  if ((dev=malloc(sizeof(DEVICE))) == NULL) {
+    stderror();
+    return NULL;
+  }
+
+  *dev=*device;
+  dev->cache=NULL;
+  dev->ring=NULL;
+  dev->overlay=NULL;
+  dev->position=0;
+  dev->mediaEnd=0;
+  memset(&dev->stats, 0, sizeof(struct sDeviceStats));
+  dev->emulator=NULL;
+  dev->trace=NULL;
+  dev->view=1;
+  dev->base=device->base + offset;
+  dev->viewSize=size;
+
+  if (device->map != NULL) {
+    // the view maps the part of the mapping it covers
+    dev->map=device->map + MIN((uint64_t) offset, device->mapSize);
+    dev->mapSize=((uint64_t) offset < device->mapSize) ? MIN(size, device->mapSize - (uint64_t) offset) : 0;
+  }
+
+  // erase units are aligned to the disk, not to the view
+  if (dev->eraseUnitSize && (dev->base % dev->eraseUnitSize)) dev->eraseUnitSize=0;
+
+#ifdef HAVE_IO_URING
+  // a ring can only be used by one thread, so every view gets its own one
+  if (device->ring != NULL) dev->ring=ring_open(DEVICE_RING_ENTRIES);
+#endif
+
+  return dev;
+}
+
+void device_stats(DEVICE *device, struct sDeviceStats *stats) {
+
+  assert(device != NULL);
+  assert(stats != NULL);
+
+  *stats=device->stats;
+}
+
+DEVICE *device_open(const char *path) {
+
+  assert(path != NULL);
+
+  int fd;
+  DEVICE *dev;
+  struct stat st;
+  void *map;
+
+  if (!strncmp(path, DEVICE_RAM_PREFIX, strlen(DEVICE_RAM_PREFIX))) return ram_load(path+strlen(DEVICE_RAM_PREFIX));
+
+  if ((fd=open(path, O_RDWR | O_EXCL)) == -1) {
+    stderror();
+    return NULL;
+  }
+
+  if ((dev=malloc(sizeof(DEVICE))) == NULL) {
+    stderror();
+    return NULL;
+  }
+
+  dev->fd=fd;
+  dev->cache=NULL;
+  dev->map=NULL;
+  dev->mapSize=0;
+  dev->ring=NULL;
+  dev->direct=0;
+  dev->overlay=NULL;
+  dev->ram=0;
+  dev->position=0;
+  dev->mediaEnd=0;
+  memset(&dev->stats, 0, sizeof(struct sDeviceStats));
+  dev->emulator=NULL;
+  dev->trace=NULL;
+  dev->view=0;
+  dev->base=0;
+  dev->viewSize=0;
+
+  if (fstat(fd, &st)) {
+    stderror();
+    close(fd);
+    free(dev);
+    return NULL;
+  }
+
+  probe_geometry(dev, &st);
+
+  // image files are mapped into memory, block devices are accessed via the descriptor
+  if (S_ISREG(st.st_mode) && (st.st_size > 0) && ((uint64_t) st.st_size <= SIZE_MAX)) {
+    map=mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      dev->map=(char *) map;
+      dev->mapSize=(uint64_t) st.st_size;
+    }
+  }
+
+  return dev;
+}
+
+int device_setcache(DEVICE *device, uint32_t blockSize, uint32_t blocks) {
+
+  assert(device != NULL);
+  assert(!blocks || blockSize);
+
+  struct sDeviceCache *cache;
+  uint32_t i, hashSize;
+
+  // mapped devices are already accessed in memory
+  if (device->map != NULL) return 0;
+
+  // drop existing cache
+  if (device->cache != NULL) {
+    if (cache_flush(device)) return -1;
+    cache_free(device);
+  }
+
+  if (!blocks) return 0;
+
+  // twice as many hash buckets as blocks, rounded up to a power of two
+  for (hashSize=1; hashSize < 2*blocks; hashSize <<= 1);
+
+  if ((cache=malloc(sizeof(struct sDeviceCache))) == NULL) {
+    stderror();
+    return -1;
+  }
+  cache->blockSize=blockSize;
+  cache->blockCount=blocks;
+  cache->used=0;
+  cache->hashMask=hashSize-1;
+  cache->first=cache->last=NULL;
+  cache->hits=cache->misses=0;
+  cache->data=alignedmalloc((size_t) blockSize * blocks, blockSize, &cache->mem);
+  cache->blocks=malloc(sizeof(struct sCacheBlock) * blocks);
+  cache->hash=malloc(sizeof(struct sCacheBlock *) * hashSize);
+  device->cache=cache;
+  if ((cache->data == NULL) || (cache->blocks == NULL) || (cache->hash == NULL)) {
+    stderror();
+    cache_free(device);
+    return -1;
+  }
+  memset(cache->hash, 0, sizeof(struct sCacheBlock *) * hashSize);
+
+  for (i=0; i<blocks; i++) {
+    cache->blocks[i].data=cache->data + (size_t) i * blockSize;
+  }
+
+  return 0;
+}
+
+void device_cachestats(DEVICE *device, uint64_t *hits, uint64_t *misses) {
+
+  assert(device != NULL);
+  assert(hits != NULL);
+  assert(misses != NULL);
+
+  if (device->cache != NULL) {
+    *hits=device->cache->hits;
+    *misses=device->cache->misses;
+  } else {
+    *hits=*misses=0;
+  }
+}
+
+int device_setbackend(DEVICE *device, int backend) {
+
+  assert(device != NULL);
+
+  if (device->ram && (backend != DEVICE_BACKEND_MAP)) {
+    myerror("RAM devices can only be accessed in memory!");
+    return -1;
+  }
+
+  switch(backend) {
+  case DEVICE_BACKEND_MAP:
+    if (device->map == NULL) {
+      myerror("Only regular files can be memory mapped!");
+      return -1;
+    }
+    return 0;
+  case DEVICE_BACKEND_SYNC:
+  case DEVICE_BACKEND_URING:
+    if (device->map != NULL) {
+      // the mapping of a view belongs to its disk
+      if (map_sync(device, 0, device->mapSize) || (!device->view && munmap(device->map, (size_t) device->mapSize))) {
+        stderror();
+        return -1;
+      }
+      device->map=NULL;
+      device->mapSize=0;
+    }
+#ifdef HAVE_IO_URING
+    if ((backend == DEVICE_BACKEND_SYNC) && (device->ring != NULL)) {
+      ring_close(device->ring);
+      device->ring=NULL;
+    } else if ((backend == DEVICE_BACKEND_URING) && (device->ring == NULL)) {
+      // stays synchronous if the kernel lacks io_uring
+      device->ring=ring_open(DEVICE_RING_ENTRIES);
+    }
+#endif
+    return 0;
+  default:
+    myerror("Unknown device backend %d!", backend);
+    return -1;
+  }
+}
+
+int device_getbackend(DEVICE *device) {
+
+  assert(device != NULL);
+
+  if (device->ring != NULL) return DEVICE_BACKEND_URING;
+  if (device->map != NULL) return DEVICE_BACKEND_MAP;
+
+  return DEVICE_BACKEND_SYNC;
+}
+
+int device_setdirect(DEVICE *device, int enable) {
+
+  assert(device != NULL);
+
+  int flags;
+
+  if (device->ram && enable) {
+    myerror("Direct i/o is not possible for RAM devices!");
+    return -1;
+  }
+
+  // direct i/o needs the descriptor, so drop the mapping first
+  if (enable && (device->map != NULL) && device_setbackend(device, DEVICE_BACKEND_SYNC)) return -1;
+
+  // write back cached blocks through the page cache before bypassing it
+  if ((device->cache != NULL) && cache_flush(device)) return -1;
+
+  // the descriptor flags are shared with the disk, so all views of a disk must use the same setting
+#if defined __OSX__
+  if (fcntl(device->fd, F_NOCACHE, enable ? 1 : 0) == -1) {
+    stderror();
+    return -1;
+  }
+#elif defined O_DIRECT
+  if (((flags=fcntl(device->fd, F_GETFL)) == -1) ||
+      (fcntl(device->fd, F_SETFL, enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) == -1)) {
+    stderror();
+    return -1;
+  }
+#else
+  if (enable) {
+    myerror("Direct i/o is not supported on this platform!");
+    return -1;
+  }
+#endif
+  (void) flags;
+
+  device->direct=enable;
+
+  return 0;
+}
+
+void device_getgeometry(DEVICE *device, uint32_t *logical, uint32_t *physical, uint32_t *optimal) {
+
+  assert(device != NULL);
+  assert(logical != NULL);
+  assert(physical != NULL);
+  assert(optimal != NULL);
+
+  *logical=device->logicalSectorSize;
+  *physical=device->physicalSectorSize;
+  *optimal=device->optimalIOSize;
+}
+
+int device_prefetch(DEVICE *device, const struct sDeviceRange *ranges, uint32_t n) {
+
+  assert(device != NULL);
+  assert(!n || (ranges != NULL));
+
+  struct sDeviceCache *cache=device->cache;
+  struct sDeviceRequest *req;
+  struct sCacheBlock *block, **blocks;
+  uint32_t i, count=0, max;
+  uint64_t nr, last;
+  int ret=0;
+
+  for (i=0; i<n; i++) trace(device, DEVICE_TRACE_PREFETCH, ranges[i].offset, ranges[i].size, NULL);
+
+  // there is only something to prefetch into if the device is cached
+  if (cache == NULL) return 0;
+
+  // at most half of the cache is filled, so the batch cannot evict its own blocks
+  if ((max=cache->blockCount / 2) == 0) return 0;
+
+  req=malloc(sizeof(struct sDeviceRequest) * max);
+  blocks=malloc(sizeof(struct sCacheBlock *) * max);
+  if ((req == NULL) || (blocks == NULL)) {
+    stderror();
+    free(req);
+    free(blocks);
+    return -1;
+  }
+
+  for (i=0; (i < n) && (count < max); i++) {
+    if (!ranges[i].size) continue;
+    last=((uint64_t) ranges[i].offset + ranges[i].size - 1) / cache->blockSize;
+    for (nr=(uint64_t) ranges[i].offset / cache->blockSize; (nr <= last) && (count < max); nr++) {
+      if (cache_lookup(cache, nr) != NULL) continue;
+      if ((block=cache_newblock(device, nr)) == NULL) {
+        ret=-1;
+        break;
+      }
+      cache->misses++;
+      blocks[count]=block;
+      req[count].data=block->data;
+      req[count].size=cache->blockSize;
+      req[count].offset=(int64_t) nr * cache->blockSize;
+      req[count].result=-1;
+      count++;
+    }
+  }
+
+  // blocks whose request did not complete are dropped
+  if (raw_preadbatch(device, req, count)) ret=-1;
+
+  for (i=0; i<count; i++) {
+    if (req[i].result == -1) {
+      cache_discard(cache, blocks[i]);
+      ret=-1;
+    } else {
+      blocks[i]->len=(uint32_t) req[i].result;
+    }
+  }
+
+  free(req);
+  free(blocks);
+
+  return ret;
+}
+
+int device_advise(DEVICE *device, const struct sDeviceRange *ranges, uint32_t n) {
+
+  assert(device != NULL);
+  assert(!n || (ranges != NULL));
+
+  uint32_t i;
+  uintptr_t start, page=(uintptr_t) sysconf(_SC_PAGESIZE);
+  int64_t end;
+#if !defined POSIX_FADV_WILLNEED && defined F_RDADVISE
+  struct radvisory ra;
+#endif
+
+  for (i=0; i<n; i++) trace(device, DEVICE_TRACE_ADVISE, ranges[i].offset, ranges[i].size, NULL);
+
+  // RAM devices are in memory already and direct i/o bypasses the page cache
+  if (device->ram || device->direct) return 0;
+
+  for (i=0; i<n; i++) {
+    if (!ranges[i].size) continue;
+
+    if (device->map != NULL) {
+      if ((uint64_t) ranges[i].offset >= device->mapSize) continue;
+      // madvise needs a page aligned address
+      start=(uintptr_t) (device->map + ranges[i].offset);
+      end=ranges[i].offset + (int64_t) ranges[i].size;
+      if (end > (int64_t) device->mapSize) end=(int64_t) device->mapSize;
+      device->stats.syscalls++;
+      madvise((void *) (start - start % page), (size_t) (end - ranges[i].offset) + start % page, MADV_WILLNEED);
+    } else {
+#if defined POSIX_FADV_WILLNEED
+      device->stats.syscalls++;
+      posix_fadvise(device->fd, (off_t) (device->base + ranges[i].offset), (off_t) ranges[i].size, POSIX_FADV_WILLNEED);
+#elif defined F_RDADVISE
+      ra.ra_offset=(off_t) (device->base + ranges[i].offset);
+      ra.ra_count=(int) ((ranges[i].size > INT32_MAX) ? INT32_MAX : ranges[i].size);
+      device->stats.syscalls++;
+      fcntl(device->fd, F_RDADVISE, &ra);
+#endif
+    }
+  }
+
+  return 0;
+}
+
+int device_setoverlay(DEVICE *device, uint32_t blockSize) {
+
+  assert(device != NULL);
+  assert(blockSize > 0);
+
+  struct sDeviceOverlay *overlay;
+
+  if (device->overlay != NULL) return 0;
+
+  if ((overlay=malloc(sizeof(struct sDeviceOverlay))) == NULL) {
+    stderror();
+    return -1;
+  }
+  overlay->blockSize=blockSize;
+  overlay->hashMask=255;
+  overlay->count=0;
+  overlay->writes=0;
+  overlay->bytes=0;
+  overlay->writeBack=0;
+  overlay->maxBlocks=0;
+  overlay->sectorSize=0;
+
+  if ((overlay->hash=malloc(((size_t) overlay->hashMask+1) * sizeof(struct sOverlayBlock *))) == NULL) {
+    stderror();
+    free(overlay);
+    return -1;
+  }
+  memset(overlay->hash, 0, ((size_t) overlay->hashMask+1) * sizeof(struct sOverlayBlock *));
+
+  device->overlay=overlay;
+
+  return 0;
+}
+
+uint32_t device_getsectorsize(DEVICE *device) {
+
+  assert(device != NULL);
+
+  return device->sectorSize;
+}
+
+uint32_t device_geteraseunit(DEVICE *device) {
+
+  assert(device != NULL);
+
+  return device->eraseUnitSize;
+}
+
+int device_setwriteunit(DEVICE *device, uint32_t unit, uint64_t maxSize) {
+
+  assert(device != NULL);
+  assert(unit > 0);
+
+  if (device->overlay != NULL) {
+    myerror("Writes can not be staged on an overlay!");
+    return -1;
+  }
+
+  // staged sectors are written around the cache, so it must not hold changes
+  if ((device->cache != NULL) && cache_flush(device)) return -1;
+
+  if (unit % device->sectorSize) {
+    myerror("Write unit of %u bytes is not a multiple of the device sector size!", unit);
+    return -1;
+  }
+
+  if (device_setoverlay(device, unit)) return -1;
+
+  device->overlay->writeBack=1;
+  device->overlay->sectorSize=device->sectorSize;
+  device->overlay->maxBlocks=(maxSize > unit) ? (uint32_t) (maxSize / unit) : 1;
+
+  return 0;
+}
+
+void device_overlaystats(DEVICE *device, uint64_t *blocks, uint64_t *writes, uint64_t *bytes) {
+
+  assert(device != NULL);
+  assert(blocks != NULL);
+  assert(writes != NULL);
+  assert(bytes != NULL);
+
+  if (device->overlay == NULL) {
+    *blocks=*writes=*bytes=0;
+    return;
+  }
+
+  *blocks=device->overlay->count;
+  *writes=device->overlay->writes;
+  *bytes=device->overlay->bytes;
+}
+
+int device_overlayranges(DEVICE *device, struct sDeviceRange **ranges, uint32_t *n, uint64_t *changed) {
+
+  assert(device != NULL);
+  assert(ranges != NULL);
+  assert(n != NULL);
+  assert(changed != NULL);
+
+  struct sDeviceOverlay *overlay=device->overlay;
+  struct sOverlayBlock **blocks, *b;
+  char *orig;
+  uint32_t i, j, count=0;
+  uint64_t k;
+
+  *ranges=NULL;
+  *n=0;
+  *changed=0;
+
+  if ((overlay == NULL) || !overlay->count) return 0;
+
+  if (((blocks=malloc(overlay->count * sizeof(struct sOverlayBlock *))) == NULL) ||
+      ((*ranges=malloc(overlay->count * sizeof(struct sDeviceRange))) == NULL) ||
+      ((orig=malloc(overlay->blockSize)) == NULL)) {
+    stderror();
+    free(blocks);
+    free(*ranges);
+    *ranges=NULL;
+    return -1;
+  }
+
+  for (i=0; i<=overlay->hashMask; i++) {
+    for (b=overlay->hash[i]; b != NULL; b=b->hnext) blocks[count++]=b;
+  }
+  qsort(blocks, count, sizeof(struct sOverlayBlock *), compare_blocknr);
+
+  for (i=0, j=0; i<count; i++) {
+    // merge adjacent blocks
+    if (j && ((uint64_t) ((*ranges)[j-1].offset + (int64_t) (*ranges)[j-1].size) == blocks[i]->nr * overlay->blockSize)) {
+      (*ranges)[j-1].size+=blocks[i]->len;
+    } else {
+      (*ranges)[j].offset=(int64_t) (blocks[i]->nr * overlay->blockSize);
+      (*ranges)[j].size=blocks[i]->len;
+      j++;
+    }
+
+    // count bytes that differ from the device
+    if (lower_pread(device, orig, blocks[i]->len, (int64_t) (blocks[i]->nr * overlay->blockSize)) < (int64_t) blocks[i]->len) {
+      stderror();
+      free(orig);
+      free(blocks);
+      free(*ranges);
+      *ranges=NULL;
+      return -1;
+    }
+    for (k=0; k<blocks[i]->len; k++) {
+      if (orig[k] != blocks[i]->data[k]) (*changed)++;
+    }
+  }
+  *n=j;
+
+  free(orig);
+  free(blocks);
+
+  return 0;
+}
+
+int device_setmodel(DEVICE *device, const struct sDeviceModel *model) {
+
+  assert(device != NULL);
+
+  if (model == NULL) {
+    free(device->emulator);
+    device->emulator=NULL;
+    return 0;
+  }
+
+  if ((device->emulator == NULL) && ((device->emulator=malloc(sizeof(struct sDeviceEmulator))) == NULL)) {
+    stderror();
+    return -1;
+  }
+  device->emulator->model=*model;
+  device->emulator->last=0;
+  device->emulator->total=0;
+  device->emulator->debt=0;
+
+  return 0;
+}
+
+uint64_t device_modeldelay(DEVICE *device) {
+
+  assert(device != NULL);
+
+  return (device->emulator != NULL) ? device->emulator->total : 0;
+}
+
+int device_settrace(DEVICE *device, const char *path) {
+
+  assert(device != NULL);
+
+  if (device->trace != NULL) trace_close(device);
+
+  if (path == NULL) return 0;
+
+  if ((device->trace=malloc(sizeof(struct sDeviceTrace))) == NULL) {
+    stderror();
+    return -1;
+  }
+
+  if ((device->trace->fp=fopen(path, "wb")) == NULL) {
+    stderror();
+    free(device->trace);
+    device->trace=NULL;
+    return -1;
+  }
+
+  if (fwrite(DEVICE_TRACE_MAGIC, 8, 1, device->trace->fp) != 1) {
+    stderror();
+    trace_close(device);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &device->trace->start);
+
+  return 0;
+}
+
+int device_tracephase(DEVICE *device, const char *name) {
+
+  assert(device != NULL);
+  assert(name != NULL);
+
+  trace(device, DEVICE_TRACE_PHASE, -1, strlen(name), name);
+
+  return 0;
+}
+
+void *device_map(DEVICE *device, int64_t offset, uint64_t size) {
+
+  assert(device != NULL);
+  assert(offset >= 0);
+
+  // overlay blocks are not part of the mapping, traced and emulated accesses must go through the device functions
+  if ((device->map == NULL) || (device->overlay != NULL) || (device->trace != NULL) || (device->emulator != NULL) ||
+      ((uint64_t) offset > device->mapSize) || (size > device->mapSize - (uint64_t) offset)) {
+    return NULL;
+  }
+
+  return device->map+offset;
+}
+
+int64_t device_seekset(DEVICE *device, int64_t offset) {
+
+  assert(device != NULL);
+  assert(offset >= 0);
+
+  int64_t ret;
+
+  trace(device, DEVICE_TRACE_SEEK, offset, 0, NULL);
+
+  // views share the descriptor, so they cannot use its position
+  if (device->ram || device->view) return device->position=offset;
+
+  device->stats.syscalls++;
+#if defined __BSD__ || defined __OSX__ 
+  ret=lseek(device->fd, (off_t) offset, SEEK_SET);
+#else
+  ret=lseek64(device->fd, (off64_t) offset, SEEK_SET);
+#endif
+  if (ret != -1) device->position=ret;
+
+  return ret;
+}
+
+int64_t device_read(DEVICE *device, void *data, uint64_t size, uint64_t n) {
+
+  assert(device != NULL);
+  assert(data != NULL);
+
+  int64_t offset, ret;
+
+  if (device->ram || device->view) {
+    trace(device, DEVICE_TRACE_READ, device->position, size * n, NULL);
+    if ((ret=io_pread(device, data, size * n, device->position)) > 0) device->position+=ret;
+    return ret;
+  }
+
+  if ((device->cache == NULL) && (device->map == NULL) && !device->direct && (device->overlay == NULL)) {
+    trace(device, DEVICE_TRACE_READ, device->position, size * n, NULL);
+    device->stats.reads++;
+    device->stats.syscalls++;
+    media_access(device, device->position, size * n, 0);
+    if ((ret=read(device->fd, data, (size_t) size * n)) > 0) {
+      device->position+=ret;
+      device->stats.bytesRead+=(uint64_t) ret;
+    }
+    return ret;
+  }
+
+  // go through the overlay, cache, mapping or bounce buffers and advance the current position ourselves
+  device->stats.syscalls++;
+  if ((offset=lseek(device->fd, 0, SEEK_CUR)) == -1) return -1;
+  trace(device, DEVICE_TRACE_READ, offset, size * n, NULL);
+  if ((ret=io_pread(device, data, size * n, offset)) > 0) {
+    device->stats.syscalls++;
+    device->position=lseek(device->fd, offset+ret, SEEK_SET);
+  }
+
+  return ret;
+}
+
+int64_t device_write(DEVICE *device, const void *data, uint64_t size, uint64_t n) {
+
+  assert(device != NULL);
+  assert(data != NULL);
+
+  int64_t offset, ret;
+
+  if (device->ram || device->view) {
+    trace(device, DEVICE_TRACE_WRITE, device->position, size * n, NULL);
+    if ((ret=io_pwrite(device, data, size * n, device->position)) > 0) device->position+=ret;
+    return ret;
+  }
+
+  if ((device->cache == NULL) && (device->map == NULL) && !device->direct && (device->overlay == NULL)) {
+    trace(device, DEVICE_TRACE_WRITE, device->position, size * n, NULL);
+    device->stats.writes++;
+    device->stats.syscalls++;
+    media_access(device, device->position, size * n, 1);
+    if ((ret=write(device->fd, (void *) data, (size_t) size * n)) > 0) {
+      device->position+=ret;
+      device->stats.bytesWritten+=(uint64_t) ret;
+    }
+    return ret;
+  }
+
+  // go through the overlay, cache, mapping or bounce buffers and advance the current position ourselves
+  device->stats.syscalls++;
+  if ((offset=lseek(device->fd, 0, SEEK_CUR)) == -1) return -1;
+  trace(device, DEVICE_TRACE_WRITE, offset, size * n, NULL);
+  if ((ret=io_pwrite(device, data, size * n, offset)) > 0) {
+    device->stats.syscalls++;
+    device->position=lseek(device->fd, offset+ret, SEEK_SET);
+  }
+
+  return ret;
+}
+
+int64_t device_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  assert(device != NULL);
+  assert(data != NULL);
+  assert(offset >= 0);
+
+  trace(device, DEVICE_TRACE_PREAD, offset, size, NULL);
+
+  return io_pread(device, data, size, offset);
+}
+
+int64_t device_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  assert(device != NULL);
+  assert(data != NULL);
+  assert(offset >= 0);
+
+  trace(device, DEVICE_TRACE_PWRITE, offset, size, NULL);
 
-#if defined __LINUX__ || defined __BSD__ || defined __OSX__ 
+  return io_pwrite(device, data, size, offset);
+}
 
-DEVICE *device_open(const char *path) {
+int64_t device_preadv(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
 
-  assert(path != NULL);
+  assert(device != NULL);
+  assert(iov != NULL);
+  assert(offset >= 0);
 
-  int fd;
-  DEVICE *dev;
+  int i;
+  int64_t ret, total=0;
 
-  if ((fd=open(path, O_RDWR | O_EXCL)) == -1) {
-    stderror();
-    return NULL;
+  if (device->trace != NULL) {
+    for (i=0; i<iovcnt; i++) total+=(int64_t) iov[i].iov_len;
+    trace(device, DEVICE_TRACE_PREAD, offset, (uint64_t) total, NULL);
+    total=0;
   }
 
-  if ((dev=malloc(sizeof(DEVICE))) == NULL) {
-    stderror();
-    return NULL;
+  if ((device->cache == NULL) && (device->overlay == NULL)) {
+    device->stats.reads++;
+    if ((total=raw_preadv(device, iov, iovcnt, offset)) > 0) device->stats.bytesRead+=(uint64_t) total;
+    return total;
   }
 
-  dev->fd=fd;
+  for (i=0; i<iovcnt; i++) {
+    ret=io_pread(device, iov[i].iov_base, iov[i].iov_len, offset+total);
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
 
-  return dev;
+  return total;
 }
 
-int64_t device_seekset(DEVICE *device, int64_t offset) {
+int64_t device_pwritev(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
 
   assert(device != NULL);
+  assert(iov != NULL);
   assert(offset >= 0);
 
-#if defined __BSD__ || defined __OSX__ 
-  return lseek(device->fd, (off_t) offset, SEEK_SET);
-#else
-  return lseek64(device->fd, (off64_t) offset, SEEK_SET);
-#endif
-}
+  int i;
+  int64_t ret, total=0;
 
-int64_t device_read(DEVICE *device, void *data, uint64_t size, uint64_t n) {
+  if (device->trace != NULL) {
+    for (i=0; i<iovcnt; i++) total+=(int64_t) iov[i].iov_len;
+    trace(device, DEVICE_TRACE_PWRITE, offset, (uint64_t) total, NULL);
+    total=0;
+  }
 
-  assert(device != NULL);
-  assert(data != NULL);
+  if ((device->cache == NULL) && (device->overlay == NULL)) {
+    device->stats.writes++;
+    if ((total=raw_pwritev(device, iov, iovcnt, offset)) > 0) device->stats.bytesWritten+=(uint64_t) total;
+    return total;
+  }
 
-  return read(device->fd, data, (size_t) size * n);
+  for (i=0; i<iovcnt; i++) {
+    ret=io_pwrite(device, iov[i].iov_base, iov[i].iov_len, offset+total);
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
+
+  return total;
 }
 
-int64_t device_write(DEVICE *device, const void *data, uint64_t size, uint64_t n) {
+int device_sync(DEVICE *device) {
 
   assert(device != NULL);
-  assert(data != NULL);
 
-  return write(device->fd, (void *) data, (size_t) size * n);
+  trace(device, DEVICE_TRACE_SYNC, -1, 0, NULL);
+  device->stats.syncs++;
+
+  // staged units are written back, an overlay is never written to the device
+  if ((device->overlay != NULL) && device->overlay->writeBack && overlay_writeback(device)) return -1;
+
+  // RAM devices have nothing to sync
+  if (((device->overlay != NULL) && !device->overlay->writeBack) || device->ram) return 0;
+
+  if ((device->cache != NULL) && cache_flush(device)) return -1;
+
+  if ((device->map != NULL) && map_sync(device, 0, device->mapSize)) return -1;
+
+  device->stats.syscalls++;
+  return fsync(device->fd);
 }
 
-int device_sync(DEVICE *device) {
+int device_syncrange(DEVICE *device, int64_t offset, uint64_t size) {
 
   assert(device != NULL);
 
+  trace(device, DEVICE_TRACE_SYNCRANGE, offset, size, NULL);
+  device->stats.syncs++;
+
+  if ((device->overlay != NULL) && device->overlay->writeBack) {
+    // the written back units cover the range
+    if (overlay_writeback(device)) return -1;
+    size+=(uint64_t) (offset % device->overlay->blockSize);
+    offset-=offset % device->overlay->blockSize;
+    size=(size + device->overlay->blockSize - 1) / device->overlay->blockSize * device->overlay->blockSize;
+  }
+
+  if (((device->overlay != NULL) && !device->overlay->writeBack) || device->ram) return 0;
+
+  if ((device->cache != NULL) && cache_flush(device)) return -1;
+
+  if (device->map != NULL) return map_sync(device, offset, size);
+
+  device->stats.syscalls++;
+#if defined SYNC_FILE_RANGE_WRITE
+  // writes out the dirty pages of the range only, device caches and metadata are not flushed
+  return sync_file_range(device->fd, device->base + offset, (off_t) size,
+    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
   return fsync(device->fd);
+#endif
 }
 
 int device_close(DEVICE *device) {
 
   assert(device != NULL);
 
-  if(!close(device->fd)) {
+  int ret=0;
+
+  if (device->overlay != NULL) {
+    if (device->overlay->writeBack && overlay_writeback(device)) ret=-1;
+    overlay_free(device);
+  }
+
+  if (device->cache != NULL) {
+    if (cache_flush(device)) ret=-1;
+    cache_free(device);
+  }
+
+  free(device->emulator);
+
+  if (device->trace != NULL) trace_close(device);
+
+  // descriptor and mapping of a view belong to its disk
+  if (device->view) {
+#ifdef HAVE_IO_URING
+    if (device->ring != NULL) ring_close(device->ring);
+#endif
+    free((void*) device);
+    return ret;
+  }
+
+  if (device->ram) {
+    free(device->map);
+    free((void*) device);
+    return 0;
+  }
+
+  if ((device->map != NULL) && munmap(device->map, (size_t) device->mapSize)) ret=-1;
+
+#ifdef HAVE_IO_URING
+  if (device->ring != NULL) ring_close(device->ring);
+#endif
+
+  if(!close(device->fd) && !ret) {
     free((void*) device);
     return 0;
   } else {
@@ -303,6 +2540,227 @@ DEVICE *device_open(const char *path) {
   return dev;
 }
 
+int device_setcache(DEVICE *device, uint32_t blockSize, uint32_t blocks) {
+
+  assert(device != NULL);
+
+  // drives keep their own single sector buffer, no block cache for handles
+  (void) blockSize;
+  (void) blocks;
+
+  return 0;
+}
+
+void device_cachestats(DEVICE *device, uint64_t *hits, uint64_t *misses) {
+
+  assert(device != NULL);
+  assert(hits != NULL);
+  assert(misses != NULL);
+
+  *hits=*misses=0;
+}
+
+int device_setbackend(DEVICE *device, int backend) {
+
+  assert(device != NULL);
+
+  if (backend != DEVICE_BACKEND_SYNC) {
+    myerror("Device backend %d is not supported on Windows!", backend);
+    return -1;
+  }
+
+  return 0;
+}
+
+int device_getbackend(DEVICE *device) {
+
+  assert(device != NULL);
+
+  return DEVICE_BACKEND_SYNC;
+}
+
+int device_setdirect(DEVICE *device, int enable) {
+
+  assert(device != NULL);
+
+  if (enable) {
+    myerror("Direct i/o is not supported on Windows!");
+    return -1;
+  }
+
+  return 0;
+}
+
+void device_getgeometry(DEVICE *device, uint32_t *logical, uint32_t *physical, uint32_t *optimal) {
+
+  assert(device != NULL);
+  assert(logical != NULL);
+  assert(physical != NULL);
+  assert(optimal != NULL);
+
+  *logical=*physical=device->isDrive ? device->sectorSize : 512;
+  *optimal=0;
+}
+
+int device_prefetch(DEVICE *device, const struct sDeviceRange *ranges, uint32_t n) {
+
+  assert(device != NULL);
+
+  // nothing to prefetch into
+  (void) ranges;
+  (void) n;
+
+  return 0;
+}
+
+DEVICE *device_openram(void *data, uint64_t size) {
+
+  assert(data != NULL);
+
+  (void) size;
+
+  myerror("RAM devices are not supported on Windows!");
+
+  return NULL;
+}
+
+DEVICE *device_openview(DEVICE *device, int64_t offset, uint64_t size) {
+
+  assert(device != NULL);
+
+  (void) offset;
+  (void) size;
+
+  myerror("Partitions are not supported on Windows!");
+
+  return NULL;
+}
+
+void device_stats(DEVICE *device, struct sDeviceStats *stats) {
+
+  assert(device != NULL);
+  assert(stats != NULL);
+
+  memset(stats, 0, sizeof(struct sDeviceStats));
+}
+
+int device_advise(DEVICE *device, const struct sDeviceRange *ranges, uint32_t n) {
+
+  assert(device != NULL);
+  assert(!n || (ranges != NULL));
+
+  // no read ahead hints on Windows
+  (void) ranges;
+  (void) n;
+
+  return 0;
+}
+
+int device_setoverlay(DEVICE *device, uint32_t blockSize) {
+
+  assert(device != NULL);
+
+  (void) blockSize;
+
+  myerror("Overlay devices are not supported on Windows!");
+
+  return -1;
+}
+
+uint32_t device_getsectorsize(DEVICE *device) {
+
+  assert(device != NULL);
+
+  return device->isDrive ? device->sectorSize : 512;
+}
+
+uint32_t device_geteraseunit(DEVICE *device) {
+
+  assert(device != NULL);
+
+  return 0;
+}
+
+int device_setwriteunit(DEVICE *device, uint32_t unit, uint64_t maxSize) {
+
+  assert(device != NULL);
+
+  (void) unit;
+  (void) maxSize;
+
+  myerror("Staged writes are not supported on Windows!");
+
+  return -1;
+}
+
+void device_overlaystats(DEVICE *device, uint64_t *blocks, uint64_t *writes, uint64_t *bytes) {
+
+  assert(device != NULL);
+
+  *blocks=*writes=*bytes=0;
+}
+
+int device_overlayranges(DEVICE *device, struct sDeviceRange **ranges, uint32_t *n, uint64_t *changed) {
+
+  assert(device != NULL);
+
+  *ranges=NULL;
+  *n=0;
+  *changed=0;
+
+  return 0;
+}
+
+int device_setmodel(DEVICE *device, const struct sDeviceModel *model) {
+
+  assert(device != NULL);
+
+  if (model != NULL) {
+    myerror("Device emulation is not supported on Windows!");
+    return -1;
+  }
+
+  return 0;
+}
+
+uint64_t device_modeldelay(DEVICE *device) {
+
+  assert(device != NULL);
+
+  return 0;
+}
+
+int device_settrace(DEVICE *device, const char *path) {
+
+  assert(device != NULL);
+
+  if (path != NULL) {
+    myerror("Tracing is not supported on Windows!");
+    return -1;
+  }
+
+  return 0;
+}
+
+int device_tracephase(DEVICE *device, const char *name) {
+
+  assert(device != NULL);
+  assert(name != NULL);
+
+  return 0;
+}
+
+void *device_map(DEVICE *device, int64_t offset, uint64_t size) {
+
+  assert(device != NULL);
+
+  // handles are never mapped
+  (void) offset;
+  (void) size;
+
+  return NULL;
+}
+
 int64_t device_seekset(DEVICE *device, int64_t offset) {
 
   assert(device != NULL);
@@ -548,6 +3006,68 @@ int64_t device_write(DEVICE *device, const void *data, uint64_t size, uint64_t n
   }
 }
 
+int64_t device_pread(DEVICE *device, void *data, uint64_t size, int64_t offset) {
+
+  assert(device != NULL);
+  assert(data != NULL);
+
+  // there is no positional read for handles, so emulate it
+  if (device_seekset(device, offset) == -1) {
+    return -1;
+  }
+
+  return device_read(device, data, 1, size);
+}
+
+int64_t device_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset) {
+
+  assert(device != NULL);
+  assert(data != NULL);
+
+  // there is no positional write for handles, so emulate it
+  if (device_seekset(device, offset) == -1) {
+    return -1;
+  }
+
+  return device_write(device, data, 1, size);
+}
+
+int64_t device_preadv(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
+
+  int i;
+  int64_t ret, total=0;
+
+  assert(device != NULL);
+  assert(iov != NULL);
+
+  for (i=0; i<iovcnt; i++) {
+    ret=device_pread(device, iov[i].iov_base, iov[i].iov_len, offset+total);
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
+
+  return total;
+}
+
+int64_t device_pwritev(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset) {
+
+  int i;
+  int64_t ret, total=0;
+
+  assert(device != NULL);
+  assert(iov != NULL);
+
+  for (i=0; i<iovcnt; i++) {
+    ret=device_pwrite(device, iov[i].iov_base, iov[i].iov_len, offset+total);
+    if (ret == -1) return -1;
+    total+=ret;
+    if ((size_t) ret < iov[i].iov_len) break;
+  }
+
+  return total;
+}
+
 int device_sync(DEVICE *device) {
 
   assert(device != NULL);
@@ -562,6 +3082,16 @@ int device_sync(DEVICE *device) {
   }
 }
 
+int device_syncrange(DEVICE *device, int64_t offset, uint64_t size) {
+
+  assert(device != NULL);
+
+  (void) offset;
+  (void) size;
+
+  return device_sync(device);
+}
+
 int device_close(DEVICE *device) {
 
   assert(device != NULL);
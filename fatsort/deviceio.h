@@ -27,12 +27,113 @@
 
 #include <stdint.h>
 
+// size of the blocks kept in the device cache
+#define DEVICE_CACHE_BLOCK_SIZE 4096
+
+// device backends
+#define DEVICE_BACKEND_SYNC 0	// blocking i/o on the file descriptor
+#define DEVICE_BACKEND_MAP 1	// memory mapped image file
+#define DEVICE_BACKEND_URING 2	// batched asynchronous reads with io_uring
+
+// at most this many bytes are staged by device_setwriteunit before they are written back
+#define DEVICE_STAGE_SIZE (64*1024*1024)
+
+// number of requests kept in flight by the io_uring backend
+#define DEVICE_RING_ENTRIES 64
+
+// a range of the device
+struct sDeviceRange {
+  int64_t offset;
+  uint64_t size;
+};
+
+// paths with this prefix are loaded into memory, changes are not written back
+#define DEVICE_RAM_PREFIX "ram:"
+
+// cost model of a slow device, all fields 0 means no cost
+struct sDeviceModel {
+  uint32_t latency;		// microseconds per request
+  uint32_t seek;		// microseconds per GiB of distance to the end of the previous request
+  uint32_t readRate;		// KiB/s, 0 means unlimited
+  uint32_t writeRate;		// KiB/s, 0 means unlimited
+  uint32_t page;		// bytes, writes are charged for all pages they touch
+};
+
+// number of buckets of the seek distance histogram, bucket i counts distances
+// from 2^i to 2^(i+1)-1 bytes, the last one all longer distances
+#define DEVICE_SEEK_BUCKETS 48
+
+// i/o counters of a device
+struct sDeviceStats {
+  uint64_t reads, writes;		// requests of the caller
+  uint64_t bytesRead, bytesWritten;
+  uint64_t mediaReads, mediaWrites;	// accesses to the media below cache and overlay
+  uint64_t mediaBytesRead, mediaBytesWritten;
+  uint64_t syscalls;			// i/o system calls
+  uint64_t syncs;
+  uint64_t seeks;			// media accesses that did not start where the previous one ended
+  uint64_t seekBytes;			// sum of all seek distances
+  uint64_t seekHistogram[DEVICE_SEEK_BUCKETS];
+};
+
+// magic number at the start of trace files
+#define DEVICE_TRACE_MAGIC "FSTRACE1"
+
+// operations recorded in a trace
+#define DEVICE_TRACE_SEEK 1		// device_seekset
+#define DEVICE_TRACE_READ 2		// device_read at the current position
+#define DEVICE_TRACE_WRITE 3		// device_write at the current position
+#define DEVICE_TRACE_PREAD 4		// device_pread and device_preadv
+#define DEVICE_TRACE_PWRITE 5		// device_pwrite and device_pwritev
+#define DEVICE_TRACE_SYNC 6		// device_sync
+#define DEVICE_TRACE_SYNCRANGE 7	// device_syncrange
+#define DEVICE_TRACE_PREFETCH 8		// one range of device_prefetch, consecutive ranges belong to one call
+#define DEVICE_TRACE_PHASE 9		// start of a phase, followed by size bytes of name
+#define DEVICE_TRACE_ADVISE 10		// one range of device_advise
+
+// a trace record, stored in host byte order
+struct sDeviceTraceRecord {
+  uint32_t op;
+  uint32_t reserved;
+  int64_t offset;		// -1 if unknown
+  uint64_t size;
+  uint64_t time;		// nanoseconds since the trace was started
+};
+
 #if defined __LINUX__ || defined __BSD__ || defined __OSX__ 
 
 #define DIRECTORY_SEPARATOR '/'
 
+#include <sys/uio.h>
+
+struct sDeviceCache;
+struct sDeviceRing;
+struct sDeviceOverlay;
+struct sDeviceEmulator;
+struct sDeviceTrace;
+
 typedef struct {
   int fd;
+  struct sDeviceCache *cache;	// block cache, NULL if disabled
+  char *map;			// mapping of image files, NULL for block devices
+  uint64_t mapSize;
+  struct sDeviceRing *ring;	// io_uring instance, NULL for synchronous i/o
+  int direct;			// page cache is bypassed (O_DIRECT or F_NOCACHE)
+  uint32_t logicalSectorSize;	// alignment required for direct i/o
+  uint32_t sectorSize;		// size of the addressable sectors, 512 for image files
+  uint32_t physicalSectorSize;
+  uint32_t optimalIOSize;	// 0 if unknown
+  uint32_t eraseUnitSize;	// preferred write granularity of flash media, 0 if unknown
+  struct sDeviceOverlay *overlay;	// copy-on-write overlay that receives all writes, NULL if disabled
+  int ram;			// device lives in a heap buffer (map), there is no descriptor
+  int64_t position;		// current position of sequential i/o
+  int64_t mediaEnd;		// end of the previous media access
+  struct sDeviceStats stats;
+  struct sDeviceEmulator *emulator;	// delays media accesses according to a model, NULL if disabled
+  struct sDeviceTrace *trace;	// records all calls, NULL if disabled
+  int view;			// device is a view of a partition that shares descriptor and mapping of its disk
+  int64_t base;			// offset of a view on its disk, 0 otherwise
+  uint64_t viewSize;		// size of a view, accesses beyond it are short
 } DEVICE;
 
 #elif defined __WIN32__
@@ -43,6 +144,12 @@ typedef struct {
 
 #define SECTOR_NONE 0xffffffffffffffff
 
+// scatter/gather buffer for vectored i/o
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
 typedef struct {
   HANDLE h;
   int isDrive;
@@ -60,6 +167,18 @@ typedef struct {
 // opens a device
 DEVICE *device_open(const char *path);
 
+// opens a RAM device on size bytes of data that has been allocated with malloc,
+// the device takes ownership of data
+DEVICE *device_openram(void *data, uint64_t size);
+
+// opens a view of size bytes at offset of device, e.g. a partition of a disk, the view has its own
+// cache, overlay and counters but shares the descriptor and mapping, so device must outlive it
+// (views must be opened before the cache, overlay, emulation or trace of device are set up)
+DEVICE *device_openview(DEVICE *device, int64_t offset, uint64_t size);
+
+// gets the i/o counters of a device
+void device_stats(DEVICE *device, struct sDeviceStats *stats);
+
 // performs a seek inside an open device
 int64_t device_seekset(DEVICE *device, int64_t offset);
 
@@ -69,9 +188,87 @@ int64_t device_read(DEVICE *device, void *data, uint64_t size, uint64_t n);
 // writes data to a device
 int64_t device_write(DEVICE *device, const void *data, uint64_t size, uint64_t n);
 
-// ensures that all pending data writes are performed
+// reads data from a device at offset without using the current position
+int64_t device_pread(DEVICE *device, void *data, uint64_t size, int64_t offset);
+
+// writes data to a device at offset without using the current position
+int64_t device_pwrite(DEVICE *device, const void *data, uint64_t size, int64_t offset);
+
+// reads data from a device at offset into several buffers
+int64_t device_preadv(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset);
+
+// writes data from several buffers to a device at offset
+int64_t device_pwritev(DEVICE *device, const struct iovec *iov, int iovcnt, int64_t offset);
+
+// selects the backend of an open device, must be done before enabling the cache
+// (image files are memory mapped by default, io_uring falls back to synchronous i/o if unavailable)
+int device_setbackend(DEVICE *device, int backend);
+
+// gets the backend actually used by a device
+int device_getbackend(DEVICE *device);
+
+// enables or disables direct i/o bypassing the page cache, unaligned transfers
+// are done through aligned bounce buffers
+int device_setdirect(DEVICE *device, int enable);
+
+// gets logical and physical sector size and optimal i/o size of a device
+void device_getgeometry(DEVICE *device, uint32_t *logical, uint32_t *physical, uint32_t *optimal);
+
+// gets the size of the sectors partition tables of the device are addressed in
+uint32_t device_getsectorsize(DEVICE *device);
+
+// gets the erase or allocation unit reported by the device, 0 if unknown
+uint32_t device_geteraseunit(DEVICE *device);
+
+// stages all following writes in memory in aligned units of unit bytes and writes the changed sectors back
+// unit by unit when the device is synced or more than maxSize bytes are staged (not together with an overlay)
+int device_setwriteunit(DEVICE *device, uint32_t unit, uint64_t maxSize);
+
+// enables a write-back LRU cache of aligned blocks with blockSize bytes each
+// (blocks=0 disables the cache, memory mapped devices are never cached)
+int device_setcache(DEVICE *device, uint32_t blockSize, uint32_t blocks);
+
+// gets number of cache hits and misses
+void device_cachestats(DEVICE *device, uint64_t *hits, uint64_t *misses);
+
+// reads all blocks of the given ranges into the device cache in one batch
+int device_prefetch(DEVICE *device, const struct sDeviceRange *ranges, uint32_t n);
+
+// asks the operating system to read the given ranges ahead in the background,
+// this is only a hint, so errors are ignored
+int device_advise(DEVICE *device, const struct sDeviceRange *ranges, uint32_t n);
+
+// redirects all following writes to an in-memory overlay of blockSize blocks, the device is not modified anymore
+int device_setoverlay(DEVICE *device, uint32_t blockSize);
+
+// gets number of overlay blocks, write calls and bytes written to the overlay
+void device_overlaystats(DEVICE *device, uint64_t *blocks, uint64_t *writes, uint64_t *bytes);
+
+// gets the merged ranges of all overlay blocks (to be freed by the caller)
+// and the number of bytes that differ from the device
+int device_overlayranges(DEVICE *device, struct sDeviceRange **ranges, uint32_t *n, uint64_t *changed);
+
+// delays all accesses to the media (below the cache) according to model, NULL disables the emulation
+int device_setmodel(DEVICE *device, const struct sDeviceModel *model);
+
+// returns the total delay in nanoseconds that was added by the model
+uint64_t device_modeldelay(DEVICE *device);
+
+// records all following calls to trace file path, NULL stops the recording
+int device_settrace(DEVICE *device, const char *path);
+
+// marks the start of a phase named name in the trace, if one is recorded
+int device_tracephase(DEVICE *device, const char *name);
+
+// returns a pointer to size bytes at offset if the device is memory mapped, NULL otherwise
+void *device_map(DEVICE *device, int64_t offset, uint64_t size);
+
+// ensures that all pending data writes (including cached ones) are performed
 int device_sync(DEVICE *device);
 
+// like device_sync, but only waits for data written to the given range if the platform allows it
+int device_syncrange(DEVICE *device, int64_t offset, uint64_t size);
+
 // closes a device
 int device_close(DEVICE *device);
 
@@ -0,0 +1,96 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+	This file contains/describes functions that unpack FAT12 tables.
+*/
+
+#include "fat12.h"
+
+#include <stddef.h>
+#include <assert.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define FAT12_SSSE3
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define FAT12_NEON
+#endif
+
+/*
+	Two entries are packed into three bytes b0 b1 b2:
+	the even entry is b0 plus the low nibble of b1, the odd entry is the high nibble of b1 plus b2.
+	The vector variants load 16 bytes and shuffle each group of three bytes into the two
+	little endian 16 bit lanes b0 b1 and b1 b2, then mask the even and shift the odd lanes.
+	Each step consumes 12 bytes and produces 8 entries.
+*/
+#if defined(FAT12_SSSE3) || defined(FAT12_NEON)
+static const uint8_t shuffle[16] = {0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11};
+#endif
+
+void unpackFAT12(const uint8_t *src, uint16_t *dst, uint32_t count) {
+/*
+	unpacks count 12 bit FAT entries from src into dst
+*/
+	assert(!count || ((src != NULL) && (dst != NULL)));
+
+	uint32_t i=0;
+	const uint8_t *p;
+
+#if defined(FAT12_SSSE3)
+	const uint64_t size=FAT12_PACKED_SIZE(count);
+	const __m128i indices=_mm_loadu_si128((const __m128i *) shuffle);
+	const __m128i even=_mm_set1_epi32(0x00000FFF);
+	const __m128i odd=_mm_set1_epi32((int32_t) 0xFFFF0000);
+	__m128i v;
+
+	// the 16 byte load must not run over the end of src
+	for (; (i + 8 <= count) && ((uint64_t) i / 2 * 3 + 16 <= size); i+=8) {
+		v=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + i / 2 * 3)), indices);
+		v=_mm_or_si128(_mm_and_si128(v, even), _mm_and_si128(_mm_srli_epi16(v, 4), odd));
+		_mm_storeu_si128((__m128i *) (dst + i), v);
+	}
+#elif defined(FAT12_NEON)
+	const uint64_t size=FAT12_PACKED_SIZE(count);
+	const uint8x16_t indices=vld1q_u8(shuffle);
+	const uint16x8_t even=vreinterpretq_u16_u32(vdupq_n_u32(0x00000FFF));
+	const uint16x8_t odd=vreinterpretq_u16_u32(vdupq_n_u32(0xFFFF0000));
+	uint16x8_t v;
+
+	// the 16 byte load must not run over the end of src
+	for (; (i + 8 <= count) && ((uint64_t) i / 2 * 3 + 16 <= size); i+=8) {
+		v=vreinterpretq_u16_u8(vqtbl1q_u8(vld1q_u8(src + i / 2 * 3), indices));
+		v=vorrq_u16(vandq_u16(v, even), vandq_u16(vshrq_n_u16(v, 4), odd));
+		vst1q_u16(dst + i, v);
+	}
+#endif
+
+	// remaining entries, or all of them without vector instructions
+	for (; i + 2 <= count; i+=2) {
+		p=src + i / 2 * 3;
+		dst[i]=(uint16_t) (p[0] | ((p[1] & 0x0F) << 8));
+		dst[i+1]=(uint16_t) ((p[1] >> 4) | (p[2] << 4));
+	}
+	if (i < count) {
+		p=src + i / 2 * 3;
+		dst[i]=(uint16_t) (p[0] | ((p[1] & 0x0F) << 8));
+	}
+}
@@ -0,0 +1,36 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+	This file contains/describes functions that unpack FAT12 tables.
+*/
+
+#ifndef __fat12_h__
+#define __fat12_h__
+
+#include <stdint.h>
+
+// bytes that hold count packed FAT12 entries
+#define FAT12_PACKED_SIZE(count) (((uint64_t) (count) * 3 + 1) / 2)
+
+// unpacks count 12 bit FAT entries from src into dst, src holds FAT12_PACKED_SIZE(count) bytes
+void unpackFAT12(const uint8_t *src, uint16_t *dst, uint32_t count);
+
+#endif // __fat12_h__
@@ -39,7 +39,9 @@
 #include "options.h"
 #include "errors.h"
 #include "sort.h"
+#include "replay.h"
 #include "clusterchain.h"
+#include "partition.h"
 #include "misc.h"
 #include "mallocv.h"
 
@@ -87,14 +89,57 @@
 				"\t-L LOC\tUse the locale LOC instead of the locale from the environment variables\n\n" \
 				"More options:\n\n" \
 				"\t-l\tPrint current order of files only\n\n" \
+				"\t-g\tReport how fragmented the files are instead of sorting, together with\n" \
+				"\t\tthe extent sizes and the most fragmented directories\n\n" \
+				"\t-C\tCheck the file system for cross-linked, cyclic and lost cluster chains\n" \
+				"\t\tbefore sorting and refuse to sort if it is inconsistent\n\n" \
+				"\t-Y MOD\tEmulate a slow device with model MOD, a comma separated list of\n" \
+				"\t\tthe presets sd or usb and latency=US, seek=US (per GiB of distance),\n" \
+				"\t\tread=KIB (per second), write=KIB (per second) and page=BYTES\n\n" \
+				"\t-w\tDry run: sort and write to an in-memory copy of the changed sectors\n" \
+				"\t\tonly and report what would have been written\n\n" \
+				"\t-s\tPrint device i/o statistics and a histogram of seek distances after sorting\n\n" \
+				"\t-T FILE\tRecord all device i/o requests with their time to trace FILE\n\n" \
+				"\t-G FILE\tReplay trace FILE on DEVICE with the selected backend, cache and\n" \
+				"\t\tdevice model instead of sorting and print the time per phase.\n" \
+				"\t\tWrites put back the current contents of the device.\n\n" \
 				"\t-i\tPrint file system information only\n\n" \
 				"\t-f\tForce sorting even if file system is mounted\n\n" \
+				"\t-p N\tUse the file system in partition N of an MBR or GPT partitioned DEVICE\n\n" \
+				"\t-P\tSort the file systems in all FAT partitions of DEVICE concurrently\n" \
+				"\t\t(with -i print the partition table, not together with -j, -k, -T and -G)\n\n" \
+				"\t-b KIB\tUse a device cache of KIB kibibytes (default 4096, 0 disables it)\n\n" \
+				"\t-F KIB\tKeep up to KIB kibibytes of the FAT in memory (default 65536, 0 disables it)\n\n" \
+				"\t-B IO\tAccess the device with i/o backend IO where IO is one of\n\n" \
+				"\t\t\tsync : blocking reads and writes (default for devices)\n\n" \
+				"\t\t\tmmap : memory mapping (default for image files)\n\n" \
+				"\t\t\turing : batched asynchronous reads with io_uring (Linux only)\n\n" \
+				"\t-O\tBypass the page cache with direct i/o\n\n" \
+				"\t-u BYTES\tWrite directories in aligned units of BYTES bytes, a multiple of 512\n" \
+				"\t\t(default: the erase unit reported by flash media with sync policies dirs,\n" \
+				"\t\tkib and end, 0 disables it)\n\n" \
+				"\t-S POL\tSync written directories to the device with policy POL where POL is one of\n\n" \
+				"\t\t\tdir : after each directory (default)\n\n" \
+				"\t\t\tdirs:N : after every N directories, a crash may undo the last N\n\n" \
+				"\t\t\tkib:N : after N kibibytes, a crash may undo the last N kibibytes\n\n" \
+				"\t\t\trange : only the range written for each directory (no device cache flush)\n\n" \
+				"\t\t\tend : once after sorting, a crash may undo any directory\n\n" \
+				"\t-j FILE\tLog directory writes to journal FILE before they are applied\n\n" \
+				"\t\tCommitted writes of an interrupted run are completed and uncommitted\n" \
+				"\t\tones are discarded when FATSort is started again with the same journal.\n" \
+				"\t\tThe file is removed afterwards.\n\n" \
+				"\t-k FILE\tSave the traversal position to checkpoint FILE every second\n\n" \
+				"\t-K, --resume\n\n" \
+				"\t\tSkip the directories that were finished according to the checkpoint\n\n" \
 				"\t-h, --help\n\n" \
 				"\t\tPrint some help\n\n" \
 				"\t-v, --version\n\n" \
 				"\t\tPrint version information\n\n" \
 				"\t-q\tBe quiet\n\n" \
-				"DEVICE must be a FAT12, FAT16, FAT32 or exFAT file system.\n\n" \
+				"DEVICE must be a FAT12, FAT16, FAT32 or exFAT file system or a disk with\n" \
+				"partitions holding them (options -p and -P).\n" \
+				"If DEVICE is ram:FILE, the image FILE is loaded into memory and sorted there\n" \
+				"without writing it back, e.g. for benchmarks.\n\n" \
 				"WARNING: THE FILESYSTEM MUST BE CONSISTENT (NO FILESYSTEM ERRORS).\n" \
 				"PLEASE BACKUP YOUR DATA BEFORE USING FATSORT. RISK OF CORRUPT FILESYSTEM!\n" \
 				"FATSORT USER ASSUMES ALL RISK. FATSORT WILL NOT BE HELD LIABLE FOR DATA LOSS!\n" \
@@ -102,6 +147,8 @@
 				"Examples:\n" \
 				"\tfatsort /dev/sda\t\tSort /dev/sda.\n" \
 				"\tfatsort -n /dev/sdb1\t\tSort /dev/sdb1 with natural order.\n" \
+				"\tfatsort -P disk.img\t\tSort all FAT partitions of disk.img.\n" \
+				"\tfatsort -g /dev/sdc1\t\tReport the fragmentation of /dev/sdc1.\n" \
 				"\n" \
 				"Report bugs to <fatsort@formenos.de>.\n"
 
@@ -117,7 +164,7 @@
 				INFO_USAGE
 
 
-int32_t printFSInfo(char *filename) {
+int32_t printFSInfo(char *filename, uint32_t partition) {
 /*
 	print file system information
 */
@@ -126,46 +173,40 @@ int32_t printFSInfo(char *filename) {
 
 	uint32_t value, clen;
 	uint32_t usedClusters, badClusters;
-	uint32_t i;
-	struct sClusterChain *chain;
+	uint32_t i, *lengths=NULL;
 
 	struct sFileSystem fs;
 
 	printf("\t- File system information -\n");
 
-	if (openFileSystem(filename, FS_MODE_RO, &fs)) {
+	if (openFileSystem(filename, partition, FS_MODE_RO, &fs)) {
 		myerror("Failed to open file system!");
 		return -1;
 	}
 
-	if (fs.FATType != 64) { // VFAT
-		usedClusters=0;
-		badClusters=0;
-		for (i=2; i<fs.clusters+2; i++) {
-			getFATEntry(&fs, i, &value);
-			if ((value & 0x0FFFFFFF) != 0) usedClusters++;
-			if (fs.FATType == FATTYPE_FAT32) {
-				if ((value & 0x0FFFFFFF) == 0x0FFFFFF7) badClusters++;
-			} else if (fs.FATType == FATTYPE_FAT16) {
-				if (value == 0x0000FFF7) badClusters++;
-			} else if (fs.FATType == FATTYPE_FAT12) {
-				if (value == 0x00000FF7) badClusters++;
-			} else {
-				myerror("Unsupported FAT type!");
-				return -1;
-			}
-		}
-	} else { // exFAT
-		usedClusters=fs.allocatedClusters;
-		badClusters=0;
-		for (i=2; i<fs.clusters+2; i++) {
-			getFATEntry(&fs, i, &value);
-			if (value == 0xFFFFFFF7) badClusters++;
-		}
+	if (setupDevice(&fs)) {
+		myerror("Failed to set up device!");
+		closeFileSystem(&fs);
+		return -1;
+	}
+
+	// chain lengths are only printed with more info
+	if (OPT_MORE_INFO && ((lengths=malloc(sizeof(uint32_t) * (fs.clusters+2))) == NULL)) {
+		stderror();
+		closeFileSystem(&fs);
+		return -1;
+	}
+
+	if (getFATStats(&fs, &usedClusters, &badClusters, lengths)) {
+		myerror("Failed to get cluster statistics!");
+		free(lengths);
+		closeFileSystem(&fs);
+		return -1;
 	}
 
 	// feature: print volume label
 	printf("Device:\t\t\t\t\t%s\n", fs.path);
+	if (partition) printf("Partition:\t\t\t\t%u\n", partition);
 	printf("Type:\t\t\t\t\t");
 	if (fs.FATType == 12) {
 		printf("FAT12");
@@ -188,6 +229,7 @@ int32_t printFSInfo(char *filename) {
 	if (fs.FATType == FATTYPE_FAT32) {
 		if (getFATEntry(&fs, SwapInt32(fs.bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_RootClus), &value) == -1) {
 			myerror("Failed to get FAT entry!");
+			free(lengths);
 			closeFileSystem(&fs);
 			return -1;
 		}
@@ -214,27 +256,94 @@ int32_t printFSInfo(char *filename) {
 			getFATEntry(&fs, i, &value);
 
 			clen=0;
-			if ((value & 0x0FFFFFFF ) != 0) {
-				if ((chain=newClusterChain()) == NULL) {
-					myerror("Failed to generate new ClusterChain!");
-					return -1;
-				}
-				clen=getClusterChain(&fs, i, chain);
-				freeClusterChain(chain);
-			}
+			if ((value & 0x0FFFFFFF ) != 0) clen=lengths[i];
 
 			printf("%08x\t%08x\t%u\n", i, value, clen);
 
 		}
 
+		uint64_t hits, misses;
+		uint32_t logical, physical, optimal;
+		device_getgeometry(fs.device, &logical, &physical, &optimal);
+		printf("\nDevice sectors (logical / physical):\t%u / %u bytes\n", logical, physical);
+		printf("Optimal i/o size:\t\t\t%u bytes\n", optimal);
+		printf("Erase unit size:\t\t\t%u bytes\n", device_geteraseunit(fs.device));
+		device_cachestats(fs.device, &hits, &misses);
+		printf("Device cache hits / misses:\t\t%" PRIu64 " / %" PRIu64 "\n", hits, misses);
+		if (fs.FATCache != NULL) {
+			printf("FAT cache pages loaded:\t\t\t%" PRIu64 " of %u\n", fs.FATCache->loads, fs.FATCache->pageCount);
+		}
 	}
 
+	free(lengths);
 	closeFileSystem(&fs);
 
 	return 0;
 
 }
 
+int32_t printPartitionsInfo(char *filename) {
+/*
+	print the partition table and the information of all FAT file systems in it
+*/
+
+	assert(filename != NULL);
+
+	DEVICE *disk;
+	struct sPartitionTable *table;
+	struct sPartition *p;
+	uint32_t i;
+	int32_t ret=0, fat[MAX_PARTITIONS];
+	char size[32];
+
+	if ((disk=openDevice(filename, FS_MODE_RO)) == NULL) {
+		myerror("Failed to open device!");
+		return -1;
+	}
+
+	if ((table=malloc(sizeof(struct sPartitionTable))) == NULL) {
+		stderror();
+		device_close(disk);
+		return -1;
+	}
+
+	if (readPartitionTable(disk, table)) {
+		myerror("Failed to read partition table!");
+		free(table);
+		device_close(disk);
+		return -1;
+	}
+
+	printf("\t- Partition table -\n");
+	printf("Device:\t\t\t\t\t%s\n", filename);
+	printf("Partition table:\t\t\t%s\n", getPartitionSchemeName(table->scheme));
+	for (i=0; i<table->count; i++) {
+		p=&table->partitions[i];
+		fat[i]=isFATPartition(disk, p);
+		formatBytes(size, sizeof(size), p->size);
+		printf("Partition %u:\t\t\t\t%s at offset %" PRIu64 ", type 0x%02x%s\n", p->number, size,
+			(uint64_t) p->offset, p->type, fat[i] ? ", FAT" : "");
+	}
+
+	// each file system opens the device on its own
+	device_close(disk);
+
+	if (table->scheme == PARTITION_SCHEME_NONE) {
+		printf("\n");
+		ret=printFSInfo(filename, 0);
+	}
+
+	for (i=0; i<table->count; i++) {
+		if (!fat[i]) continue;
+		printf("\n");
+		if (printFSInfo(filename, table->partitions[i].number)) ret=-1;
+	}
+
+	free(table);
+
+	return ret;
+}
+
 int main(int argc, char *argv[]) {
 /*
 	parse arguments and options and start sorting
@@ -281,9 +390,14 @@ int main(int argc, char *argv[]) {
 
 	filename=argv[optind];
 
-	if (OPT_INFO) {
+	if (OPT_REPLAY != NULL) {
+		if (replayTrace(OPT_REPLAY, filename) == -1) {
+			myerror("Failed to replay trace!");
+			return -1;
+		}
+	} else if (OPT_INFO) {
 		//infomsg(INFO_HEADER "\n\n");
-		if (printFSInfo(filename) == -1) {
+		if ((OPT_ALL_PARTITIONS ? printPartitionsInfo(filename) : printFSInfo(filename, OPT_PARTITION)) == -1) {
 			myerror("Failed to print file system information");
 			return -1;
 		}
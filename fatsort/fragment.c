@@ -0,0 +1,198 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+	This file contains/describes the fragmentation report.
+*/
+
+#include "fragment.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#include "errors.h"
+#include "misc.h"
+#include "mallocv.h"
+
+struct sFragmentation *frag_new(void) {
+/*
+	creates an empty fragmentation report
+*/
+	struct sFragmentation *frag;
+
+	if ((frag=malloc(sizeof(struct sFragmentation))) == NULL) {
+		stderror();
+		return NULL;
+	}
+	memset(frag, 0, sizeof(struct sFragmentation));
+
+	return frag;
+}
+
+void frag_begindir(struct sFragmentation *frag, const char *path) {
+/*
+	starts collecting the files of directory path
+*/
+	assert(frag != NULL);
+	assert(path != NULL);
+
+	frag->current.path=(char *) path;
+	frag->current.files=0;
+	frag->current.extents=0;
+	frag->fileExtents=0;
+}
+
+void frag_addextent(struct sFragmentation *frag, uint32_t length) {
+/*
+	adds an extent of length clusters to the current file
+*/
+	assert(frag != NULL);
+
+	uint32_t sizeClass=0;
+
+	while ((length >> (sizeClass+1)) && (sizeClass < FRAG_SIZE_CLASSES-1)) sizeClass++;
+
+	frag->sizeClasses[sizeClass]++;
+	frag->extents++;
+	frag->clusters+=length;
+	if (length > frag->largestExtent) frag->largestExtent=length;
+	frag->fileExtents++;
+}
+
+void frag_brokenfile(struct sFragmentation *frag) {
+/*
+	marks the current file as having a broken cluster chain
+*/
+	assert(frag != NULL);
+
+	frag->brokenFiles++;
+}
+
+void frag_endfile(struct sFragmentation *frag) {
+/*
+	finishes the current file
+*/
+	assert(frag != NULL);
+
+	// empty files have no clusters at all
+	if (frag->fileExtents) {
+		frag->files++;
+		if (frag->fileExtents > 1) frag->fragmentedFiles++;
+		frag->current.files++;
+		frag->current.extents+=frag->fileExtents;
+	}
+	frag->fileExtents=0;
+}
+
+int32_t frag_enddir(struct sFragmentation *frag) {
+/*
+	finishes the current directory and inserts it into the list of the most fragmented ones
+*/
+	assert(frag != NULL);
+
+	uint64_t excess=frag->current.extents - frag->current.files;
+	uint32_t i;
+	char *path;
+
+	frag->dirs++;
+
+	// directories without fragmented files are not listed
+	if (!excess) return 0;
+
+	for (i=frag->topCount; i && (frag->top[i-1].extents - frag->top[i-1].files < excess); i--);
+	if (i == FRAG_TOP_DIRS) return 0;
+
+	if ((path=malloc(strlen(frag->current.path)+1)) == NULL) {
+		stderror();
+		return -1;
+	}
+	strcpy(path, frag->current.path);
+
+	if (frag->topCount == FRAG_TOP_DIRS) {
+		free(frag->top[FRAG_TOP_DIRS-1].path);
+	} else {
+		frag->topCount++;
+	}
+	memmove(&frag->top[i+1], &frag->top[i], sizeof(struct sFragDir) * (frag->topCount - 1 - i));
+
+	frag->top[i].path=path;
+	frag->top[i].files=frag->current.files;
+	frag->top[i].extents=frag->current.extents;
+
+	return 0;
+}
+
+void frag_print(struct sFragmentation *frag, uint32_t clusterSize) {
+/*
+	prints the report for clusters of clusterSize bytes
+*/
+	assert(frag != NULL);
+
+	char from[32], to[32];
+	uint32_t i;
+
+	printf("Fragmentation report:\n\n");
+	printf("Directories:\t\t\t%" PRIu64 "\n", frag->dirs);
+	printf("Files (fragmented):\t\t%" PRIu64 " (%" PRIu64 ")\n", frag->files, frag->fragmentedFiles);
+	printf("Extents:\t\t\t%" PRIu64 " (%.2f per file)\n", frag->extents,
+		frag->files ? (double) frag->extents / frag->files : 0.0);
+	if (frag->brokenFiles) {
+		printf("Broken cluster chains:\t\t%" PRIu64 " (counted up to the break)\n", frag->brokenFiles);
+	}
+
+	if (!frag->extents) return;
+
+	formatBytes(from, sizeof(from), (uint64_t) frag->largestExtent * clusterSize);
+	printf("Largest extent:\t\t\t%s\n", from);
+	printf("Average extent:\t\t\t%.1f KiB\n", (double) frag->clusters * clusterSize / frag->extents / 1024);
+
+	printf("\nExtent sizes:\n");
+	for (i=0; i<FRAG_SIZE_CLASSES; i++) {
+		if (!frag->sizeClasses[i]) continue;
+		formatBytes(from, sizeof(from), ((uint64_t) clusterSize) << i);
+		if (i < FRAG_SIZE_CLASSES-1) {
+			formatBytes(to, sizeof(to), ((uint64_t) clusterSize) << (i+1));
+			printf("\t%10s - %-10s %12" PRIu64 "\n", from, to, frag->sizeClasses[i]);
+		} else {
+			printf("\t%10s or more   %12" PRIu64 "\n", from, frag->sizeClasses[i]);
+		}
+	}
+
+	if (!frag->topCount) return;
+
+	printf("\nMost fragmented directories (extents / files):\n");
+	for (i=0; i<frag->topCount; i++) {
+		printf("\t%8" PRIu64 " / %-8u %s\n", frag->top[i].extents, frag->top[i].files, frag->top[i].path);
+	}
+}
+
+void frag_free(struct sFragmentation *frag) {
+/*
+	frees the report
+*/
+	uint32_t i;
+
+	if (frag == NULL) return;
+
+	for (i=0; i<frag->topCount; i++) free(frag->top[i].path);
+	free(frag);
+}
@@ -0,0 +1,89 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+	This file contains/describes the fragmentation report.
+	Files are added as the contiguous runs (extents) of their cluster chains,
+	directories are ranked by the extents of their files beyond the first one.
+*/
+
+#ifndef __fragment_h__
+#define __fragment_h__
+
+#include <stdint.h>
+
+// extents of 1, 2-3, 4-7, ... clusters, the last class holds all larger ones
+#define FRAG_SIZE_CLASSES 24
+
+// number of directories in the list of the most fragmented ones
+#define FRAG_TOP_DIRS 10
+
+struct sFragDir {
+/*
+	a directory in the list of the most fragmented ones
+*/
+	char *path;
+	uint32_t files;
+	uint64_t extents;
+};
+
+struct sFragmentation {
+/*
+	this structure collects the extents of all files
+*/
+	uint64_t files;
+	uint64_t fragmentedFiles;	// files with more than one extent
+	uint64_t brokenFiles;		// files whose cluster chain is broken, counted up to the break
+	uint64_t extents;
+	uint64_t clusters;
+	uint32_t largestExtent;		// in clusters
+	uint64_t sizeClasses[FRAG_SIZE_CLASSES];
+	uint64_t dirs;
+	struct sFragDir top[FRAG_TOP_DIRS];	// most fragmented directories first
+	uint32_t topCount;
+	uint32_t fileExtents;		// extents of the current file
+	struct sFragDir current;	// directory whose files are being added
+};
+
+// creates an empty fragmentation report
+struct sFragmentation *frag_new(void);
+
+// starts collecting the files of directory path
+void frag_begindir(struct sFragmentation *frag, const char *path);
+
+// adds an extent of length clusters to the current file
+void frag_addextent(struct sFragmentation *frag, uint32_t length);
+
+// marks the current file as having a broken cluster chain
+void frag_brokenfile(struct sFragmentation *frag);
+
+// finishes the current file
+void frag_endfile(struct sFragmentation *frag);
+
+// finishes the current directory and ranks it, -1 on error
+int32_t frag_enddir(struct sFragmentation *frag);
+
+// prints the report for clusters of clusterSize bytes
+void frag_print(struct sFragmentation *frag, uint32_t clusterSize);
+
+// frees the report
+void frag_free(struct sFragmentation *frag);
+
+#endif // __fragment_h__
@@ -0,0 +1,390 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes the write-ahead journal. Directory writes are
+	logged with their old and new contents to a sidecar file and only applied
+	to the device after a commit record has been synced. When the journal is
+	opened again, committed writes of an interrupted run are rolled forward and
+	uncommitted ones are discarded, they never reached the device.
+*/
+
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/types.h>
+#if defined __WIN32__
+#include <io.h>
+#endif
+#include "errors.h"
+#include "misc.h"
+#include "mallocv.h"
+
+#define JOURNAL_MAGIC "FSJRNL01"
+#define JOURNAL_RECORD_MAGIC 0x4c4e524aU
+
+#define JOURNAL_RECORD_DATA 1
+#define JOURNAL_RECORD_COMMIT 2
+
+// the journal is a host local file, so all fields are stored in host byte order
+struct sJournalHeader {
+	char magic[8];
+	uint64_t volume;
+};
+
+struct sJournalRecord {
+	uint32_t magic;
+	uint32_t type;
+	int64_t offset;
+	uint32_t size;		// size of the write, followed by size bytes old and size bytes new data
+	uint32_t reserved;
+	uint64_t checksum;	// hash of record with checksum 0 and data
+};
+
+static int32_t journal_flush(struct sJournal *journal) {
+/*
+	writes buffered journal data and waits until it is on disk
+*/
+	assert(journal != NULL);
+
+	if (fflush(journal->fp)) {
+		stderror();
+		return -1;
+	}
+#if defined __WIN32__
+	if (_commit(_fileno(journal->fp))) {
+#else
+	if (fsync(fileno(journal->fp))) {
+#endif
+		stderror();
+		return -1;
+	}
+
+	return 0;
+}
+
+static int32_t journal_write(struct sJournal *journal, uint32_t type, int64_t offset, const void *old, const void *new, uint32_t size) {
+/*
+	appends a record to the journal
+*/
+	assert(journal != NULL);
+
+	struct sJournalRecord rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic=JOURNAL_RECORD_MAGIC;
+	rec.type=type;
+	rec.offset=offset;
+	rec.size=size;
+	rec.checksum=hashData(HASH_INIT, &rec, sizeof(rec));
+	if (size) {
+		rec.checksum=hashData(rec.checksum, old, size);
+		rec.checksum=hashData(rec.checksum, new, size);
+	}
+
+	if (fseeko(journal->fp, (off_t) journal->end, SEEK_SET) ||
+		(fwrite(&rec, sizeof(rec), 1, journal->fp) != 1) ||
+		(size && (fwrite(old, size, 1, journal->fp) != 1)) ||
+		(size && (fwrite(new, size, 1, journal->fp) != 1))) {
+		stderror();
+		return -1;
+	}
+
+	journal->end+=sizeof(rec) + 2 * (uint64_t) size;
+
+	return 0;
+}
+
+static int32_t journal_read(struct sJournal *journal, uint64_t pos, struct sJournalRecord *rec, char **data) {
+/*
+	reads and verifies the record at pos, *data is resized to hold old and new data,
+	returns 1 if there is no valid record at pos
+*/
+	assert(journal != NULL);
+	assert(rec != NULL);
+	assert(data != NULL);
+
+	uint64_t checksum;
+	char *tmp;
+
+	if (fseeko(journal->fp, (off_t) pos, SEEK_SET)) {
+		stderror();
+		return -1;
+	}
+
+	if ((fread(rec, sizeof(*rec), 1, journal->fp) != 1) || (rec->magic != JOURNAL_RECORD_MAGIC)) return 1;
+
+	if ((tmp=realloc(*data, 2 * (size_t) rec->size + 1)) == NULL) {
+		stderror();
+		return -1;
+	}
+	*data=tmp;
+
+	// a torn record at the end of the journal is not an error
+	if (rec->size && (fread(*data, 2 * (size_t) rec->size, 1, journal->fp) != 1)) return 1;
+
+	checksum=rec->checksum;
+	rec->checksum=0;
+	rec->checksum=hashData(hashData(HASH_INIT, rec, sizeof(*rec)), *data, 2 * (size_t) rec->size);
+	if (rec->checksum != checksum) return 1;
+
+	return 0;
+}
+
+static int32_t journal_addrecord(struct sJournal *journal, uint64_t pos) {
+/*
+	remembers the position of a data record
+*/
+	assert(journal != NULL);
+
+	uint64_t *tmp;
+
+	if (journal->count == journal->capacity) {
+		if ((tmp=realloc(journal->records, (journal->capacity * 2 + 16) * sizeof(uint64_t))) == NULL) {
+			stderror();
+			return -1;
+		}
+		journal->records=tmp;
+		journal->capacity=journal->capacity * 2 + 16;
+	}
+	journal->records[journal->count++]=pos;
+
+	return 0;
+}
+
+static int32_t journal_apply(struct sJournal *journal, DEVICE *device) {
+/*
+	writes the new contents of all data records to the device in log order
+*/
+	assert(journal != NULL);
+	assert(device != NULL);
+
+	struct sJournalRecord rec;
+	char *data=NULL;
+	uint32_t i;
+
+	for (i=0; i<journal->count; i++) {
+		if (journal_read(journal, journal->records[i], &rec, &data)) {
+			myerror("Failed to read journal record!");
+			free(data);
+			return -1;
+		}
+		if (device_pwrite(device, data + rec.size, rec.size, rec.offset) < (int64_t) rec.size) {
+			stderror();
+			free(data);
+			return -1;
+		}
+	}
+
+	free(data);
+
+	return 0;
+}
+
+struct sJournal *journal_open(const char *path, uint64_t volume) {
+/*
+	opens or creates the journal file for the file system with fingerprint volume
+*/
+	assert(path != NULL);
+
+	struct sJournal *journal;
+	struct sJournalHeader header;
+
+	if ((journal=malloc(sizeof(struct sJournal))) == NULL) {
+		stderror();
+		return NULL;
+	}
+	memset(journal, 0, sizeof(struct sJournal));
+	journal->volume=volume;
+	journal->end=sizeof(header);
+
+	if ((journal->path=malloc(strlen(path)+1)) == NULL) {
+		stderror();
+		free(journal);
+		return NULL;
+	}
+	strcpy(journal->path, path);
+
+	if ((journal->fp=fopen(path, "r+b")) != NULL) {
+		if ((fread(&header, sizeof(header), 1, journal->fp) != 1) ||
+			memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic))) {
+			myerror("%s is not a journal file!", path);
+			// keep the file
+			fclose(journal->fp);
+			journal->fp=NULL;
+			journal_close(journal);
+			return NULL;
+		}
+		if (header.volume != volume) {
+			myerror("Journal %s belongs to another file system!", path);
+			// keep the file
+			fclose(journal->fp);
+			journal->fp=NULL;
+			journal_close(journal);
+			return NULL;
+		}
+	} else if ((errno == ENOENT) && ((journal->fp=fopen(path, "w+b")) != NULL)) {
+		memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+		header.volume=volume;
+		if ((fwrite(&header, sizeof(header), 1, journal->fp) != 1) || journal_flush(journal)) {
+			stderror();
+			journal_close(journal);
+			return NULL;
+		}
+	} else {
+		stderror();
+		free(journal->path);
+		free(journal);
+		return NULL;
+	}
+
+	return journal;
+}
+
+int32_t journal_recover(struct sJournal *journal, DEVICE *device) {
+/*
+	replays an interrupted journal on the device: committed writes are rolled forward,
+	uncommitted ones are discarded, returns one of the JOURNAL_* results
+*/
+	assert(journal != NULL);
+	assert(device != NULL);
+
+	struct sJournalRecord rec;
+	char *data=NULL;
+	uint64_t pos=sizeof(struct sJournalHeader);
+	int32_t ret, committed=0;
+
+	while ((ret=journal_read(journal, pos, &rec, &data)) == 0) {
+		if (rec.type == JOURNAL_RECORD_COMMIT) {
+			committed=1;
+			break;
+		}
+		if (journal_addrecord(journal, pos)) {
+			free(data);
+			return -1;
+		}
+		pos+=sizeof(rec) + 2 * (uint64_t) rec.size;
+	}
+	free(data);
+	if (ret == -1) return -1;
+
+	if (!journal->count) return journal_reset(journal) ? -1 : JOURNAL_CLEAN;
+
+	// uncommitted records were never applied, the device still holds the old contents
+	if (!committed) return journal_reset(journal) ? -1 : JOURNAL_DISCARDED;
+
+	if (journal_apply(journal, device) || device_sync(device) || journal_reset(journal)) {
+		myerror("Failed to replay journal!");
+		return -1;
+	}
+
+	return JOURNAL_ROLLED_FORWARD;
+}
+
+int32_t journal_log(struct sJournal *journal, int64_t offset, const void *old, const void *new, uint32_t size) {
+/*
+	logs old and new contents of size bytes at offset,
+	the write is applied to the device by journal_commit
+*/
+	assert(journal != NULL);
+	assert(old != NULL);
+	assert(new != NULL);
+
+	uint64_t pos=journal->end;
+
+	if (journal_write(journal, JOURNAL_RECORD_DATA, offset, old, new, size)) return -1;
+
+	return journal_addrecord(journal, pos);
+}
+
+uint32_t journal_pending(struct sJournal *journal) {
+/*
+	returns the number of logged but not yet committed writes
+*/
+	assert(journal != NULL);
+
+	return journal->count;
+}
+
+int32_t journal_commit(struct sJournal *journal, DEVICE *device) {
+/*
+	makes logged writes durable with a commit record and applies them to the device,
+	the caller has to sync the device and call journal_reset afterwards
+*/
+	assert(journal != NULL);
+	assert(device != NULL);
+
+	uint64_t pos=journal->end;
+
+	if (!journal->count) return 0;
+
+	if (journal_write(journal, JOURNAL_RECORD_COMMIT, 0, NULL, NULL, 0) || journal_flush(journal)) {
+		myerror("Failed to commit journal!");
+		// drop the commit record, the logged writes stay pending for the next commit
+		if (ftruncate(fileno(journal->fp), (off_t) pos)) stderror();
+		journal->end=pos;
+		return -1;
+	}
+
+	if (journal_apply(journal, device)) {
+		myerror("Failed to apply journal!");
+		return -1;
+	}
+
+	return 0;
+}
+
+int32_t journal_reset(struct sJournal *journal) {
+/*
+	empties the journal after the applied writes have been synced to the device
+*/
+	assert(journal != NULL);
+
+	if (fflush(journal->fp) || ftruncate(fileno(journal->fp), sizeof(struct sJournalHeader)) || journal_flush(journal)) {
+		stderror();
+		return -1;
+	}
+
+	journal->end=sizeof(struct sJournalHeader);
+	journal->count=0;
+
+	return 0;
+}
+
+void journal_close(struct sJournal *journal) {
+/*
+	closes the journal file and removes it if nothing is left to recover
+*/
+	assert(journal != NULL);
+
+	int32_t empty=(journal->end == sizeof(struct sJournalHeader));
+
+	if (journal->fp != NULL) {
+		fclose(journal->fp);
+		if (empty) remove(journal->path);
+	}
+
+	free(journal->records);
+	free(journal->path);
+	free(journal);
+}
@@ -0,0 +1,74 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes the write-ahead journal. Directory writes are
+	logged with their old and new contents to a sidecar file and only applied
+	to the device after a commit record has been synced. When the journal is
+	opened again, committed writes of an interrupted run are rolled forward and
+	uncommitted ones are discarded, they never reached the device.
+*/
+
+#ifndef __journal_h__
+#define __journal_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "deviceio.h"
+
+struct sJournal {
+/*
+	this structure describes an open journal file
+*/
+	FILE *fp;
+	char *path;
+	uint64_t volume;	// fingerprint of the file system the journal belongs to
+	uint64_t end;		// end of the last record
+	uint64_t *records;	// file positions of the logged data records
+	uint32_t count;
+	uint32_t capacity;
+};
+
+// recovery results of journal_recover
+#define JOURNAL_CLEAN 0
+#define JOURNAL_ROLLED_FORWARD 1
+#define JOURNAL_DISCARDED 2
+
+// opens or creates the journal file for the file system with fingerprint volume
+struct sJournal *journal_open(const char *path, uint64_t volume);
+
+// replays an interrupted journal on the device
+int32_t journal_recover(struct sJournal *journal, DEVICE *device);
+
+// logs old and new contents of size bytes at offset
+int32_t journal_log(struct sJournal *journal, int64_t offset, const void *old, const void *new, uint32_t size);
+
+// returns the number of logged but not yet committed writes
+uint32_t journal_pending(struct sJournal *journal);
+
+// makes logged writes durable in the journal and applies them to the device
+int32_t journal_commit(struct sJournal *journal, DEVICE *device);
+
+// empties the journal after the applied writes have been synced to the device
+int32_t journal_reset(struct sJournal *journal);
+
+// closes the journal file and removes it if nothing is left to recover
+void journal_close(struct sJournal *journal);
+
+#endif // __journal_h__
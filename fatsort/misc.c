@@ -25,6 +25,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include "options.h"
 #include "mallocv.h"
 
@@ -41,3 +42,32 @@ void infomsg(char *str, ...) {
 	}
 
 }
+
+uint64_t hashData(uint64_t hash, const void *data, size_t len) {
+/*
+	continues a 64 bit FNV-1a hash over len bytes of data
+*/
+	const unsigned char *p=(const unsigned char *) data;
+
+	while (len--) {
+		hash^=*p++;
+		hash*=0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+void formatBytes(char *str, size_t len, uint64_t bytes) {
+/*
+	formats a byte count with the largest binary unit that divides it
+*/
+	const char *units[]={"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+	uint32_t i=0;
+
+	while (bytes && !(bytes & 1023) && (i < 5)) {
+		bytes>>=10;
+		i++;
+	}
+
+	snprintf(str, len, "%" PRIu64 " %s", bytes, units[i]);
+}
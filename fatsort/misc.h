@@ -24,7 +24,19 @@
 #ifndef __misc_h__
 #define __misc_h__
 
+#include <stdint.h>
+#include <stddef.h>
+
+// initial value for hashData
+#define HASH_INIT 0xcbf29ce484222325ULL
+
 // info messages that can be muted with a command line option
 void infomsg(char *str, ...);
 
+// continues a 64 bit FNV-1a hash over len bytes of data
+uint64_t hashData(uint64_t hash, const void *data, size_t len);
+
+// formats a byte count with the largest binary unit that divides it, e.g. "4 KiB"
+void formatBytes(char *str, size_t len, uint64_t bytes);
+
 #endif // __misc_h__
@@ -24,6 +24,7 @@
 #include "options.h"
 
 #include <getopt.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
 #include "errors.h"
@@ -35,7 +36,9 @@
 uint32_t OPT_VERSION, OPT_HELP, OPT_INFO, OPT_QUIET, OPT_IGNORE_CASE,
 	OPT_ORDER, OPT_LIST, OPT_REVERSE, OPT_FORCE, OPT_NATURAL_SORT,
 	OPT_RECURSIVE, OPT_RANDOM, OPT_MORE_INFO, OPT_MODIFICATION,
-	OPT_ASCII, OPT_REGEX;
+	OPT_ASCII, OPT_REGEX, OPT_CACHE_SIZE, OPT_DIRECT,
+	OPT_SYNC_POLICY, OPT_SYNC_INTERVAL, OPT_RESUME, OPT_DRY_RUN, OPT_EMULATE, OPT_STATS,
+	OPT_PARTITION, OPT_ALL_PARTITIONS, OPT_FAT_CACHE_SIZE, OPT_FRAGMENTATION, OPT_CHECK;
 
 struct sStringList *OPT_INCL_DIRS = NULL;
 struct sStringList *OPT_EXCL_DIRS = NULL;
@@ -48,6 +51,15 @@ struct sRegExList *OPT_REGEX_EXCL = NULL;
 
 char *OPT_LOCALE;
 
+char *OPT_JOURNAL = NULL;
+char *OPT_CHECKPOINT = NULL;
+char *OPT_TRACE = NULL;
+char *OPT_REPLAY = NULL;
+
+int32_t OPT_BACKEND, OPT_WRITE_UNIT;
+
+struct sDeviceModel OPT_DEVICE_MODEL;
+
 int32_t addDirPathToStringList(struct sStringList *stringList, const char (*str)[MAX_PATH_LEN+1]) {
 /*
 	insert new string into string list
@@ -133,17 +145,93 @@ int32_t matchesDirPathLists(struct sStringList *includes,
 	return 0; // no match
 }
 
+static int32_t parseNumber(const char *str, uint32_t *value) {
+/*
+	parses a non-negative decimal number
+*/
+
+	assert(str != NULL);
+	assert(value != NULL);
+
+	char *end;
+	unsigned long n;
+
+	errno=0;
+	n=strtoul(str, &end, 10);
+	if ((*str < '0') || (*str > '9') || (*end != '\0') || errno || (n > UINT32_MAX)) {
+		return -1;
+	}
+
+	*value=(uint32_t) n;
+
+	return 0;
+}
+
+static int32_t parseDeviceModel(const char *str, struct sDeviceModel *model) {
+/*
+	parses a comma separated device model, optionally starting with a preset:
+	sd : cheap SD card with 1 ms latency, 10 MiB/s writes in 16 KiB pages
+	usb : USB 2.0 flash drive
+	the values latency=US, seek=US (per GiB), read=KIB/s, write=KIB/s and page=BYTES override it
+*/
+
+	assert(str != NULL);
+	assert(model != NULL);
+
+	char buf[256], *token, *value;
+	uint32_t *field;
+
+	if (strlen(str) >= sizeof(buf)) return -1;
+	strcpy(buf, str);
+
+	memset(model, 0, sizeof(struct sDeviceModel));
+
+	for (token=strtok(buf, ","); token != NULL; token=strtok(NULL, ",")) {
+		if (!strcmp(token, "sd")) {
+			model->latency=1000;
+			model->seek=2000;
+			model->readRate=20480;
+			model->writeRate=10240;
+			model->page=16384;
+			continue;
+		} else if (!strcmp(token, "usb")) {
+			model->latency=250;
+			model->seek=500;
+			model->readRate=30720;
+			model->writeRate=15360;
+			model->page=4096;
+			continue;
+		}
+
+		if ((value=strchr(token, '=')) == NULL) return -1;
+		*value++='\0';
+
+		if (!strcmp(token, "latency")) field=&model->latency;
+		else if (!strcmp(token, "seek")) field=&model->seek;
+		else if (!strcmp(token, "read")) field=&model->readRate;
+		else if (!strcmp(token, "write")) field=&model->writeRate;
+		else if (!strcmp(token, "page")) field=&model->page;
+		else return -1;
+
+		if (parseNumber(value, field)) return -1;
+	}
+
+	return 0;
+}
+
 int32_t parse_options(int argc, char *argv[]) {
 /*
 	parses command line options
 */
 
 	int8_t c,len;
+	uint32_t value;
 
 	static struct option longOpts[] = {
 		// name, has_arg, flag, val
 		{"help", 0, 0, 'h'},
 		{"version", 0, 0, 'v'},
+		{"resume", 0, 0, 'K'},
 		{0, 0, 0, 0}
 	};
 
@@ -178,6 +266,55 @@ int32_t parse_options(int argc, char *argv[]) {
 	// sort by using locale collation order
 	OPT_ASCII = 0;
 
+	// 4 MiB device cache by default
+	OPT_CACHE_SIZE = 4096;
+
+	// keep FATs of up to 64 MiB in memory
+	OPT_FAT_CACHE_SIZE = 65536;
+
+	// keep the backend chosen when opening the device
+	OPT_BACKEND = -1;
+
+	// stage writes in erase units if the device reports them
+	OPT_WRITE_UNIT = -1;
+
+	// use the page cache
+	OPT_DIRECT = 0;
+
+	// sync after every written directory
+	OPT_SYNC_POLICY = SYNC_POLICY_DIR;
+	OPT_SYNC_INTERVAL = 1;
+
+	// no write-ahead journal
+	OPT_JOURNAL = NULL;
+
+	// no checkpoints, start from the root directory
+	OPT_CHECKPOINT = NULL;
+	OPT_RESUME = 0;
+
+	// write to the device
+	OPT_DRY_RUN = 0;
+
+	// access the device at its own speed
+	OPT_EMULATE = 0;
+
+	// no i/o statistics
+	OPT_STATS = 0;
+
+	// neither record nor replay an i/o trace
+	OPT_TRACE = NULL;
+	OPT_REPLAY = NULL;
+
+	// the file system starts at the beginning of the device
+	OPT_PARTITION = 0;
+	OPT_ALL_PARTITIONS = 0;
+
+	// sort instead of reporting fragmentation
+	OPT_FRAGMENTATION = 0;
+
+	// don't check the directory tree before sorting
+	OPT_CHECK = 0;
+
 #ifdef __MINGW__
 #define WIN_LOCALE "C"
 	OPT_LOCALE = malloc(6);
@@ -237,15 +374,67 @@ OPT_LOCALE[0] = '\0';
 	}
 
 	opterr=0;
-	while ((c=getopt_long(argc, argv, "imvhqcfo:lrRnd:D:x:X:I:taL:e:E:", longOpts, NULL)) != -1) {
+	while ((c=getopt_long(argc, argv, "imvhqcfo:lrRnd:D:x:X:I:taL:e:E:b:B:OS:j:k:KwY:T:G:su:p:PF:gC", longOpts, NULL)) != -1) {
 		switch(c) {
 			case 'a' : OPT_ASCII = 1; break;
+			case 'b' :
+				if (parseNumber(optarg, &OPT_CACHE_SIZE)) {
+					myerror("Invalid cache size '%s' for option 'b'.", optarg);
+					freeOptions();
+					return -1;
+				}
+				break;
+			case 'F' :
+				if (parseNumber(optarg, &OPT_FAT_CACHE_SIZE)) {
+					myerror("Invalid FAT cache size '%s' for option 'F'.", optarg);
+					freeOptions();
+					return -1;
+				}
+				break;
+			case 'u' :
+				if (parseNumber(optarg, &value) || (value % 512) || (value > MAX_WRITE_UNIT)) {
+					myerror("Invalid write unit '%s' for option 'u'.", optarg);
+					freeOptions();
+					return -1;
+				}
+				OPT_WRITE_UNIT = (int32_t) value;
+				break;
+			case 'B' :
+				if (!strcmp(optarg, "sync")) {
+					OPT_BACKEND=DEVICE_BACKEND_SYNC;
+				} else if (!strcmp(optarg, "mmap")) {
+					OPT_BACKEND=DEVICE_BACKEND_MAP;
+				} else if (!strcmp(optarg, "uring")) {
+					OPT_BACKEND=DEVICE_BACKEND_URING;
+				} else {
+					myerror("Unknown backend '%s' for option 'B'.", optarg);
+					myerror("Use -h for more help.");
+					freeOptions();
+					return -1;
+				}
+				break;
 			case 'c' : OPT_IGNORE_CASE = 1; break;
 			case 'f' : OPT_FORCE = 1; break;
 			case 'h' : OPT_HELP = 1; break;
 			case 'i' : OPT_INFO = 1; break;
+			case 'j' : OPT_JOURNAL = optarg; break;
+			case 'k' : OPT_CHECKPOINT = optarg; break;
+			case 'K' : OPT_RESUME = 1; break;
+			case 'T' : OPT_TRACE = optarg; break;
+			case 'G' : OPT_REPLAY = optarg; break;
 			case 'm' : OPT_MORE_INFO = 1; break;
+			case 'p' :
+				if (parseNumber(optarg, &OPT_PARTITION) || !OPT_PARTITION) {
+					myerror("Invalid partition number '%s' for option 'p'.", optarg);
+					freeOptions();
+					return -1;
+				}
+				break;
+			case 'P' : OPT_ALL_PARTITIONS = 1; break;
+			case 's' : OPT_STATS = 1; break;
 			case 'l' : OPT_LIST = 1; break;
+			case 'g' : OPT_FRAGMENTATION = 1; break;
+			case 'C' : OPT_CHECK = 1; break;
 			case 'o' :
 				switch(optarg[0]) {
 					case 'd': OPT_ORDER=0; break;
@@ -310,11 +499,40 @@ OPT_LOCALE[0] = '\0';
 				}
 				break;
 			case 'n' : OPT_NATURAL_SORT = 1; break;
+			case 'O' : OPT_DIRECT = 1; break;
 			case 'q' : OPT_QUIET = 1; break;
 			case 'r' : OPT_REVERSE = -1; break;
 			case 'R' : OPT_RANDOM = 1; break;
+			case 'S' :
+				if (!strcmp(optarg, "dir")) {
+					OPT_SYNC_POLICY=SYNC_POLICY_DIR;
+				} else if (!strncmp(optarg, "dirs:", 5) && !parseNumber(optarg+5, &OPT_SYNC_INTERVAL) && OPT_SYNC_INTERVAL) {
+					OPT_SYNC_POLICY=SYNC_POLICY_DIRS;
+				} else if (!strncmp(optarg, "kib:", 4) && !parseNumber(optarg+4, &OPT_SYNC_INTERVAL) && OPT_SYNC_INTERVAL) {
+					OPT_SYNC_POLICY=SYNC_POLICY_KIB;
+				} else if (!strcmp(optarg, "range")) {
+					OPT_SYNC_POLICY=SYNC_POLICY_RANGE;
+				} else if (!strcmp(optarg, "end")) {
+					OPT_SYNC_POLICY=SYNC_POLICY_END;
+				} else {
+					myerror("Unknown sync policy '%s' for option 'S'.", optarg);
+					myerror("Use -h for more help.");
+					freeOptions();
+					return -1;
+				}
+				break;
 			case 't' : OPT_MODIFICATION = 1; break;
 			case 'v' : OPT_VERSION = 1; break;
+			case 'w' : OPT_DRY_RUN = 1; break;
+			case 'Y' :
+				if (parseDeviceModel(optarg, &OPT_DEVICE_MODEL)) {
+					myerror("Invalid device model '%s' for option 'Y'.", optarg);
+					myerror("Use -h for more help.");
+					freeOptions();
+					return -1;
+				}
+				OPT_EMULATE = 1;
+				break;
 			case 'L' :
 				len=strlen(optarg);
 				OPT_LOCALE=realloc(OPT_LOCALE, len+1);
@@ -332,6 +550,57 @@ OPT_LOCALE[0] = '\0';
 		}
 	}
 
+	// the fragmentation report reads the file system like listing it does
+	if (OPT_FRAGMENTATION) OPT_LIST = 1;
+
+	if (OPT_RESUME && (OPT_CHECKPOINT == NULL)) {
+		myerror("Option -K requires a checkpoint file (option -k)!");
+		freeOptions();
+		return -1;
+	}
+
+	// the checkpoint counts directories in traversal order, which a random order changes
+	if (OPT_RESUME && OPT_RANDOM) {
+		myerror("Option -K may not be used with option -R!");
+		freeOptions();
+		return -1;
+	}
+
+	// a dry run must not replay or remove the journal or checkpoint of a real run
+	if (OPT_DRY_RUN && ((OPT_JOURNAL != NULL) || (OPT_CHECKPOINT != NULL))) {
+		myerror("Option -w may not be used with options -j and -k!");
+		freeOptions();
+		return -1;
+	}
+
+	// a RAM device is not written back, recovery would only remove the journal or checkpoint of the image
+	if ((optind < argc) && !strncmp(argv[optind], DEVICE_RAM_PREFIX, strlen(DEVICE_RAM_PREFIX)) &&
+			((OPT_JOURNAL != NULL) || (OPT_CHECKPOINT != NULL))) {
+		myerror("Options -j and -k may not be used with a RAM device!");
+		freeOptions();
+		return -1;
+	}
+
+	if ((OPT_TRACE != NULL) && (OPT_REPLAY != NULL)) {
+		myerror("Option -T may not be used with option -G!");
+		freeOptions();
+		return -1;
+	}
+
+	if (OPT_ALL_PARTITIONS && OPT_PARTITION) {
+		myerror("Option -P may not be used with option -p!");
+		freeOptions();
+		return -1;
+	}
+
+	// journal, checkpoint and trace files belong to a single file system
+	if (OPT_ALL_PARTITIONS && ((OPT_JOURNAL != NULL) || (OPT_CHECKPOINT != NULL) ||
+			(OPT_TRACE != NULL) || (OPT_REPLAY != NULL))) {
+		myerror("Option -P may not be used with options -j, -k, -T and -G!");
+		freeOptions();
+		return -1;
+	}
+
 	// regex or not regex
 	if ((OPT_EXCL_DIRS->next || OPT_EXCL_DIRS_REC->next || OPT_INCL_DIRS->next || OPT_INCL_DIRS_REC->next) && (OPT_REGEX)) {
 		myerror(" -d, -D, -x and -X may not be used simultaneously with options -e and -E!");
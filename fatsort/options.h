@@ -28,14 +28,30 @@
 #include "stringlist.h"
 #include "regexlist.h"
 
+// sync policies for written directories
+#define SYNC_POLICY_DIR 0	// sync after each directory
+#define SYNC_POLICY_DIRS 1	// sync after every OPT_SYNC_INTERVAL directories
+#define SYNC_POLICY_KIB 2	// sync after OPT_SYNC_INTERVAL KiB were written
+#define SYNC_POLICY_RANGE 3	// sync the written range of each directory only
+#define SYNC_POLICY_END 4	// sync once after sorting
+
+// largest write unit that can be given with option -u
+#define MAX_WRITE_UNIT (256*1024*1024)
+
 extern uint32_t OPT_VERSION, OPT_HELP, OPT_INFO, OPT_QUIET, OPT_IGNORE_CASE,
 		OPT_ORDER, OPT_LIST, OPT_REVERSE, OPT_FORCE, OPT_NATURAL_SORT,
 		OPT_RECURSIVE, OPT_RANDOM, OPT_MORE_INFO, OPT_MODIFICATION,
-		OPT_ASCII, OPT_REGEX;
+		OPT_ASCII, OPT_REGEX, OPT_CACHE_SIZE, OPT_DIRECT,
+		OPT_SYNC_POLICY, OPT_SYNC_INTERVAL, OPT_RESUME, OPT_DRY_RUN, OPT_EMULATE, OPT_STATS,
+		OPT_PARTITION, OPT_ALL_PARTITIONS, OPT_FAT_CACHE_SIZE, OPT_FRAGMENTATION, OPT_CHECK;
 extern struct sStringList *OPT_INCL_DIRS, *OPT_EXCL_DIRS, *OPT_INCL_DIRS_REC, *OPT_EXCL_DIRS_REC, *OPT_IGNORE_PREFIXES_LIST;
 extern struct sRegExList *OPT_REGEX_INCL, *OPT_REGEX_EXCL;
 
-extern char *OPT_LOCALE;
+extern char *OPT_LOCALE, *OPT_JOURNAL, *OPT_CHECKPOINT, *OPT_TRACE, *OPT_REPLAY;
+
+extern int32_t OPT_BACKEND, OPT_WRITE_UNIT;
+
+extern struct sDeviceModel OPT_DEVICE_MODEL;
 
 // parses command line options
 int32_t parse_options(int argc, char *argv[]);
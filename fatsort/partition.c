@@ -0,0 +1,378 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes functions that read MBR and GPT partition tables,
+	so that the file systems of whole disk images can be opened as device views.
+*/
+
+#include "partition.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <assert.h>
+#include "FAT_fs.h"
+#include "endianness.h"
+#include "errors.h"
+#include "mallocv.h"
+
+// MBR partition types
+#define MBR_TYPE_EMPTY 0x00
+#define MBR_TYPE_EXTENDED_CHS 0x05
+#define MBR_TYPE_EXTENDED_LBA 0x0f
+#define MBR_TYPE_EXTENDED_LINUX 0x85
+#define MBR_TYPE_GPT_PROTECTIVE 0xee
+
+#define MBR_SIGNATURE 0xaa55
+#define GPT_SIGNATURE "EFI PART"
+
+// number of extended boot records that are followed before the chain is considered to loop
+#define MAX_EXTENDED_PARTITIONS (MAX_PARTITIONS - 4)
+
+// sector sizes a GPT is looked for with, besides the logical sector size of the device
+static const uint32_t GPTSectorSizes[] = {512, 4096};
+
+struct sMBRPartitionEntry {
+	uint8_t status;		// 0x80 bootable, 0x00 inactive
+	uint8_t firstCHS[3];
+	uint8_t type;
+	uint8_t lastCHS[3];
+	uint32_t firstLBA;
+	uint32_t sectors;
+} ATTR_PACKED;
+
+struct sMBR {
+	uint8_t bootCode[446];
+	struct sMBRPartitionEntry entries[4];
+	uint16_t signature;
+} ATTR_PACKED;
+
+struct sGPTHeader {
+	char signature[8];
+	uint32_t revision;
+	uint32_t headerSize;
+	uint32_t headerCRC32;
+	uint32_t reserved;
+	uint64_t currentLBA;
+	uint64_t backupLBA;
+	uint64_t firstUsableLBA;
+	uint64_t lastUsableLBA;
+	uint8_t diskGUID[16];
+	uint64_t entriesLBA;
+	uint32_t entryCount;
+	uint32_t entrySize;
+	uint32_t entriesCRC32;
+} ATTR_PACKED;
+
+struct sGPTPartitionEntry {
+	uint8_t typeGUID[16];
+	uint8_t partitionGUID[16];
+	uint64_t firstLBA;
+	uint64_t lastLBA;
+	uint64_t attributes;
+	uint16_t name[36];
+} ATTR_PACKED;
+
+static uint32_t crc32(const uint8_t *data, uint64_t size, uint32_t crc) {
+/*
+	calculates the CRC-32 that is used by GPT headers and partition entry arrays
+*/
+	uint64_t i;
+	uint32_t bit;
+
+	crc=~crc;
+	for (i=0; i<size; i++) {
+		crc^=data[i];
+		for (bit=0; bit<8; bit++) {
+			crc=(crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+static int32_t isBootSector(const uint8_t *sector) {
+/*
+	checks whether a sector is the boot sector of a FAT or exFAT file system
+*/
+	const struct sBootSector *bs=(const struct sBootSector *) sector;
+	uint16_t bytesPerSector;
+	uint8_t sectorsPerCluster;
+
+	if (SwapInt16(bs->BS_EndOfBS) != MBR_SIGNATURE) return 0;
+
+	if (!memcmp(bs->BS_OEMName, "EXFAT   ", 8)) return 1;
+
+	// an MBR may start with a jump instruction too, so the BIOS parameter block must be sane
+	if ((sector[0] != 0xeb) && (sector[0] != 0xe9)) return 0;
+	bytesPerSector=SwapInt16(bs->xxFATxx.FAT12_16_32.BS_BytesPerSec);
+	sectorsPerCluster=bs->xxFATxx.FAT12_16_32.BS_SecPerClus;
+	if ((bytesPerSector < 512) || (bytesPerSector > 4096) || (bytesPerSector & (bytesPerSector-1))) return 0;
+	if (!sectorsPerCluster || (sectorsPerCluster & (sectorsPerCluster-1))) return 0;
+	if (!SwapInt16(bs->xxFATxx.FAT12_16_32.BS_RsvdSecCnt) || !bs->xxFATxx.FAT12_16_32.BS_NumFATs) return 0;
+
+	return 1;
+}
+
+static int32_t addPartition(struct sPartitionTable *table, uint32_t number, uint8_t type, uint64_t firstSector, uint64_t sectors) {
+/*
+	appends a partition to the table
+*/
+	assert(table != NULL);
+
+	struct sPartition *p;
+
+	if (table->count >= MAX_PARTITIONS) {
+		myerror("Too many partitions, only the first %u are used!", MAX_PARTITIONS);
+		return -1;
+	}
+
+	p=&table->partitions[table->count++];
+	p->number=number;
+	p->type=type;
+	p->offset=(int64_t) (firstSector * table->sectorSize);
+	p->size=sectors * table->sectorSize;
+
+	return 0;
+}
+
+static int32_t readExtendedPartitions(DEVICE *device, struct sPartitionTable *table, uint64_t extendedStart) {
+/*
+	follows the chain of extended boot records and adds all logical partitions
+*/
+	assert(device != NULL);
+	assert(table != NULL);
+
+	struct sMBR ebr;
+	uint64_t ebrSector=extendedStart;
+	uint32_t i, number=5;
+
+	for (i=0; i<MAX_EXTENDED_PARTITIONS; i++) {
+		if (device_pread(device, &ebr, sizeof(ebr), (int64_t) (ebrSector * table->sectorSize)) != sizeof(ebr)) {
+			myerror("Failed to read extended boot record at sector %" PRIu64 "!", ebrSector);
+			return -1;
+		}
+		if (SwapInt16(ebr.signature) != MBR_SIGNATURE) {
+			myerror("Extended boot record at sector %" PRIu64 " is invalid!", ebrSector);
+			return -1;
+		}
+
+		// the first entry is the logical partition relative to this EBR
+		if ((ebr.entries[0].type != MBR_TYPE_EMPTY) && SwapInt32(ebr.entries[0].sectors)) {
+			if (addPartition(table, number++, ebr.entries[0].type,
+					ebrSector + SwapInt32(ebr.entries[0].firstLBA), SwapInt32(ebr.entries[0].sectors))) return 0;
+		}
+
+		// the second entry points to the next EBR relative to the extended partition
+		if ((ebr.entries[1].type == MBR_TYPE_EMPTY) || !SwapInt32(ebr.entries[1].firstLBA)) return 0;
+		ebrSector=extendedStart + SwapInt32(ebr.entries[1].firstLBA);
+	}
+
+	myerror("Chain of extended boot records is too long!");
+	return -1;
+}
+
+static int32_t readGPT(DEVICE *device, struct sPartitionTable *table) {
+/*
+	reads the GUID partition table, returns 1 if there is none with the sector size of table
+*/
+	assert(device != NULL);
+	assert(table != NULL);
+
+	struct sGPTHeader header;
+	struct sGPTPartitionEntry *entry;
+	uint8_t *sector, *entries;
+	static const uint8_t unused[16]={0};
+	uint32_t i, crc, headerSize, entrySize, entryCount;
+	uint64_t size;
+
+	if ((sector=malloc(table->sectorSize)) == NULL) {
+		stderror();
+		return -1;
+	}
+
+	// the header lives in LBA 1
+	if (device_pread(device, sector, table->sectorSize, (int64_t) table->sectorSize) != (int64_t) table->sectorSize) {
+		free(sector);
+		return 1;
+	}
+	memcpy(&header, sector, sizeof(header));
+	if (memcmp(header.signature, GPT_SIGNATURE, 8)) {
+		free(sector);
+		return 1;
+	}
+
+	headerSize=SwapInt32(header.headerSize);
+	if ((headerSize < sizeof(header)) || (headerSize > table->sectorSize)) {
+		myerror("GPT header size %u is invalid!", headerSize);
+		free(sector);
+		return -1;
+	}
+
+	// the checksum is calculated with its own field set to zero
+	crc=SwapInt32(header.headerCRC32);
+	memset(sector+offsetof(struct sGPTHeader, headerCRC32), 0, 4);
+	if (crc32(sector, headerSize, 0) != crc) {
+		myerror("GPT header checksum is invalid!");
+		free(sector);
+		return -1;
+	}
+	free(sector);
+
+	entrySize=SwapInt32(header.entrySize);
+	entryCount=SwapInt32(header.entryCount);
+	if ((entrySize < sizeof(struct sGPTPartitionEntry)) || (entrySize % 8) || (entryCount > 65536)) {
+		myerror("GPT partition entry array is invalid!");
+		return -1;
+	}
+
+	size=(uint64_t) entrySize * entryCount;
+	if ((entries=malloc(size+1)) == NULL) {
+		stderror();
+		return -1;
+	}
+	if (device_pread(device, entries, size, (int64_t) (SwapInt64(header.entriesLBA) * table->sectorSize)) != (int64_t) size) {
+		myerror("Failed to read GPT partition entries!");
+		free(entries);
+		return -1;
+	}
+	if (crc32(entries, size, 0) != SwapInt32(header.entriesCRC32)) {
+		myerror("GPT partition entry array checksum is invalid!");
+		free(entries);
+		return -1;
+	}
+
+	table->scheme=PARTITION_SCHEME_GPT;
+	for (i=0; i<entryCount; i++) {
+		entry=(struct sGPTPartitionEntry *) (entries + (uint64_t) i * entrySize);
+		if (!memcmp(entry->typeGUID, unused, 16)) continue;
+		if (SwapInt64(entry->lastLBA) < SwapInt64(entry->firstLBA)) continue;
+		// partitions are numbered by their index in the entry array
+		if (addPartition(table, i+1, 0, SwapInt64(entry->firstLBA),
+				SwapInt64(entry->lastLBA) - SwapInt64(entry->firstLBA) + 1)) break;
+	}
+
+	free(entries);
+
+	return 0;
+}
+
+int32_t readPartitionTable(DEVICE *device, struct sPartitionTable *table) {
+/*
+	reads the MBR or GPT partition table of device
+*/
+	assert(device != NULL);
+	assert(table != NULL);
+
+	struct sMBR mbr;
+	struct sMBRPartitionEntry *entry;
+	uint32_t sectorSize, i, j, extended=0;
+	int32_t ret;
+
+	table->scheme=PARTITION_SCHEME_NONE;
+	table->count=0;
+
+	sectorSize=device_getsectorsize(device);
+	table->sectorSize=sectorSize;
+
+	if (device_pread(device, &mbr, sizeof(mbr), 0) != sizeof(mbr)) {
+		myerror("Failed to read master boot record!");
+		return -1;
+	}
+
+	// a file system without partition table starts with its boot sector
+	if ((SwapInt16(mbr.signature) != MBR_SIGNATURE) || isBootSector((const uint8_t *) &mbr)) return 0;
+
+	for (i=0; i<4; i++) {
+		if ((mbr.entries[i].status != 0x00) && (mbr.entries[i].status != 0x80)) return 0;
+		if (mbr.entries[i].type == MBR_TYPE_GPT_PROTECTIVE) {
+			// look for the GPT with the sector size of the device first, image files do not know theirs
+			if ((ret=readGPT(device, table)) != 1) return ret;
+			for (j=0; j<sizeof(GPTSectorSizes)/sizeof(GPTSectorSizes[0]); j++) {
+				if (GPTSectorSizes[j] == sectorSize) continue;
+				table->sectorSize=GPTSectorSizes[j];
+				if ((ret=readGPT(device, table)) != 1) return ret;
+			}
+			myerror("Protective MBR found, but no GUID partition table!");
+			return -1;
+		}
+	}
+
+	table->scheme=PARTITION_SCHEME_MBR;
+	for (i=0; i<4; i++) {
+		entry=&mbr.entries[i];
+		if ((entry->type == MBR_TYPE_EMPTY) || !SwapInt32(entry->sectors)) continue;
+		switch(entry->type) {
+		case MBR_TYPE_EXTENDED_CHS:
+		case MBR_TYPE_EXTENDED_LBA:
+		case MBR_TYPE_EXTENDED_LINUX:
+			if (!extended++ && readExtendedPartitions(device, table, SwapInt32(entry->firstLBA))) return -1;
+			break;
+		default:
+			if (addPartition(table, i+1, entry->type, SwapInt32(entry->firstLBA), SwapInt32(entry->sectors))) return 0;
+		}
+	}
+
+	return 0;
+}
+
+struct sPartition *getPartition(struct sPartitionTable *table, uint32_t number) {
+/*
+	finds partition number in table, returns NULL if it does not exist
+*/
+	assert(table != NULL);
+
+	uint32_t i;
+
+	for (i=0; i<table->count; i++) {
+		if (table->partitions[i].number == number) return &table->partitions[i];
+	}
+
+	return NULL;
+}
+
+int32_t isFATPartition(DEVICE *device, const struct sPartition *partition) {
+/*
+	checks whether partition holds a FAT or exFAT boot sector
+*/
+	assert(device != NULL);
+	assert(partition != NULL);
+
+	uint8_t sector[512];
+
+	if (partition->size < sizeof(sector)) return 0;
+
+	if (device_pread(device, sector, sizeof(sector), partition->offset) != sizeof(sector)) return 0;
+
+	return isBootSector(sector);
+}
+
+const char *getPartitionSchemeName(uint32_t scheme) {
+/*
+	gets the name of a partition table scheme
+*/
+	switch(scheme) {
+	case PARTITION_SCHEME_MBR: return "MBR";
+	case PARTITION_SCHEME_GPT: return "GPT";
+	default: return "none";
+	}
+}
@@ -0,0 +1,71 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes functions that read MBR and GPT partition tables,
+	so that the file systems of whole disk images can be opened as device views.
+*/
+
+#ifndef __partition_h__
+#define __partition_h__
+
+#include <stdint.h>
+#include "deviceio.h"
+
+// partition table schemes
+#define PARTITION_SCHEME_NONE 0	// the device holds a single file system
+#define PARTITION_SCHEME_MBR 1	// primary and logical partitions of a master boot record
+#define PARTITION_SCHEME_GPT 2	// GUID partition table
+
+// maximum number of partitions that are read from a partition table
+#define MAX_PARTITIONS 128
+
+struct sPartition {
+/*
+	a partition of a device
+*/
+	uint32_t number;	// as counted by the operating system, logical MBR partitions start at 5
+	uint8_t type;		// MBR partition type, 0 for GPT
+	int64_t offset;		// in bytes
+	uint64_t size;		// in bytes
+};
+
+struct sPartitionTable {
+/*
+	this structure contains all partitions of a device
+*/
+	uint32_t scheme;
+	uint32_t sectorSize;	// size of the sectors the table is addressed in
+	uint32_t count;
+	struct sPartition partitions[MAX_PARTITIONS];
+};
+
+// reads the MBR or GPT partition table of device
+int32_t readPartitionTable(DEVICE *device, struct sPartitionTable *table);
+
+// finds partition number in table, returns NULL if it does not exist
+struct sPartition *getPartition(struct sPartitionTable *table, uint32_t number);
+
+// checks whether partition holds a FAT or exFAT boot sector
+int32_t isFATPartition(DEVICE *device, const struct sPartition *partition);
+
+// gets the name of a partition table scheme
+const char *getPartitionSchemeName(uint32_t scheme);
+
+#endif // __partition_h__
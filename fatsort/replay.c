@@ -0,0 +1,311 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes the replay of i/o traces. A trace that has
+	been recorded with option -T is run against a device with the configured
+	backend, cache and device model, and the time is reported per phase.
+*/
+
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <assert.h>
+#include "deviceio.h"
+#include "FAT_fs.h"
+#include "sort.h"
+#include "options.h"
+#include "errors.h"
+#include "mallocv.h"
+
+static int64_t replay_write(DEVICE *device, struct sDeviceTraceRecord *rec, int64_t position, char *buffer, uint64_t *elapsed) {
+/*
+	replays a write, the trace holds no data, so the current contents of the
+	range are read untimed and written back
+*/
+	assert(device != NULL);
+	assert(rec != NULL);
+	assert(buffer != NULL);
+	assert(elapsed != NULL);
+
+	struct timespec start, end;
+	int64_t offset=(rec->op == DEVICE_TRACE_WRITE) ? position : rec->offset;
+	int64_t ret;
+
+	if ((ret=device_pread(device, buffer, rec->size, offset)) == -1) return -1;
+	// nothing to put back behind the end of the device
+	if (ret == 0) return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (rec->op == DEVICE_TRACE_WRITE) {
+		ret=device_write(device, buffer, (uint64_t) ret, 1);
+	} else {
+		ret=device_pwrite(device, buffer, (uint64_t) ret, offset);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*elapsed=(uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 + (uint64_t) end.tv_nsec - (uint64_t) start.tv_nsec;
+
+	return ret;
+}
+
+static struct sReplayPhase *replay_newphase(struct sReplayPhase **phases, uint32_t *count, uint32_t *capacity, const char *name) {
+/*
+	appends a phase to the list
+*/
+	assert(phases != NULL);
+	assert(count != NULL);
+	assert(capacity != NULL);
+	assert(name != NULL);
+
+	struct sReplayPhase *p;
+
+	if (*count == *capacity) {
+		*capacity=*capacity ? *capacity * 2 : 8;
+		if ((p=realloc(*phases, sizeof(struct sReplayPhase) * *capacity)) == NULL) {
+			stderror();
+			return NULL;
+		}
+		*phases=p;
+	}
+
+	p=&(*phases)[(*count)++];
+	memset(p, 0, sizeof(struct sReplayPhase));
+	strncpy(p->name, name, REPLAY_PHASE_NAME_LEN);
+
+	return p;
+}
+
+static int32_t replay_run(FILE *fp, DEVICE *device, struct sReplayPhase **phases, uint32_t *count) {
+/*
+	replays all records of the trace
+*/
+	assert(fp != NULL);
+	assert(device != NULL);
+	assert(phases != NULL);
+	assert(count != NULL);
+
+	struct sDeviceTraceRecord rec;
+	struct sReplayPhase *phase;
+	struct sDeviceRange *ranges=NULL, *r, range;
+	struct timespec start, end;
+	char *buffer=NULL, *b;
+	char name[REPLAY_PHASE_NAME_LEN+1];
+	uint64_t bufferSize=0, phaseStart=0, last=0, elapsed, n;
+	uint32_t capacity=0, nranges=0, rangeCapacity=0;
+	int64_t position=0, ret=0;
+	int32_t result=0;
+
+	// requests before the first phase marker were made while the device was set up
+	if ((phase=replay_newphase(phases, count, &capacity, "setup")) == NULL) return -1;
+
+	for (;;) {
+		n=fread(&rec, sizeof(struct sDeviceTraceRecord), 1, fp);
+
+		// consecutive prefetch ranges are replayed as one batch
+		if (nranges && ((n != 1) || (rec.op != DEVICE_TRACE_PREFETCH))) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ret=device_prefetch(device, ranges, nranges);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			phase->replayed+=(uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 + (uint64_t) end.tv_nsec - (uint64_t) start.tv_nsec;
+			phase->requests++;
+			nranges=0;
+			if (ret == -1) {
+				myerror("Failed to replay prefetch!");
+				result=-1;
+				break;
+			}
+		}
+
+		if (n != 1) break;
+
+		last=rec.time;
+
+		if (rec.op == DEVICE_TRACE_PHASE) {
+			memset(name, 0, sizeof(name));
+			n=(rec.size < REPLAY_PHASE_NAME_LEN) ? rec.size : REPLAY_PHASE_NAME_LEN;
+			if (n && (fread(name, (size_t) n, 1, fp) != 1)) break;
+			if ((rec.size > REPLAY_PHASE_NAME_LEN) && fseek(fp, (long) (rec.size - REPLAY_PHASE_NAME_LEN), SEEK_CUR)) break;
+			phase->traced=rec.time - phaseStart;
+			phaseStart=rec.time;
+			if ((phase=replay_newphase(phases, count, &capacity, name)) == NULL) {
+				result=-1;
+				break;
+			}
+			continue;
+		}
+
+		if (rec.op == DEVICE_TRACE_PREFETCH) {
+			if (nranges == rangeCapacity) {
+				rangeCapacity=rangeCapacity ? rangeCapacity * 2 : 64;
+				if ((r=realloc(ranges, sizeof(struct sDeviceRange) * rangeCapacity)) == NULL) {
+					stderror();
+					result=-1;
+					break;
+				}
+				ranges=r;
+			}
+			ranges[nranges].offset=rec.offset;
+			ranges[nranges].size=rec.size;
+			nranges++;
+			continue;
+		}
+
+		if ((rec.op != DEVICE_TRACE_SYNCRANGE) && (rec.op != DEVICE_TRACE_ADVISE) && (rec.size > bufferSize)) {
+			if ((b=realloc(buffer, (size_t) rec.size)) == NULL) {
+				stderror();
+				result=-1;
+				break;
+			}
+			buffer=b;
+			bufferSize=rec.size;
+		}
+
+		elapsed=0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		switch (rec.op) {
+		case DEVICE_TRACE_SEEK:
+			ret=device_seekset(device, rec.offset);
+			position=rec.offset;
+			break;
+		case DEVICE_TRACE_READ:
+			if ((ret=device_read(device, buffer, rec.size, 1)) > 0) position+=ret;
+			phase->bytesRead+=rec.size;
+			break;
+		case DEVICE_TRACE_PREAD:
+			ret=device_pread(device, buffer, rec.size, rec.offset);
+			phase->bytesRead+=rec.size;
+			break;
+		case DEVICE_TRACE_WRITE:
+		case DEVICE_TRACE_PWRITE:
+			if (((ret=replay_write(device, &rec, position, buffer, &elapsed)) > 0) && (rec.op == DEVICE_TRACE_WRITE)) position+=ret;
+			phase->bytesWritten+=rec.size;
+			break;
+		case DEVICE_TRACE_SYNC:
+			ret=device_sync(device);
+			break;
+		case DEVICE_TRACE_SYNCRANGE:
+			ret=device_syncrange(device, rec.offset, rec.size);
+			break;
+		case DEVICE_TRACE_ADVISE:
+			range.offset=rec.offset;
+			range.size=rec.size;
+			ret=device_advise(device, &range, 1);
+			break;
+		default:
+			myerror("Unknown trace record type %" PRIu32 "!", rec.op);
+			ret=-1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (ret == -1) {
+			myerror("Failed to replay trace record!");
+			result=-1;
+			break;
+		}
+
+		// writes are timed without reading back their contents
+		if ((rec.op != DEVICE_TRACE_WRITE) && (rec.op != DEVICE_TRACE_PWRITE)) {
+			elapsed=(uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 + (uint64_t) end.tv_nsec - (uint64_t) start.tv_nsec;
+		}
+		phase->replayed+=elapsed;
+		phase->requests++;
+	}
+
+	if (!result && ferror(fp)) {
+		myerror("Failed to read trace file!");
+		result=-1;
+	}
+
+	if (phase != NULL) phase->traced=last - phaseStart;
+
+	free(buffer);
+	free(ranges);
+
+	return result;
+}
+
+int32_t replayTrace(const char *path, char *filename) {
+/*
+	replays the trace in file path on the file system in filename and prints the time per phase
+*/
+	assert(path != NULL);
+	assert(filename != NULL);
+
+	struct sFileSystem fs;
+	struct sReplayPhase *phases=NULL;
+	uint32_t count=0, i;
+	uint64_t requests=0, traced=0, replayed=0;
+	char magic[8];
+	FILE *fp;
+	int32_t ret;
+
+	if ((fp=fopen(path, "rb")) == NULL) {
+		stderror();
+		myerror("Failed to open trace file '%s'!", path);
+		return -1;
+	}
+
+	if ((fread(magic, 8, 1, fp) != 1) || memcmp(magic, DEVICE_TRACE_MAGIC, 8)) {
+		myerror("'%s' is not a trace file!", path);
+		fclose(fp);
+		return -1;
+	}
+
+	if (openFileSystem(filename, OPT_PARTITION, OPT_FORCE ? FS_MODE_RW : FS_MODE_RW_EXCL, &fs)) {
+		myerror("Failed to open file system!");
+		fclose(fp);
+		return -1;
+	}
+
+	if (setupDevice(&fs)) {
+		myerror("Failed to set up device!");
+		closeFileSystem(&fs);
+		fclose(fp);
+		return -1;
+	}
+
+	ret=replay_run(fp, fs.device, &phases, &count);
+
+	fclose(fp);
+
+	if (!ret && OPT_STATS) printDeviceStats(&fs);
+
+	if (closeFileSystem(&fs)) ret=-1;
+
+	if (!ret) {
+		printf("%-20s %10s %15s %15s %12s %12s\n", "Phase", "Requests", "Read (bytes)", "Written (bytes)", "Traced (s)", "Replayed (s)");
+		for (i=0; i<count; i++) {
+			printf("%-20s %10" PRIu64 " %15" PRIu64 " %15" PRIu64 " %12.3f %12.3f\n", phases[i].name, phases[i].requests,
+				phases[i].bytesRead, phases[i].bytesWritten, phases[i].traced / 1e9, phases[i].replayed / 1e9);
+			requests+=phases[i].requests;
+			traced+=phases[i].traced;
+			replayed+=phases[i].replayed;
+		}
+		printf("%-20s %10" PRIu64 " %15s %15s %12.3f %12.3f\n", "Total", requests, "", "", traced / 1e9, replayed / 1e9);
+	}
+
+	free(phases);
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+	FATSort, utility for sorting FAT directory structures
+	Copyright (C) 2018 Boris Leidner <fatsort(at)formenos.de>
+
+	This program is free software; you can redistribute it and/or
+	modify it under the terms of the GNU General Public License
+	as published by the Free Software Foundation; either version 2
+	of the License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	This file contains/describes the replay of i/o traces. A trace that has
+	been recorded with option -T is run against a device with the configured
+	backend, cache and device model, and the time is reported per phase.
+*/
+
+#ifndef __replay_h__
+#define __replay_h__
+
+#include <stdint.h>
+
+// maximum length of phase names, longer names are truncated
+#define REPLAY_PHASE_NAME_LEN 31
+
+struct sReplayPhase {
+/*
+	requests and times of one phase of the trace
+*/
+	char name[REPLAY_PHASE_NAME_LEN+1];
+	uint64_t requests;
+	uint64_t bytesRead, bytesWritten;
+	uint64_t traced;	// nanoseconds the phase took when it was recorded
+	uint64_t replayed;	// nanoseconds the requests took in the replay
+};
+
+// replays the trace in file path on the file system in filename and prints the time per phase
+int32_t replayTrace(const char *path, char *filename);
+
+#endif // __replay_h__
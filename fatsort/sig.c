@@ -25,12 +25,16 @@
 
 #include <stdlib.h>
 #include <signal.h>
+#include <pthread.h>
 #include "mallocv.h"
 
 #ifndef __WIN32__
 
 sigset_t blocked_signals_set;
 
+// signals stay blocked after critical sections while this is set
+static int held_signals=0;
+
 void init_signal_handling(void) {
 /*
 	initialize signal handling for critical sections
@@ -42,14 +46,31 @@ void start_critical_section(void) {
 /*
 	blocks signals for critical section
 */
-	sigprocmask(SIG_BLOCK, &blocked_signals_set, NULL);
+	pthread_sigmask(SIG_BLOCK, &blocked_signals_set, NULL);
 }
 
 void end_critical_section(void) {
 /*
 	unblocks signals after critical section
 */
-	sigprocmask(SIG_UNBLOCK, &blocked_signals_set, NULL);
+	if (!held_signals) pthread_sigmask(SIG_UNBLOCK, &blocked_signals_set, NULL);
+}
+
+void hold_signals(void) {
+/*
+	blocks signals of the calling thread until release_signals is called,
+	threads that are created meanwhile inherit the blocked signals
+*/
+	pthread_sigmask(SIG_BLOCK, &blocked_signals_set, NULL);
+	held_signals=1;
+}
+
+void release_signals(void) {
+/*
+	unblocks signals that were held, pending ones are delivered now
+*/
+	held_signals=0;
+	pthread_sigmask(SIG_UNBLOCK, &blocked_signals_set, NULL);
 }
 
 #endif
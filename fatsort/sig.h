@@ -35,11 +35,20 @@ void start_critical_section(void);
 // unblocks signals after critical section
 void end_critical_section(void);
 
+// blocks signals in all threads created until release_signals is called, as one
+// thread could otherwise be terminated by a signal while another one writes
+void hold_signals(void);
+
+// unblocks signals that were held
+void release_signals(void);
+
 
 #else
 #define init_signal_handling()
 #define start_critical_section()
 #define end_critical_section()
+#define hold_signals()
+#define release_signals()
 #endif
 
 #endif // __sig_h__
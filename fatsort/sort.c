@@ -28,9 +28,11 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <locale.h>
 #include <sys/param.h>
+#include <pthread.h>
 #include "entrylist.h"
 #include "errors.h"
 #include "options.h"
@@ -39,9 +41,24 @@
 #include "sig.h"
 #include "misc.h"
 #include "deviceio.h"
+#include "journal.h"
+#include "checkpoint.h"
+#include "consistency.h"
+#include "partition.h"
 #include "stringlist.h"
 #include "mallocv.h"
 
+struct sPartitionJob {
+/*
+	the file system of a partition that is sorted in its own thread
+*/
+	struct sFileSystem fs;
+	uint32_t number;
+	int32_t result;
+	int32_t started;	// the thread was created
+	pthread_t thread;
+};
+
 char *getCharSet(void) {
 /*
 	find out character set
@@ -270,17 +287,18 @@ void printDirectoryEntryType(const struct sExFATDirEntry *de) {
 	fprintf(stderr, "(%u)\n", type);
 }
 
-int32_t parseExFATClusterChain(struct sFileSystem *fs, struct sClusterChain *chain, struct sExFATDirEntrySetList *desl, uint32_t *direntrysets, uint32_t *reordered) {
+int32_t parseExFATClusterChain(struct sFileSystem *fs, struct sClusterChain *chain, const char *image, struct sExFATDirEntrySetList *desl, uint32_t *direntrysets, uint32_t *reordered) {
 	/*
-		parses an exFAT cluster chain and puts found directory entries to list
+		parses the image of an exFAT cluster chain and puts found directory entries to list
 	*/
 	assert(fs != NULL);
 	assert(chain != NULL);
+	assert(image != NULL);
 	assert(desl != NULL);
 	assert(direntrysets != NULL);
 	assert(reordered != NULL);
 
-	uint32_t j;
+	uint32_t j, k=0;
 	int32_t ret;
 	uint32_t entries=0;
 	uint32_t expected_entries=0;
@@ -305,11 +323,10 @@ int32_t parseExFATClusterChain(struct sFileSystem *fs, struct sClusterChain *cha
 	*reordered=0;
 
 	while (chain != NULL) {
-		device_seekset(fs->device, getClusterOffset(fs, chain->cluster));
 		// fprintf(stderr, "cluster=%x;clusterOffset=%x\n", chain->cluster, getClusterOffset(fs, chain->cluster));
 		for (j=0;j<fs->maxDirEntriesPerCluster;j++) {
 
-			ret=parseExFATEntry(fs, &de);
+			ret=parseExFATEntry(&de, image + (size_t) k * fs->clusterSize + (size_t) j * DIR_ENTRY_SIZE);
 			if (OPT_MORE_INFO && (ret != -1)) {
 				printDirectoryEntryType(&de);
 			}
@@ -526,6 +543,7 @@ int32_t parseExFATClusterChain(struct sFileSystem *fs, struct sClusterChain *cha
 
 		}
 		chain=chain->next;
+		k++;
 	}
 
 	if (entries) {
@@ -539,17 +557,18 @@ int32_t parseExFATClusterChain(struct sFileSystem *fs, struct sClusterChain *cha
 
 
 
-int32_t parseClusterChain(struct sFileSystem *fs, struct sClusterChain *chain, struct sDirEntryList *list, uint32_t *direntries, uint32_t *reordered) {
+int32_t parseClusterChain(struct sFileSystem *fs, struct sClusterChain *chain, const char *image, struct sDirEntryList *list, uint32_t *direntries, uint32_t *reordered) {
 /*
-	parses a cluster chain and puts found directory entries to list
+	parses the image of a cluster chain and puts found directory entries to list
 */
 
 	assert(fs != NULL);
 	assert(chain != NULL);
+	assert(image != NULL);
 	assert(list != NULL);
 	assert(direntries != NULL);
 
-	uint32_t j;
+	uint32_t j, k=0;
 	int32_t ret;
 	uint32_t entries=0;
 	uint32_t r;
@@ -566,10 +585,9 @@ int32_t parseClusterChain(struct sFileSystem *fs, struct sClusterChain *chain, s
 	lname[0]='\0';
 	*reordered=0;
 	while (chain != NULL) {
-		device_seekset(fs->device, getClusterOffset(fs, chain->cluster));
 		for (j=0;j<fs->maxDirEntriesPerCluster;j++) {
 			entries++;
-			ret=parseEntry(fs, &de);
+			ret=parseEntry(&de, image + (size_t) k * fs->clusterSize + (size_t) j * DIR_ENTRY_SIZE);
 
 			switch(ret) {
 			case -1:
@@ -647,6 +665,7 @@ int32_t parseClusterChain(struct sFileSystem *fs, struct sClusterChain *chain, s
 
 		}
 		chain=chain->next;
+		k++;
 	}
 
 	if (llist != NULL) {
@@ -658,16 +677,16 @@ int32_t parseClusterChain(struct sFileSystem *fs, struct sClusterChain *chain, s
 	return 0;
 }
 
-int32_t parseFat1xRootDirEntries(struct sFileSystem *fs, struct sDirEntryList *list, uint32_t *direntries, uint32_t *reordered) {
+int32_t parseFat1xRootDirEntries(struct sFileSystem *fs, const char *image, struct sDirEntryList *list, uint32_t *direntries, uint32_t *reordered) {
 /*
-	parses FAT1x root directory entries to list
+	parses FAT1x root directory entries from the root directory image to list
 */
 
 	assert(fs != NULL);
+	assert(image != NULL);
 	assert(list != NULL);
 	assert(direntries != NULL);
 
-	off_t BSOffset;
 	int32_t j, ret;
 	uint32_t entries=0, r;
 	union sDirEntry de;
@@ -681,14 +700,9 @@ int32_t parseFat1xRootDirEntries(struct sFileSystem *fs, struct sDirEntryList *l
 	lname[0]='\0';
 	*reordered=0;
 
-	BSOffset = ((off_t)SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) +
-		fs->bs.xxFATxx.FAT12_16_32.BS_NumFATs * fs->FATSize) * fs->sectorSize;
-
-	device_seekset(fs->device, BSOffset);
-
 	for (j=0;j<SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RootEntCnt);j++) {
 		entries++;
-		ret=parseEntry(fs, &de);
+		ret=parseEntry(&de, image + (size_t) j * DIR_ENTRY_SIZE);
 
 		switch(ret) {
 		case -1:
@@ -774,157 +788,218 @@ int32_t parseFat1xRootDirEntries(struct sFileSystem *fs, struct sDirEntryList *l
 	return 0;
 }
 
-int32_t writeList(struct sFileSystem *fs, struct sDirEntryList *list) {
+int64_t serializeDirEntryList(struct sDirEntryList *list, char *data, uint64_t size) {
 /*
-	writes directory entries to file
+	copies all directory entries from list to data,
+	returns the number of bytes used or -1 if data is too small
 */
 
-	assert(fs != NULL);
 	assert(list != NULL);
+	assert(data != NULL);
 
+	uint64_t pos=0;
 	struct sLongDirEntryList *tmp;
 
-	// no signal handling while writing (atomic action)
-	start_critical_section();
+	while(list->next != NULL) {
+		for (tmp=list->next->ldel; tmp != NULL; tmp=tmp->next) {
+			if (pos + DIR_ENTRY_SIZE > size) return -1;
+			memcpy(data+pos, tmp->lde, DIR_ENTRY_SIZE);
+			pos+=DIR_ENTRY_SIZE;
+		}
+		if (pos + DIR_ENTRY_SIZE > size) return -1;
+		memcpy(data+pos, list->next->sde, DIR_ENTRY_SIZE);
+		pos+=DIR_ENTRY_SIZE;
+		list=list->next;
+	}
+
+	return (int64_t) pos;
+}
 
-	while(list->next!=NULL) {
-		tmp=list->next->ldel;
-		while(tmp != NULL) {
-			if (device_write(fs->device, tmp->lde, DIR_ENTRY_SIZE, 1)<1) {
-				// end of critical section
-				end_critical_section();
+int64_t serializeExFATDirEntrySetList(struct sExFATDirEntrySetList *desl, char *data, uint64_t size) {
+/*
+	copies all exFAT directory entries from desl to data,
+	returns the number of bytes used or -1 if data is too small
+*/
 
-				stderror();
-				return -1;
-			}
-			tmp=tmp->next;
-		}
-		if (device_write(fs->device, list->next->sde, DIR_ENTRY_SIZE, 1)<1) {
-			// end of critical section
-			end_critical_section();
+	assert(desl != NULL);
+	assert(data != NULL);
 
-			stderror();
-			return -1;
+	uint64_t pos=0;
+	uint32_t i;
+	struct sExFATDirEntryList *tmp;
+
+	while(desl->next != NULL) {
+		tmp=desl->next->des->del->next;
+		for (i=0; i<desl->next->des->entries; i++) {
+			if (pos + DIR_ENTRY_SIZE > size) return -1;
+			memcpy(data+pos, &tmp->de, DIR_ENTRY_SIZE);
+			pos+=DIR_ENTRY_SIZE;
+			tmp=tmp->next;
 		}
-		list=list->next;
+		desl=desl->next;
 	}
 
-	// sync fs
-	syncFileSystem(fs);
+	return (int64_t) pos;
+}
 
-	// end of critical section
-	end_critical_section();
+int32_t syncDirectory(struct sFileSystem *fs) {
+/*
+	syncs the file system after a directory has been written according to the sync policy:
+	dir   : every written directory is on disk before the next one is touched (default)
+	dirs  : a crash may lose the last OPT_SYNC_INTERVAL directories, each one is either old or new
+	kib   : a crash may lose about OPT_SYNC_INTERVAL KiB of directory writes
+	range : like dir, but only the written range leaves the page cache; the write cache of
+	        the drive is not flushed, so a power loss may still lose the last directories
+	end   : all directories are synced at once at the end, a crash may lose any of them
+	Directory sectors are written in place, so a torn sector write can still damage a
+	directory with every policy.
+*/
 
-	return 0;
+	assert(fs != NULL);
+
+	fs->pendingDirs++;
+
+	switch(OPT_SYNC_POLICY) {
+	case SYNC_POLICY_DIRS:
+		if (fs->pendingDirs < OPT_SYNC_INTERVAL) return 0;
+		break;
+	case SYNC_POLICY_KIB:
+		if (fs->pendingBytes < (uint64_t) OPT_SYNC_INTERVAL * 1024) return 0;
+		break;
+	case SYNC_POLICY_RANGE:
+		return syncPendingWrites(fs);
+	case SYNC_POLICY_END:
+		return 0;
+	}
+
+	return syncFileSystem(fs);
 }
 
-int32_t writeClusterChain(struct sFileSystem *fs, struct sDirEntryList *list, struct sClusterChain *chain) {
+int32_t writeList(struct sFileSystem *fs, struct sDirEntryList *list, const char *image, off_t offset, uint32_t size) {
 /*
-	writes all entries from list to the cluster chain
+	writes directory entries to file starting at offset,
+	only sectors that differ from image are written
 */
 
 	assert(fs != NULL);
 	assert(list != NULL);
-	assert(chain != NULL);
+	assert(image != NULL);
 
-	uint32_t i=0, entries=0;
-	struct sLongDirEntryList *tmp;
-	struct sDirEntryList *p=list->next;
-	char empty[DIR_ENTRY_SIZE]={0};
+	char *data;
+	int64_t len;
 
-	chain=chain->next;	// we don't need to look at the head element
+	if ((data=malloc(size)) == NULL) {
+		stderror();
+		return -1;
+	}
+	memcpy(data, image, size);
 
-	if (device_seekset(fs->device, getClusterOffset(fs, chain->cluster))==-1) {
-		myerror("Seek error!");
+	if ((len=serializeDirEntryList(list, data, size)) == -1) {
+		myerror("Directory entries exceed directory size!");
+		free(data);
 		return -1;
 	}
 
 	// no signal handling while writing (atomic action)
 	start_critical_section();
 
-	while(p != NULL) {
-		if (entries+p->entries <= fs->maxDirEntriesPerCluster) {
-			tmp=p->ldel;
-			for (i=1;i<p->entries;i++) {
-				if (device_write(fs->device, tmp->lde, DIR_ENTRY_SIZE, 1)<1) {
-					// end of critical section
-					end_critical_section();
+	if (writeChangedData(fs, data, image, (uint64_t) len, offset) == -1) {
+		// end of critical section
+		end_critical_section();
 
-					stderror();
-					return -1;
-				}
-				tmp=tmp->next;
-			}
-			if (device_write(fs->device, p->sde, DIR_ENTRY_SIZE, 1)<1) {
-				// end of critical section
-				end_critical_section();
+		free(data);
+		return -1;
+	}
 
-				stderror();
-				return -1;
-			}
-			entries+=p->entries;
-		} else {
-			tmp=p->ldel;
-			for (i=1;i<=fs->maxDirEntriesPerCluster-entries;i++) {
-				if (device_write(fs->device, tmp->lde, DIR_ENTRY_SIZE, 1)<1) {
-					// end of critical section
-					end_critical_section();
+	// sync fs according to the sync policy
+	if (syncDirectory(fs) == -1) {
+		end_critical_section();
+		free(data);
+		return -1;
+	}
 
-					stderror();
-					return -1;
-				}
-				tmp=tmp->next;
-			}
-			chain=chain->next; entries=p->entries - (fs->maxDirEntriesPerCluster - entries);	// next cluster
-			if (device_seekset(fs->device, getClusterOffset(fs, chain->cluster))==-1) {
+	// end of critical section
+	end_critical_section();
 
-				// end of critical section
-				end_critical_section();
+	free(data);
 
-				myerror("Seek error!");
-				return -1;
-			}
-			while(tmp!=NULL) {
-				if (device_write(fs->device, tmp->lde, DIR_ENTRY_SIZE, 1)<1) {
-					// end of critical section
-					end_critical_section();
+	return 0;
+}
 
-					stderror();
-					return -1;
-				}
-				tmp=tmp->next;
-			}
-			if (device_write(fs->device, p->sde, DIR_ENTRY_SIZE, 1)<1) {
-				// end of critical section
-				end_critical_section();
+int32_t writeDirectoryImage(struct sFileSystem *fs, struct sClusterChain *chain, char *data, const char *image, int64_t len) {
+/*
+	terminates directory data of len bytes and writes all clusters that contain entries,
+	sectors that equal the current directory image are skipped
+*/
 
-				stderror();
-				return -1;
-			}
-		}
-		p=p->next;
+	assert(fs != NULL);
+	assert(chain != NULL);
+	assert(data != NULL);
+	assert(image != NULL);
+
+	// mark end of directory if the last cluster is not full
+	if ((len == 0) || (len % fs->clusterSize)) {
+		memset(data+len, 0, DIR_ENTRY_SIZE);
+		len+=DIR_ENTRY_SIZE;
 	}
-	if (entries < fs->maxDirEntriesPerCluster) {
-		if (device_write(fs->device, empty, DIR_ENTRY_SIZE, 1)<1) {
-			// end of critical section
-			end_critical_section();
 
-			stderror();
-			return -1;
-		}
+	// no signal handling while writing (atomic action)
+	start_critical_section();
+
+	if (writeClusterChainData(fs, chain, data, image, (uint32_t) ((len + fs->clusterSize - 1) / fs->clusterSize)) == -1) {
+		// end of critical section
+		end_critical_section();
+		return -1;
 	}
 
-	// sync fs
-	syncFileSystem(fs);
+	// sync fs according to the sync policy
+	if (syncDirectory(fs) == -1) {
+		end_critical_section();
+		return -1;
+	}
 
 	// end of critical section
 	end_critical_section();
 
 	return 0;
+}
+
+int32_t writeClusterChain(struct sFileSystem *fs, struct sDirEntryList *list, struct sClusterChain *chain, const char *image, uint32_t clusters) {
+/*
+	writes all entries from list to the cluster chain
+*/
+
+	assert(fs != NULL);
+	assert(list != NULL);
+	assert(chain != NULL);
+	assert(image != NULL);
+
+	uint64_t size=(uint64_t) clusters * fs->clusterSize;
+	char *data;
+	int64_t len;
+	int32_t ret;
+
+	// start with the current directory image, so that data after the end mark is kept
+	if ((data=malloc((size_t) size)) == NULL) {
+		stderror();
+		return -1;
+	}
+	memcpy(data, image, (size_t) size);
+
+	if ((len=serializeDirEntryList(list, data, size)) == -1) {
+		myerror("Directory entries exceed cluster chain!");
+		free(data);
+		return -1;
+	}
+
+	ret=writeDirectoryImage(fs, chain, data, image, len);
 
+	free(data);
+
+	return ret;
 }
 
-int32_t writeExFATClusterChain(struct sFileSystem *fs, struct sExFATDirEntrySetList *desl, struct sClusterChain *chain) {
+int32_t writeExFATClusterChain(struct sFileSystem *fs, struct sExFATDirEntrySetList *desl, struct sClusterChain *chain, const char *image, uint32_t clusters) {
 /*
 	writes all entries from list to the cluster chain (exFAT)
 */
@@ -932,89 +1007,209 @@ int32_t writeExFATClusterChain(struct sFileSystem *fs, struct sExFATDirEntrySetL
 	assert(fs != NULL);
 	assert(desl != NULL);
 	assert(chain != NULL);
+	assert(image != NULL);
 
-	uint32_t i=0, entries=0;
-	struct sExFATDirEntryList *tmp;
-	struct sExFATDirEntrySetList *p=desl->next;
-	char empty[DIR_ENTRY_SIZE]={0};
+	uint64_t size=(uint64_t) clusters * fs->clusterSize;
+	char *data;
+	int64_t len;
+	int32_t ret;
 
-	chain=chain->next;	// we don't need to look at the head element
+	// start with the current directory image, so that data after the end mark is kept
+	if ((data=malloc((size_t) size)) == NULL) {
+		stderror();
+		return -1;
+	}
+	memcpy(data, image, (size_t) size);
 
-	if (device_seekset(fs->device, getClusterOffset(fs, chain->cluster))==-1) {
-		myerror("Seek error!");
+	if ((len=serializeExFATDirEntrySetList(desl, data, size)) == -1) {
+		myerror("Directory entries exceed cluster chain!");
+		free(data);
 		return -1;
 	}
 
-	// no signal handling while writing (atomic action)
-	start_critical_section();
-	// fprintf(stderr, "Startcluster: %u\n", chain->cluster);
-	while(p != NULL) {
-		// fprintf(stderr, "Entries: %u\n", p->des->entries);
-		if (entries+p->des->entries <= fs->maxDirEntriesPerCluster) {
-			tmp=p->des->del->next;
-			for (i=1;i<=p->des->entries;i++) {
-				if (device_write(fs->device, &tmp->de, DIR_ENTRY_SIZE, 1)<1) {
-					// end of critical section
-					end_critical_section();
-
-					stderror();
-					return -1;
-				}
-				tmp=tmp->next;
-			}
-			entries+=p->des->entries;
-		} else {
-			tmp=p->des->del->next;
-			for (i=1;i<=fs->maxDirEntriesPerCluster-entries;i++) {
-				if (device_write(fs->device, &(tmp->de), DIR_ENTRY_SIZE, 1)<1) {
-					// end of critical section
-					end_critical_section();
+	ret=writeDirectoryImage(fs, chain, data, image, len);
 
-					stderror();
-					return -1;
-				}
-				tmp=tmp->next;
-			}
-			chain=chain->next; entries=p->des->entries - (fs->maxDirEntriesPerCluster - entries);	// next cluster
-			if (device_seekset(fs->device, getClusterOffset(fs, chain->cluster))==-1) {
+	free(data);
+
+	return ret;
+}
 
-				// end of critical section
-				end_critical_section();
+uint32_t *getSubdirectoryClusters(struct sDirEntryList *list, uint32_t *n) {
+/*
+	returns the first clusters of all sub directories (to be freed by the caller)
+*/
+	assert(list != NULL);
+	assert(n != NULL);
 
-				myerror("Seek error!");
-				return -1;
-			}
-			while(tmp!=NULL) {
-				if (device_write(fs->device, &(tmp->de), DIR_ENTRY_SIZE, 1)<1) {
-					// end of critical section
-					end_critical_section();
+	struct sDirEntryList *p;
+	uint32_t *clusters;
 
-					stderror();
-					return -1;
-				}
-				tmp=tmp->next;
-			}
+	*n=0;
+	for (p=list->next; p != NULL; p=p->next) (*n)++;
+
+	if ((clusters=malloc(sizeof(uint32_t) * (*n + 1))) == NULL) {
+		stderror();
+		return NULL;
+	}
+
+	*n=0;
+	for (p=list->next; p != NULL; p=p->next) {
+		if ((p->sde->DIR_Atrr & ATTR_DIRECTORY) &&
+			((uint8_t) p->sde->DIR_Name[0] != DE_FREE) &&
+			!(p->sde->DIR_Atrr & ATTR_VOLUME_ID) &&
+			(strcmp(p->sname, ".")) && strcmp(p->sname, "..")) {
+			clusters[(*n)++]=SwapInt16(p->sde->DIR_FstClusHI) * 65536 + SwapInt16(p->sde->DIR_FstClusLO);
 		}
-		p=p->next;
 	}
-	if (entries < fs->maxDirEntriesPerCluster) {
-		if (device_write(fs->device, empty, DIR_ENTRY_SIZE, 1)<1) {
-			// end of critical section
-			end_critical_section();
 
-			stderror();
-			return -1;
+	return clusters;
+}
+
+uint32_t *getExFATSubdirectoryClusters(struct sExFATDirEntrySetList *desl, uint32_t *n) {
+/*
+	returns the first clusters of all exFAT sub directories (to be freed by the caller)
+*/
+	assert(desl != NULL);
+	assert(n != NULL);
+
+	struct sExFATDirEntrySetList *p;
+	uint32_t *clusters;
+
+	*n=0;
+	for (p=desl->next; p != NULL; p=p->next) (*n)++;
+
+	if ((clusters=malloc(sizeof(uint32_t) * (*n + 1))) == NULL) {
+		stderror();
+		return NULL;
+	}
+
+	*n=0;
+	for (p=desl->next; p != NULL; p=p->next) {
+		if ((FIRSTENTRY(p->des).type & EXFAT_FLAG_INUSE) &&
+		   (EXFAT_ISTYPE(FIRSTENTRY(p->des), EXFAT_ENTRY_FILE)) &&
+		   (EXFAT_HASATTR(FILEDIRENTRY(p->des), EXFAT_ATTR_DIR))) {
+			clusters[(*n)++]=SwapInt32(STREAMEXT(p->des).firstCluster);
 		}
 	}
 
-	// sync fs
-	syncFileSystem(fs);
+	return clusters;
+}
 
-	// end of critical section
-	end_critical_section();
+int32_t prefetchSubdirectories(struct sFileSystem *fs, struct sDirEntryList *list) {
+/*
+	reads the first clusters of all sub directories in one batch
+*/
+	assert(fs != NULL);
+	assert(list != NULL);
+
+	uint32_t *clusters, n;
+	int32_t ret;
+
+	if ((clusters=getSubdirectoryClusters(list, &n)) == NULL) return -1;
+
+	ret=prefetchClusters(fs, clusters, n);
+
+	free(clusters);
+
+	return ret;
+}
+
+int32_t prefetchExFATSubdirectories(struct sFileSystem *fs, struct sExFATDirEntrySetList *desl) {
+/*
+	reads the first clusters of all exFAT sub directories in one batch
+*/
+	assert(fs != NULL);
+	assert(desl != NULL);
+
+	uint32_t *clusters, n;
+	int32_t ret;
+
+	if ((clusters=getExFATSubdirectoryClusters(desl, &n)) == NULL) return -1;
+
+	ret=prefetchClusters(fs, clusters, n);
+
+	free(clusters);
+
+	return ret;
+}
+
+void adviseSubdirectories(struct sFileSystem *fs, struct sDirEntryList *list) {
+/*
+	lets the kernel read the sub directories ahead while their parent is sorted,
+	sorting goes on without the hint if it can't be given
+*/
+	assert(fs != NULL);
+	assert(list != NULL);
+
+	uint32_t *clusters, n;
+
+	if ((clusters=getSubdirectoryClusters(list, &n)) == NULL) return;
+
+	adviseClusters(fs, clusters, n);
+
+	free(clusters);
+}
+
+void adviseExFATSubdirectories(struct sFileSystem *fs, struct sExFATDirEntrySetList *desl) {
+/*
+	lets the kernel read the exFAT sub directories ahead while their parent is sorted,
+	sorting goes on without the hint if it can't be given
+*/
+	assert(fs != NULL);
+	assert(desl != NULL);
+
+	uint32_t *clusters, n;
+
+	if ((clusters=getExFATSubdirectoryClusters(desl, &n)) == NULL) return;
+
+	adviseClusters(fs, clusters, n);
+
+	free(clusters);
+}
+
+int32_t enterDirectory(struct sFileSystem *fs, uint32_t cluster, uint32_t *resumed) {
+/*
+	pushes a directory onto the checkpoint stack, resumed is set
+	if the directory was already sorted by an interrupted run
+*/
+	assert(fs != NULL);
+	assert(resumed != NULL);
+
+	int32_t ret;
+
+	*resumed=0;
+	if (fs->checkpoint == NULL) return 0;
+
+	if ((ret=checkpoint_enter(fs->checkpoint, cluster)) == -1) {
+		myerror("Failed to update checkpoint!");
+		return -1;
+	}
+	*resumed=(uint32_t) ret;
 
 	return 0;
+}
+
+int32_t leaveDirectory(struct sFileSystem *fs) {
+/*
+	pops a finished directory from the checkpoint stack and saves the
+	checkpoint from time to time after the written directories are synced
+*/
+	assert(fs != NULL);
 
+	if (fs->checkpoint == NULL) return 0;
+
+	// after the root directory the run is complete
+	checkpoint_leave(fs->checkpoint);
+	if (!fs->checkpoint->depth || !checkpoint_due(fs->checkpoint)) return 0;
+
+	if (fs->pendingBytes && syncFileSystem(fs)) return -1;
+
+	if (checkpoint_save(fs->checkpoint)) {
+		myerror("Failed to save checkpoint!");
+		return -1;
+	}
+
+	return 0;
 }
 
 int32_t sortSubdirectories(struct sFileSystem *fs, struct sDirEntryList *list, const char (*path)[MAX_PATH_LEN+1]) {
@@ -1029,6 +1224,11 @@ int32_t sortSubdirectories(struct sFileSystem *fs, struct sDirEntryList *list, c
 	char newpath[MAX_PATH_LEN+1]={0};
 	uint32_t c;
 
+	if (prefetchSubdirectories(fs, list) == -1) {
+		myerror("Failed to prefetch sub directories!");
+		return -1;
+	}
+
 	// sort sub directories
 	p=list->next;
 	while (p != NULL) {
@@ -1037,6 +1237,12 @@ int32_t sortSubdirectories(struct sFileSystem *fs, struct sDirEntryList *list, c
 			!(p->sde->DIR_Atrr & ATTR_VOLUME_ID) &&
 			(strcmp(p->sname, ".")) && strcmp(p->sname, "..")) {
 
+			// skip sub directories that were finished by an interrupted run
+			if ((fs->checkpoint != NULL) && checkpoint_skip(fs->checkpoint)) {
+				p=p->next;
+				continue;
+			}
+
 			c=(SwapInt16(p->sde->DIR_FstClusHI) * 65536 + SwapInt16(p->sde->DIR_FstClusLO));
 /*			if (getFATEntry(fs, c, &value) == -1) {
 				myerror("Failed to get FAT entry!");
@@ -1073,6 +1279,11 @@ int32_t sortExFATSubdirectories(struct sFileSystem *fs, struct sExFATDirEntrySet
 	char newpath[MAX_PATH_LEN+1]={0};
 	uint32_t c;
 
+	if (prefetchExFATSubdirectories(fs, desl) == -1) {
+		myerror("Failed to prefetch sub directories!");
+		return -1;
+	}
+
 	// sort sub directories
 	p=desl->next;
 	while (p != NULL) {
@@ -1080,6 +1291,12 @@ int32_t sortExFATSubdirectories(struct sFileSystem *fs, struct sExFATDirEntrySet
 		   (EXFAT_ISTYPE(FIRSTENTRY(p->des), EXFAT_ENTRY_FILE)) &&
 		   (EXFAT_HASATTR(FILEDIRENTRY(p->des), EXFAT_ATTR_DIR))) {
 
+			// skip sub directories that were finished by an interrupted run
+			if ((fs->checkpoint != NULL) && checkpoint_skip(fs->checkpoint)) {
+				p=p->next;
+				continue;
+			}
+
 			c=SwapInt32(STREAMEXT(p->des).firstCluster);
 
 		/*	if (getFATEntry(fs, c, &value) == -1) {
@@ -1108,17 +1325,96 @@ int32_t sortExFATSubdirectories(struct sFileSystem *fs, struct sExFATDirEntrySet
 	return 0;
 }
 
-void printDirEntryList(struct sDirEntryList *del) {
+int32_t addFragmentation(struct sFileSystem *fs, struct sDirEntryList *list, const char (*path)[MAX_PATH_LEN+1]) {
+/*
+	adds the extents of all files in a directory to the fragmentation report
+*/
+	assert(fs != NULL);
+	assert(fs->fragmentation != NULL);
+	assert(list != NULL);
+	assert(path != NULL);
 
+	struct sDirEntryList *p;
+	uint32_t c;
+	int32_t ret;
 
-	while(del->next != NULL) {
+	frag_begindir(fs->fragmentation, (const char *) path);
 
-		if (strcmp(del->next->sname, ".") &&
-			   strcmp(del->next->sname, "..") &&
-			   (((uint8_t) del->next->sname[0]) != DE_FREE) &&
-			  !(del->next->sde->DIR_Atrr & ATTR_VOLUME_ID)) {
+	for (p=list->next; p != NULL; p=p->next) {
+		if (((uint8_t) p->sde->DIR_Name[0] == DE_FREE) ||
+			(p->sde->DIR_Atrr & (ATTR_DIRECTORY | ATTR_VOLUME_ID))) continue;
 
-				if (!OPT_MORE_INFO) {
+		// empty files have no cluster
+		c=SwapInt16(p->sde->DIR_FstClusHI) * 65536 + SwapInt16(p->sde->DIR_FstClusLO);
+		if (c == 0) continue;
+
+		if ((ret=getChainExtents(fs, c, fs->fragmentation)) == -1) {
+			myerror("Failed to get extents of %s%s!", (const char *) path, (p->lname[0] != '\0') ? p->lname : p->sname);
+			return -1;
+		} else if (ret) {
+			// the report goes on without the rest of the file
+			myerror("Cluster chain of %s%s is broken!", (const char *) path, (p->lname[0] != '\0') ? p->lname : p->sname);
+			frag_brokenfile(fs->fragmentation);
+		}
+		frag_endfile(fs->fragmentation);
+	}
+
+	return frag_enddir(fs->fragmentation);
+}
+
+int32_t addExFATFragmentation(struct sFileSystem *fs, struct sExFATDirEntrySetList *desl, const char (*path)[MAX_PATH_LEN+1]) {
+/*
+	adds the extents of all files in an exFAT directory to the fragmentation report
+*/
+	assert(fs != NULL);
+	assert(fs->fragmentation != NULL);
+	assert(desl != NULL);
+	assert(path != NULL);
+
+	struct sExFATDirEntrySetList *p;
+	uint64_t len;
+	uint32_t c;
+	int32_t ret;
+
+	frag_begindir(fs->fragmentation, (const char *) path);
+
+	for (p=desl->next; p != NULL; p=p->next) {
+		if (!(FIRSTENTRY(p->des).type & EXFAT_FLAG_INUSE) ||
+		   !(EXFAT_ISTYPE(FIRSTENTRY(p->des), EXFAT_ENTRY_FILE)) ||
+		   (EXFAT_HASATTR(FILEDIRENTRY(p->des), EXFAT_ATTR_DIR))) continue;
+
+		c=SwapInt32(STREAMEXT(p->des).firstCluster);
+		len=(SwapInt64(STREAMEXT(p->des).dataLen) + fs->clusterSize - 1) / fs->clusterSize;
+		if ((c == 0) || (len == 0)) continue;
+
+		if (STREAMEXT(p->des).genSecFlags & EXFAT_GSFLAG_FAT_INVALID) {
+			// contiguous files have no FAT chain
+			frag_addextent(fs->fragmentation, (uint32_t) len);
+		} else if ((ret=getChainExtents(fs, c, fs->fragmentation)) == -1) {
+			myerror("Failed to get extents of %s%s!", (const char *) path, p->des->name);
+			return -1;
+		} else if (ret) {
+			// the report goes on without the rest of the file
+			myerror("Cluster chain of %s%s is broken!", (const char *) path, p->des->name);
+			frag_brokenfile(fs->fragmentation);
+		}
+		frag_endfile(fs->fragmentation);
+	}
+
+	return frag_enddir(fs->fragmentation);
+}
+
+void printDirEntryList(struct sDirEntryList *del) {
+
+
+	while(del->next != NULL) {
+
+		if (strcmp(del->next->sname, ".") &&
+			   strcmp(del->next->sname, "..") &&
+			   (((uint8_t) del->next->sname[0]) != DE_FREE) &&
+			  !(del->next->sde->DIR_Atrr & ATTR_VOLUME_ID)) {
+
+				if (!OPT_MORE_INFO) {
 					printf("%s\n", (del->next->lname[0] != '\0') ? del->next->lname : del->next->sname);
 				} else {
 					printf("%s (%s)\n", (del->next->lname[0] != '\0') ? del->next->lname : "n/a", del->next->sname);
@@ -1144,7 +1440,8 @@ int32_t sortClusterChain(struct sFileSystem *fs, uint32_t cluster, const char (*
 	int32_t clen;
 	struct sClusterChain *ClusterChain;
 	struct sDirEntryList *list;
-	uint32_t reordered;
+	uint32_t reordered, resumed;
+	char *image;
 
 	uint32_t match;
 
@@ -1173,7 +1470,21 @@ int32_t sortClusterChain(struct sFileSystem *fs, uint32_t cluster, const char (*
 		return -1;
 	}
 
-	if (match) {
+	if (prefetchClusterChain(fs, ClusterChain) == -1) {
+		myerror("Failed to prefetch cluster chain!");
+		freeDirEntryList(list);
+		freeClusterChain(ClusterChain);
+		return -1;
+	}
+
+	if ((image=readClusterChainData(fs, ClusterChain, clen)) == NULL) {
+		myerror("Failed to read cluster chain!");
+		freeDirEntryList(list);
+		freeClusterChain(ClusterChain);
+		return -1;
+	}
+
+	if (match && !OPT_FRAGMENTATION) {
 		if (!OPT_LIST) {
 			infomsg("Sorting directory %s\n", path);
 			if (OPT_MORE_INFO)
@@ -1187,24 +1498,46 @@ int32_t sortClusterChain(struct sFileSystem *fs, uint32_t cluster, const char (*
 		}
 	}
 
-	if (parseClusterChain(fs, ClusterChain, list, &direntries, &reordered) == -1) {
+	if (parseClusterChain(fs, ClusterChain, image, list, &direntries, &reordered) == -1) {
 		myerror("Failed to parse cluster chain!");
+		free(image);
 		freeDirEntryList(list);
 		freeClusterChain(ClusterChain);
 		return -1;
 	}
 
-	if (match) {
+	// sub directories are read by the kernel while this directory is sorted and written
+	adviseSubdirectories(fs, list);
+
+	if (enterDirectory(fs, cluster, &resumed) == -1) {
+		free(image);
+		freeDirEntryList(list);
+		freeClusterChain(ClusterChain);
+		return -1;
+	}
+
+	if (match && OPT_FRAGMENTATION) {
+		if (addFragmentation(fs, list, path) == -1) {
+			myerror("Failed to add directory to fragmentation report!");
+			free(image);
+			freeDirEntryList(list);
+			freeClusterChain(ClusterChain);
+			return -1;
+		}
+	} else if (match) {
 		if (!OPT_LIST) {
 			// sort directory if reordering was neccessary
 			// feature: crash-safe implementation
 			if (OPT_RANDOM) randomizeDirEntryList(list);
 
-			if (reordered || OPT_RANDOM) {
+			if (resumed) {
+				infomsg("Directory was sorted before interruption.\n");
+			} else if (reordered || OPT_RANDOM) {
 				infomsg("Directory reordered. Writing changes.\n");
 
-				if (writeClusterChain(fs, list, ClusterChain) == -1) {
+				if (writeClusterChain(fs, list, ClusterChain, image, clen) == -1) {
 					myerror("Failed to write cluster chain!");
+					free(image);
 					freeDirEntryList(list);
 					freeClusterChain(ClusterChain);
 					return -1;
@@ -1215,16 +1548,20 @@ int32_t sortClusterChain(struct sFileSystem *fs, uint32_t cluster, const char (*
 		}
 	}
 
+	free(image);
 	freeClusterChain(ClusterChain);
 
 	// sort subdirectories
 	if (sortSubdirectories(fs, list, path) == -1 ){
 		myerror("Failed to sort subdirectories!");
+		freeDirEntryList(list);
 		return -1;
 	}
 
 	freeDirEntryList(list);
 
+	if (leaveDirectory(fs) == -1) return -1;
+
 	return 0;
 }
 
@@ -1254,9 +1591,10 @@ int32_t sortExFATClusterChain(struct sFileSystem *fs, uint32_t cluster, uint32_t
 	struct sClusterChain *ClusterChain;
 	struct sExFATDirEntrySetList *desl;
 	uint32_t i;
+	char *image;
 
 	uint32_t match;
-	uint32_t reordered=0;
+	uint32_t reordered=0, resumed;
 
 	if (!OPT_REGEX) {
 		match=matchesDirPathLists(OPT_INCL_DIRS,
@@ -1299,7 +1637,21 @@ int32_t sortExFATClusterChain(struct sFileSystem *fs, uint32_t cluster, uint32_t
 		}
 	}
 
-	if (match) {
+	if (prefetchClusterChain(fs, ClusterChain) == -1) {
+		myerror("Failed to prefetch cluster chain!");
+		freeExFATDirEntrySetList(desl);
+		freeClusterChain(ClusterChain);
+		return -1;
+	}
+
+	if ((image=readClusterChainData(fs, ClusterChain, clen)) == NULL) {
+		myerror("Failed to read cluster chain!");
+		freeExFATDirEntrySetList(desl);
+		freeClusterChain(ClusterChain);
+		return -1;
+	}
+
+	if (match && !OPT_FRAGMENTATION) {
 		if (!OPT_LIST) {
 			infomsg("Sorting directory %s\n", path);
 		} else {
@@ -1310,25 +1662,46 @@ int32_t sortExFATClusterChain(struct sFileSystem *fs, uint32_t cluster, uint32_t
 				cluster, clen, clen*fs->clusterSize);
 	}
 
-	if (parseExFATClusterChain(fs, ClusterChain, desl, &direntrysets, &reordered) == -1) {
+	if (parseExFATClusterChain(fs, ClusterChain, image, desl, &direntrysets, &reordered) == -1) {
 		myerror("Failed to parse cluster chain!");
+		free(image);
+		freeExFATDirEntrySetList(desl);
+		freeClusterChain(ClusterChain);
+		return -1;
+	}
+
+	adviseExFATSubdirectories(fs, desl);
+
+	if (enterDirectory(fs, cluster, &resumed) == -1) {
+		free(image);
 		freeExFATDirEntrySetList(desl);
 		freeClusterChain(ClusterChain);
 		return -1;
 	}
 
-	if (match) {
+	if (match && OPT_FRAGMENTATION) {
+		if (addExFATFragmentation(fs, desl, path) == -1) {
+			myerror("Failed to add directory to fragmentation report!");
+			free(image);
+			freeExFATDirEntrySetList(desl);
+			freeClusterChain(ClusterChain);
+			return -1;
+		}
+	} else if (match) {
 		// sort directory if selected
 		if (!OPT_LIST) {
 
 			if (OPT_RANDOM) randomizeExFATDirEntrySetList(desl, direntrysets);
 
-			if (reordered || OPT_RANDOM) {
+			if (resumed) {
+				infomsg("Directory was sorted before interruption.\n");
+			} else if (reordered || OPT_RANDOM) {
 				infomsg("Directory reordered. Writing changes.\n");
 
 				// feature: crash-safe implementation
-				if (writeExFATClusterChain(fs, desl, ClusterChain) == -1) {
+				if (writeExFATClusterChain(fs, desl, ClusterChain, image, clen) == -1) {
 					myerror("Failed to write cluster chain!");
+					free(image);
 					freeExFATDirEntrySetList(desl);
 					freeClusterChain(ClusterChain);
 					return -1;
@@ -1339,6 +1712,7 @@ int32_t sortExFATClusterChain(struct sFileSystem *fs, uint32_t cluster, uint32_t
 		}
 	}
 
+	free(image);
 	freeClusterChain(ClusterChain);
 
 	// sort subdirectories
@@ -1349,6 +1723,8 @@ int32_t sortExFATClusterChain(struct sFileSystem *fs, uint32_t cluster, uint32_t
 
 	freeExFATDirEntrySetList(desl);
 
+	if (leaveDirectory(fs) == -1) return -1;
+
 	return 0;
 }
 
@@ -1360,12 +1736,14 @@ int32_t sortFat1xRootDirectory(struct sFileSystem *fs) {
 	assert(fs != NULL);
 
 	off_t BSOffset;
+	uint32_t size;
+	char *image;
 
 	uint32_t direntries=0;
 
 	struct sDirEntryList *list;
 
-	uint32_t match, reordered;
+	uint32_t match, reordered, resumed;
 	const char rootDir[2] = {DIRECTORY_SEPARATOR, '\0'};
 
 	if (!OPT_REGEX) {
@@ -1379,7 +1757,7 @@ int32_t sortFat1xRootDirectory(struct sFileSystem *fs) {
 		if (OPT_REGEX_INCL->next != NULL) match &= matchesRegExList(OPT_REGEX_INCL, rootDir);
 	}
 
-	if (match) {
+	if (match && !OPT_FRAGMENTATION) {
 		if (!OPT_LIST) {
 			infomsg("Sorting directory /\n");
 		} else {
@@ -1392,27 +1770,62 @@ int32_t sortFat1xRootDirectory(struct sFileSystem *fs) {
 		return -1;
 	}
 
-	if (parseFat1xRootDirEntries(fs, list, &direntries, &reordered) == -1) {
+	// read the whole root directory at once
+	BSOffset = ((off_t)SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) +
+		fs->bs.xxFATxx.FAT12_16_32.BS_NumFATs * fs->FATSize) * fs->sectorSize;
+	size = (uint32_t) SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RootEntCnt) * DIR_ENTRY_SIZE;
+
+	if ((image=malloc(size ? size : 1)) == NULL) {
+		stderror();
+		freeDirEntryList(list);
+		return -1;
+	}
+
+	if (device_pread(fs->device, image, size, BSOffset) < size) {
+		myerror("Failed to read root directory!");
+		free(image);
+		freeDirEntryList(list);
+		return -1;
+	}
+
+	if (parseFat1xRootDirEntries(fs, image, list, &direntries, &reordered) == -1) {
 		myerror("Failed to parse root directory entries!");
+		free(image);
+		freeDirEntryList(list);
 		return -1;
 	}
 
-	if (match) {
+	adviseSubdirectories(fs, list);
+
+	// the root directory has no cluster
+	if (enterDirectory(fs, 0, &resumed) == -1) {
+		free(image);
+		freeDirEntryList(list);
+		return -1;
+	}
+
+	if (match && OPT_FRAGMENTATION) {
+		if (addFragmentation(fs, list, (const char (*)[MAX_PATH_LEN+1]) rootDir) == -1) {
+			myerror("Failed to add directory to fragmentation report!");
+			free(image);
+			freeDirEntryList(list);
+			return -1;
+		}
+	} else if (match) {
 		if (!OPT_LIST) {
 			// sort directory if reordering was neccessary
 			// feature: crash-safe implementation
 			if (OPT_RANDOM) randomizeDirEntryList(list);
 
-			if (reordered || OPT_RANDOM) {
+			if (resumed) {
+				infomsg("Directory was sorted before interruption.\n");
+			} else if (reordered || OPT_RANDOM) {
 
 				infomsg("Directory reordered. Writing changes.\n");
 
-				BSOffset = ((off_t)SwapInt16(fs->bs.xxFATxx.FAT12_16_32.BS_RsvdSecCnt) +
-					fs->bs.xxFATxx.FAT12_16_32.BS_NumFATs * fs->FATSize) * fs->sectorSize;
-				device_seekset(fs->device, BSOffset);
-
 				// write the sorted entries back to the fs
-				if (writeList(fs, list) == -1) {
+				if (writeList(fs, list, image, BSOffset, size) == -1) {
+					free(image);
 					freeDirEntryList(list);
 				  	myerror("Failed to write root directory entries!");
 					return -1;
@@ -1424,6 +1837,8 @@ int32_t sortFat1xRootDirectory(struct sFileSystem *fs) {
 		}
 	}
 
+	free(image);
+
 	// sort subdirectories
 	if (sortSubdirectories(fs, list, (const char (*)[MAX_PATH_LEN+1]) rootDir) == -1 ){
 		myerror("Failed to sort subdirectories!");
@@ -1433,21 +1848,172 @@ int32_t sortFat1xRootDirectory(struct sFileSystem *fs) {
 
 	freeDirEntryList(list);
 
+	if (leaveDirectory(fs) == -1) return -1;
+
 	return 0;
 }
 
-int32_t sortFileSystem(char *filename) {
+int32_t setupDevice(struct sFileSystem *fs) {
 /*
-	sort FAT file system
+	configures backend and cache of the device according to the options
 */
 
-	assert(filename != NULL);
+	assert(fs != NULL);
 
-	uint32_t mode = FS_MODE_RW;
+	uint32_t logical, physical, optimal, blockSize, unit;
 
-	struct sFileSystem fs;
+	if (OPT_BACKEND != -1) {
+		if (device_setbackend(fs->device, OPT_BACKEND)) {
+			myerror("Failed to select device backend!");
+			return -1;
+		}
+		if (device_getbackend(fs->device) != OPT_BACKEND) {
+			myerror("io_uring is not available, falling back to synchronous i/o!");
+		}
+	}
 
-	const char rootDir[2] = {DIRECTORY_SEPARATOR, '\0'};
+	if (OPT_DIRECT) {
+		if (OPT_BACKEND == DEVICE_BACKEND_MAP) {
+			myerror("Direct i/o can not be used with memory mapping!");
+			return -1;
+		}
+		if (device_setdirect(fs->device, 1)) {
+			myerror("Failed to enable direct i/o!");
+			return -1;
+		}
+	}
+
+	// cache blocks shall cover whole physical sectors
+	device_getgeometry(fs->device, &logical, &physical, &optimal);
+	blockSize=MAX(DEVICE_CACHE_BLOCK_SIZE, physical);
+
+	if (device_setcache(fs->device, blockSize,
+			(uint32_t) (((uint64_t) OPT_CACHE_SIZE * 1024 + blockSize - 1) / blockSize))) {
+		myerror("Failed to set up device cache!");
+		return -1;
+	}
+
+	// emulate a slow device below the cache
+	if (OPT_EMULATE && device_setmodel(fs->device, &OPT_DEVICE_MODEL)) {
+		myerror("Failed to set up device emulation!");
+		return -1;
+	}
+
+	// flash media prefer writes grouped by erase unit, which only pays off if several directories
+	// are synced at once, a dry run writes nothing
+	if (OPT_WRITE_UNIT != -1) {
+		unit=(uint32_t) OPT_WRITE_UNIT;
+	} else if ((OPT_SYNC_POLICY == SYNC_POLICY_DIRS) || (OPT_SYNC_POLICY == SYNC_POLICY_KIB) ||
+		(OPT_SYNC_POLICY == SYNC_POLICY_END)) {
+		unit=device_geteraseunit(fs->device);
+	} else {
+		unit=0;
+	}
+	if (!OPT_DRY_RUN && (unit > fs->sectorSize)) {
+		if (unit % fs->sectorSize) {
+			myerror("Write unit of %u bytes is not a multiple of the sector size!", unit);
+			return -1;
+		}
+		if (device_setwriteunit(fs->device, unit, DEVICE_STAGE_SIZE)) {
+			myerror("Failed to set up staged writes!");
+			return -1;
+		}
+	}
+
+	// collect all writes in memory, keyed by sector
+	if (OPT_DRY_RUN && device_setoverlay(fs->device, fs->sectorSize)) {
+		myerror("Failed to set up overlay for dry run!");
+		return -1;
+	}
+
+	if ((OPT_TRACE != NULL) && device_settrace(fs->device, OPT_TRACE)) {
+		myerror("Failed to create trace file '%s'!", OPT_TRACE);
+		return -1;
+	}
+
+	// read cluster chains from memory instead of one FAT entry per request
+	if (setFATCache(fs, (uint64_t) OPT_FAT_CACHE_SIZE * 1024)) {
+		myerror("Failed to set up FAT cache!");
+		return -1;
+	}
+
+	return 0;
+}
+
+int32_t printDryRunReport(struct sFileSystem *fs) {
+/*
+	prints which sectors a dry run would have written
+*/
+	assert(fs != NULL);
+
+	struct sDeviceRange *ranges;
+	uint64_t blocks, writes, bytes, changed;
+	uint32_t i, n;
+
+	device_overlaystats(fs->device, &blocks, &writes, &bytes);
+
+	if (device_overlayranges(fs->device, &ranges, &n, &changed)) {
+		myerror("Failed to get overlay ranges!");
+		return -1;
+	}
+
+	infomsg("\nDry run, the file system was not modified.\n");
+	infomsg("%" PRIu64 " writes with %" PRIu64 " bytes would change %" PRIu64 " bytes in %" PRIu64 " sectors.\n",
+		writes, bytes, changed, blocks);
+
+	if (OPT_MORE_INFO) {
+		for (i=0; i<n; i++) {
+			infomsg("  Sectors %" PRIu64 "-%" PRIu64 " (offset 0x%" PRIx64 ", %" PRIu64 " bytes)\n",
+				(uint64_t) ranges[i].offset / fs->sectorSize,
+				((uint64_t) ranges[i].offset + ranges[i].size - 1) / fs->sectorSize,
+				(uint64_t) ranges[i].offset, ranges[i].size);
+		}
+	}
+
+	free(ranges);
+
+	return 0;
+}
+
+void printDeviceStats(struct sFileSystem *fs) {
+/*
+	prints the i/o counters and the seek distance histogram of the device
+*/
+	assert(fs != NULL);
+
+	struct sDeviceStats stats;
+	char from[32], to[32];
+	uint32_t i;
+
+	device_stats(fs->device, &stats);
+
+	infomsg("Device i/o: %" PRIu64 " reads (%" PRIu64 " bytes), %" PRIu64 " writes (%" PRIu64 " bytes).\n",
+		stats.reads, stats.bytesRead, stats.writes, stats.bytesWritten);
+	infomsg("Media accesses: %" PRIu64 " reads (%" PRIu64 " bytes), %" PRIu64 " writes (%" PRIu64 " bytes), %" PRIu64 " system calls, %" PRIu64 " syncs.\n",
+		stats.mediaReads, stats.mediaBytesRead, stats.mediaWrites, stats.mediaBytesWritten, stats.syscalls, stats.syncs);
+	infomsg("Seeks: %" PRIu64 " over %" PRIu64 " bytes.\n", stats.seeks, stats.seekBytes);
+
+	if (!stats.seeks) return;
+
+	infomsg("Seek distances:\n");
+	for (i=0; i<DEVICE_SEEK_BUCKETS; i++) {
+		if (!stats.seekHistogram[i]) continue;
+		formatBytes(from, sizeof(from), (uint64_t) 1 << i);
+		if (i < DEVICE_SEEK_BUCKETS-1) {
+			formatBytes(to, sizeof(to), (uint64_t) 1 << (i+1));
+			infomsg("\t%10s - %-10s %12" PRIu64 "\n", from, to, stats.seekHistogram[i]);
+		} else {
+			infomsg("\t%10s or more   %12" PRIu64 "\n", from, stats.seekHistogram[i]);
+		}
+	}
+}
+
+uint32_t getSortMode(void) {
+/*
+	gets the mode file systems are opened with according to the options
+*/
+
+	uint32_t mode = FS_MODE_RW;
 
 	if (!OPT_FORCE && OPT_LIST) {
 		mode = FS_MODE_RO_EXCL;
@@ -1457,25 +2023,91 @@ int32_t sortFileSystem(char *filename) {
 		mode = FS_MODE_RO;
 	}
 
-	if (openFileSystem(filename, mode, &fs)) {
-		myerror("Failed to open file system!");
+	return mode;
+}
+
+int32_t sortOpenFileSystem(struct sFileSystem *fs) {
+/*
+	sorts an opened FAT file system and closes it
+*/
+
+	assert(fs != NULL);
+
+	const char rootDir[2] = {DIRECTORY_SEPARATOR, '\0'};
+
+	if (setupDevice(fs)) {
+		myerror("Failed to set up device!");
+		closeFileSystem(fs);
 		return -1;
 	}
 
-	if (checkFATs(&fs)) {
+	// finish an interrupted run before anything is read
+	if ((OPT_JOURNAL != NULL) && !OPT_LIST) {
+		device_tracephase(fs->device, "recovery");
+		if ((fs->journal=journal_open(OPT_JOURNAL, getVolumeFingerprint(fs))) == NULL) {
+			myerror("Failed to open journal!");
+			closeFileSystem(fs);
+			return -1;
+		}
+		switch (journal_recover(fs->journal, fs->device)) {
+		case JOURNAL_CLEAN: break;
+		case JOURNAL_ROLLED_FORWARD:
+			infomsg("Completed interrupted directory writes from journal.\n");
+			break;
+		case JOURNAL_DISCARDED:
+			infomsg("Discarded uncommitted directory writes from journal.\n");
+			break;
+		default:
+			myerror("Failed to recover from journal!");
+			closeFileSystem(fs);
+			return -1;
+		}
+	}
+
+	if ((OPT_CHECKPOINT != NULL) && !OPT_LIST) {
+		if ((fs->checkpoint=checkpoint_open(OPT_CHECKPOINT, getVolumeFingerprint(fs), OPT_RESUME)) == NULL) {
+			myerror("Failed to open checkpoint!");
+			closeFileSystem(fs);
+			return -1;
+		}
+	}
+
+	device_tracephase(fs->device, "check");
+	if (checkFATs(fs)) {
 		myerror("FATs don't match! Please repair file system!");
-		closeFileSystem(&fs);
+		closeFileSystem(fs);
+		return -1;
+	}
+
+	if (OPT_CHECK) {
+		switch (checkConsistency(fs)) {
+		case 0: break;
+		case 1:
+			myerror("File system is inconsistent! Please repair file system!");
+			closeFileSystem(fs);
+			return -1;
+		default:
+			myerror("Failed to check consistency of file system!");
+			closeFileSystem(fs);
+			return -1;
+		}
+	}
+
+	if (OPT_FRAGMENTATION && ((fs->fragmentation=frag_new()) == NULL)) {
+		myerror("Failed to create fragmentation report!");
+		closeFileSystem(fs);
 		return -1;
 	}
 
-	switch(fs.FATType) {
+	device_tracephase(fs->device, "sort");
+	switch(fs->FATType) {
 	case FATTYPE_FAT12:
 		// FAT12
 		// root directory has fixed size and position
 		infomsg("File system: FAT12.\n\n");
-		if (sortFat1xRootDirectory(&fs) == -1) {
+		if (sortFat1xRootDirectory(fs) == -1) {
 			myerror("Failed to sort FAT12 root directory!");
-			closeFileSystem(&fs);
+			closeFileSystem(fs);
 			return -1;
 		}
 		break;
@@ -1483,9 +2115,9 @@ int32_t sortFileSystem(char *filename) {
 		// FAT16
 		// root directory has fixed size and position
 		infomsg("File system: FAT16.\n\n");
-		if (sortFat1xRootDirectory(&fs) == -1) {
+		if (sortFat1xRootDirectory(fs) == -1) {
 			myerror("Failed to sort FAT16 root directory!");
-			closeFileSystem(&fs);
+			closeFileSystem(fs);
 			return -1;
 		}
 		break;
@@ -1494,9 +2126,9 @@ int32_t sortFileSystem(char *filename) {
 		// root directory lies in cluster chain,
 		// so sort it like all other directories
 		infomsg("File system: FAT32.\n\n");
-		if (sortClusterChain(&fs, SwapInt32(fs.bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_RootClus), (const char(*)[MAX_PATH_LEN+1]) rootDir) == -1) {
+		if (sortClusterChain(fs, SwapInt32(fs->bs.xxFATxx.FAT12_16_32.FATxx.FAT32.BS_RootClus), (const char(*)[MAX_PATH_LEN+1]) rootDir) == -1) {
 			myerror("Failed to sort first cluster chain!");
-			closeFileSystem(&fs);
+			closeFileSystem(fs);
 			return -1;
 		}
 		break;
@@ -1505,19 +2137,217 @@ int32_t sortFileSystem(char *filename) {
 		// root directory lies in cluster chain,
 		// so sort it like all other directories
 		infomsg("File system: exFAT.\n\n");
-		if (sortExFATClusterChain(&fs, SwapInt32(fs.bs.xxFATxx.exFAT.rootdir_cluster), 0, 0, (const char(*)[MAX_PATH_LEN+1]) "/") == -1) {
+		if (sortExFATClusterChain(fs, SwapInt32(fs->bs.xxFATxx.exFAT.rootdir_cluster), 0, 0, (const char(*)[MAX_PATH_LEN+1]) "/") == -1) {
 			myerror("Failed to sort first cluster chain!");
-			closeFileSystem(&fs);
+			closeFileSystem(fs);
 			return -1;
 		}
 		break;
 	default:
 		myerror("Failed to get FAT type!");
-		closeFileSystem(&fs);
+		closeFileSystem(fs);
 		return -1;
 	}
 
-	closeFileSystem(&fs);
+	// sync directories that were left pending by the sync policy
+	device_tracephase(fs->device, "sync");
+	if (fs->pendingBytes && syncFileSystem(fs)) {
+		myerror("Failed to sync file system!");
+		closeFileSystem(fs);
+		return -1;
+	}
+
+	// all directories are sorted, so nothing is left to resume
+	if (fs->checkpoint != NULL) {
+		checkpoint_close(fs->checkpoint, 1);
+		fs->checkpoint=NULL;
+	}
+
+	if (OPT_FRAGMENTATION) frag_print(fs->fragmentation, fs->clusterSize);
+
+	if (!OPT_LIST && OPT_DRY_RUN) {
+		infomsg("\n%" PRIu64 " bytes of directory data written, %" PRIu64 " bytes unchanged and skipped.\n",
+			fs->bytesWritten, fs->bytesSkipped);
+	} else if (!OPT_LIST) {
+		// staged units and direct i/o may write more than the directory data
+		struct sDeviceStats stats;
+		device_stats(fs->device, &stats);
+		infomsg("\n%" PRIu64 " bytes of directory data written (%" PRIu64 " bytes to the media), %" PRIu64 " bytes unchanged and skipped.\n",
+			fs->bytesWritten, stats.mediaBytesWritten, fs->bytesSkipped);
+	}
+
+	if (OPT_DRY_RUN && printDryRunReport(fs)) {
+		closeFileSystem(fs);
+		return -1;
+	}
+
+	if (OPT_MORE_INFO) {
+		uint64_t hits, misses;
+		device_cachestats(fs->device, &hits, &misses);
+		infomsg("\nDevice cache: %" PRIu64 " hits, %" PRIu64 " misses.\n", hits, misses);
+		if (OPT_EMULATE) {
+			infomsg("Emulated device time: %.3f s.\n", device_modeldelay(fs->device) / 1e9);
+		}
+	}
+
+	if (OPT_MORE_INFO || OPT_STATS) {
+		if (!OPT_MORE_INFO) infomsg("\n");
+		printDeviceStats(fs);
+	}
+
+	if (!OPT_LIST && !strncmp(fs->path, DEVICE_RAM_PREFIX, strlen(DEVICE_RAM_PREFIX))) {
+		infomsg("Sorted in memory, the image file was not modified.\n");
+	}
+
+	closeFileSystem(fs);
 
 	return 0;
 }
+
+void *sortPartitionThread(void *arg) {
+/*
+	sorts the file system of a partition job
+*/
+	assert(arg != NULL);
+
+	struct sPartitionJob *job=(struct sPartitionJob *) arg;
+
+	job->result=sortOpenFileSystem(&job->fs);
+
+	return NULL;
+}
+
+int32_t sortPartitions(char *filename) {
+/*
+	sorts the file systems in all FAT partitions of a disk concurrently
+*/
+
+	assert(filename != NULL);
+
+	DEVICE *disk, *view;
+	struct sPartitionTable *table;
+	struct sPartition *p;
+	struct sPartitionJob *jobs;
+	struct sFileSystem fs;
+	uint32_t i, count=0;
+	int32_t ret=0;
+	char size[32];
+
+	if ((disk=openDevice(filename, getSortMode())) == NULL) {
+		myerror("Failed to open device!");
+		return -1;
+	}
+
+	table=malloc(sizeof(struct sPartitionTable));
+	jobs=malloc(sizeof(struct sPartitionJob) * MAX_PARTITIONS);
+	if ((table == NULL) || (jobs == NULL)) {
+		stderror();
+		free(table);
+		free(jobs);
+		device_close(disk);
+		return -1;
+	}
+
+	if (readPartitionTable(disk, table)) {
+		myerror("Failed to read partition table!");
+		free(table);
+		free(jobs);
+		device_close(disk);
+		return -1;
+	}
+
+	if (table->scheme == PARTITION_SCHEME_NONE) {
+		// the device holds a single file system
+		free(table);
+		free(jobs);
+		if (attachFileSystem(disk, filename, &fs)) {
+			myerror("Failed to open file system!");
+			return -1;
+		}
+		return sortOpenFileSystem(&fs);
+	}
+
+	// all views are opened before any of them is set up
+	for (i=0; i<table->count; i++) {
+		p=&table->partitions[i];
+		formatBytes(size, sizeof(size), p->size);
+		if (!isFATPartition(disk, p)) {
+			infomsg("Partition %u (%s at offset %" PRIu64 "): no FAT file system, skipped.\n",
+				p->number, size, (uint64_t) p->offset);
+			continue;
+		}
+		if (((view=device_openview(disk, p->offset, p->size)) == NULL) ||
+				attachFileSystem(view, filename, &jobs[count].fs)) {
+			myerror("Failed to open file system in partition %u!", p->number);
+			ret=-1;
+			continue;
+		}
+		infomsg("Partition %u (%s at offset %" PRIu64 "): FAT file system.\n", p->number, size, (uint64_t) p->offset);
+		jobs[count].number=p->number;
+		jobs[count].result=0;
+		jobs[count].started=0;
+		count++;
+	}
+
+	if (!count && !ret) {
+		myerror("No FAT file system found in %s partition table!", getPartitionSchemeName(table->scheme));
+		ret=-1;
+	}
+
+	if (OPT_LIST || (count == 1)) {
+		// listings of several partitions would be mixed up, so they are printed one after another
+		for (i=0; i<count; i++) {
+			infomsg("\nPartition %u:\n", jobs[i].number);
+			jobs[i].result=sortOpenFileSystem(&jobs[i].fs);
+		}
+	} else if (count) {
+		// partitions are independent, so each one is sorted by its own thread,
+		// signals are held as they would terminate all threads, not only the interrupted one
+		infomsg("\nSorting %u partitions concurrently.\n", count);
+		hold_signals();
+		for (i=0; i<count; i++) {
+			if (!pthread_create(&jobs[i].thread, NULL, sortPartitionThread, &jobs[i])) {
+				jobs[i].started=1;
+			} else {
+				myerror("Failed to create thread, sorting partition %u sequentially!", jobs[i].number);
+			}
+		}
+		for (i=0; i<count; i++) {
+			if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+			else sortPartitionThread(&jobs[i]);
+		}
+		release_signals();
+	}
+
+	for (i=0; i<count; i++) {
+		if (jobs[i].result) {
+			myerror("Failed to sort partition %u!", jobs[i].number);
+			ret=-1;
+		}
+	}
+
+	free(table);
+	free(jobs);
+	device_close(disk);
+
+	return ret;
+}
+
+int32_t sortFileSystem(char *filename) {
+/*
+	sort FAT file system
+*/
+
+	assert(filename != NULL);
+
+	struct sFileSystem fs;
+
+	if (OPT_ALL_PARTITIONS) return sortPartitions(filename);
+
+	if (openFileSystem(filename, OPT_PARTITION, getSortMode(), &fs)) {
+		myerror("Failed to open file system!");
+		return -1;
+	}
+
+	return sortOpenFileSystem(&fs);
+}
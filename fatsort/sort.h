@@ -28,8 +28,39 @@
 #include <stdint.h>
 #include "FAT_fs.h"
 #include "clusterchain.h"
+#include "entrylist.h"
 
-// sorts FAT file system
+// configures backend and cache of the device according to the options
+int32_t setupDevice(struct sFileSystem *fs);
+
+// pushes a directory onto the checkpoint stack, resumed is set if it was sorted by an interrupted run
+int32_t enterDirectory(struct sFileSystem *fs, uint32_t cluster, uint32_t *resumed);
+
+// pops a finished directory from the checkpoint stack and saves the checkpoint from time to time
+int32_t leaveDirectory(struct sFileSystem *fs);
+
+// syncs the file system after a directory has been written according to the sync policy
+int32_t syncDirectory(struct sFileSystem *fs);
+
+// prints which sectors a dry run would have written
+int32_t printDryRunReport(struct sFileSystem *fs);
+
+// prints the i/o counters and the seek distance histogram of the device
+void printDeviceStats(struct sFileSystem *fs);
+
+// gets the mode file systems are opened with according to the options
+uint32_t getSortMode(void);
+
+// sorts an opened FAT file system and closes it
+int32_t sortOpenFileSystem(struct sFileSystem *fs);
+
+// sorts the file system of a partition job in its own thread
+void *sortPartitionThread(void *arg);
+
+// sorts the file systems in all FAT partitions of a disk concurrently
+int32_t sortPartitions(char *filename);
+
+// sorts FAT file system, or all partitions with option -P
 int32_t sortFileSystem(char *filename);
 
 // sorts the root directory of a FAT12 or FAT16 file system
@@ -41,6 +72,12 @@ int32_t sortClusterChain(struct sFileSystem *fs, uint32_t cluster, const char (*
 // returns cluster chain for a given start cluster
 int32_t getClusterChain(struct sFileSystem *fs, uint32_t startCluster, struct sClusterChain *chain);
 
+// adds the extents of all files in a directory to the fragmentation report
+int32_t addFragmentation(struct sFileSystem *fs, struct sDirEntryList *list, const char (*path)[MAX_PATH_LEN+1]);
+
+// adds the extents of all files in an exFAT directory to the fragmentation report
+int32_t addExFATFragmentation(struct sFileSystem *fs, struct sExFATDirEntrySetList *desl, const char (*path)[MAX_PATH_LEN+1]);
+
 // sorts exFAT directory entries in a cluster
 int32_t sortExFATClusterChain(struct sFileSystem *fs, uint32_t cluster, uint32_t len, uint16_t isContigous, const char (*path)[MAX_PATH_LEN+1]);
 